@@ -0,0 +1,768 @@
+#pragma once
+
+#include <getopt.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+#include <iostream>
+#include <fstream>
+#include <thread>
+
+#include "tscns.h"
+#include "omp.h"
+#include "tbb/parallel_sort.h"
+#include "flags.h"
+#include "utils.h"
+#include "workload.h"
+#include "histogram.h"
+
+#include "../core/lipp.h"
+
+#if LIPP_NUMA
+#include <numa.h>
+#endif
+
+/// s as a JSON string literal
+inline std::string json_string(const std::string &s) {
+    std::string out = "\"";
+    for (char c : s) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", c);
+            out += buf;
+        } else {
+            out += c;
+        }
+    }
+    return out + "\"";
+}
+
+template<typename KEY_TYPE, typename PAYLOAD_TYPE, bool USE_FMCD = true>
+class Benchmark {
+    static constexpr size_t OP_CHUNK = 256; // ops a thread draws at once
+
+    /// a drawn op with its key looked up in keys, 0 for inserts past the end
+    struct DrawnOp {
+        WorkloadGenerator::Op op;
+        KEY_TYPE key;
+    };
+
+    typedef LIPP<KEY_TYPE, PAYLOAD_TYPE, USE_FMCD> index_t;
+    std::unique_ptr<index_t> index; // made in load_keys, from the index config flags
+
+    // parameters
+    WorkloadSpec workload;
+    bool append = false;
+    size_t operations_num;
+    long long int table_size = -1;
+    size_t init_table_size;
+    double init_table_ratio;
+    size_t thread_num = 1;
+    size_t batch_size = 1;
+    bool background_reclaim = false;
+    std::string keys_file_path;
+    std::string keys_file_type;
+    bool latency_sample = false;
+    double latency_sample_ratio = 0.01;
+    bool timeline = false; // throughput and p99 per second of the run
+    bool print_metrics = false; // the index's runtime counters after the run
+    bool numa = false; // pin threads by NUMA node and give each node its own key range
+    bool root_cache = false; // route past the root through the index's root cache
+    bool htm = false; // elide insert locks with RTM transactions where the CPU has them
+    // index config
+    double build_lr_remain = 0;
+    size_t two_pool_warmup = 1 << 16; // two-key nodes the pool reserves up front
+    std::string perf_events; // perf stat events counted over the run, none if empty
+    std::string json_path; // a JSON record of the run is appended here, one per line
+    std::string output_path;
+    std::string index_file_path;
+    size_t random_seed;
+
+    std::vector <KEY_TYPE> init_keys;
+    KEY_TYPE *keys;
+    std::pair <KEY_TYPE, PAYLOAD_TYPE> *init_key_values;
+
+    // The threads on one NUMA node and the keys they work on. --numa makes
+    // one per node with CPUs (up to thread_num), keys split by range, else
+    // there is one holding every key.
+    struct alignas(CACHELINE_SIZE) Socket {
+        int numa_node = 0;
+        std::vector<int> cpus; // threads are pinned to these in turn, none if empty
+        KeyRange keys;
+        std::atomic<size_t> next_insert{0}; // index of the next key to insert in keys
+    };
+    std::vector<std::unique_ptr<Socket>> sockets;
+    std::vector<KEY_TYPE> socket_boundaries; // first key of every socket but the first
+    std::mt19937 gen;
+
+    // latencies are kept per op type, whole batches in the last row
+    static constexpr int BATCH = NUM_OPERATIONS;
+
+    struct Stat {
+        std::vector<LatencyHistogram> latency; // in ticks
+        std::vector<uint64_t> timeline_ops;
+        std::vector<LatencyHistogram> timeline_latency;
+        double ns_per_tick = 1;
+        double duration_ns = 0;
+        uint64_t throughput = 0;
+        std::vector<uint64_t> socket_throughput;
+        uint64_t ops = 0; // done, fewer than operations_num if inserts ran out of keys
+        double bulk_load_ns = 0; // bulk load, or opening the saved image
+        size_t index_bytes = 0; // index_size() of nodes and slots after the run
+        std::vector<std::pair<std::string, double>> perf; // counted events and their values
+    } stat;
+
+    struct alignas(CACHELINE_SIZE)
+    ThreadParam {
+        std::vector<LatencyHistogram> latency = std::vector<LatencyHistogram>(BATCH + 1);
+        // timeline mode, per second since the thread started: the ops done
+        // and the latencies sampled in it
+        std::vector<uint64_t> timeline_ops;
+        std::vector<LatencyHistogram> timeline_latency;
+        size_t timeline_done = 0; // ops done when the last one was counted
+        size_t ops = 0;
+    };
+    typedef ThreadParam param_t;
+
+public:
+    Benchmark() {}
+
+    void load_keys() {
+        // Read keys from file
+        // COUT_THIS("Loading keys from file.");
+
+        if (keys_file_type == "binary") {
+            // mapped in place, the sort and shuffle below only copy the pages they write
+            table_size = map_binary_data(keys, table_size, keys_file_path);
+            if (table_size <= 0) {
+                COUT_THIS("Could not open key file, please check the path of key file.");
+                exit(1);
+            }
+        } else if (keys_file_type == "text") {
+            table_size = parse_text_data(keys, table_size, keys_file_path, thread_num);
+            if (table_size < 0) {
+                exit(1); // a line that isn't a key, reported by parse_text_data
+            }
+            if (table_size == 0) {
+                COUT_THIS("Could not open key file, please check the path of key file.");
+                exit(1);
+            }
+        } else {
+            COUT_THIS("Could not open key file, please check the path of key file.");
+            exit(1);
+        }
+        // SOSD files are sorted already, the shuffle only needs sorted input
+        // to be reproducible for a seed
+        if (!is_sorted_parallel(keys, table_size, thread_num)) {
+            tbb::parallel_sort(keys, keys + table_size);
+        }
+        // appends load the smallest keys and insert the rest in order
+        if (!append) {
+            std::shuffle(keys, keys + table_size, gen);
+        }
+
+        init_table_size = init_table_ratio * table_size;
+
+        init_keys.resize(init_table_size);
+#pragma omp parallel for num_threads(thread_num)
+        for (size_t i = 0; i < init_table_size; ++i) {
+            init_keys[i] = (keys[i]);
+        }
+        tbb::parallel_sort(init_keys.begin(), init_keys.end());
+
+        init_key_values = new std::pair<KEY_TYPE, PAYLOAD_TYPE>[init_keys.size()];
+#pragma omp parallel for num_threads(thread_num)
+        for (long unsigned int i = 0; i < init_keys.size(); i++) {
+            init_key_values[i].first = init_keys[i];
+            init_key_values[i].second = init_keys[i];
+        }
+
+        setup_sockets();
+
+        index.reset(new index_t(build_lr_remain, true, two_pool_warmup));
+        // an image saved by an earlier run with the same keys and config
+        // replaces the bulk load, any other is rebuilt and saved over
+        const auto load_start = std::chrono::steady_clock::now();
+        const uint64_t fingerprint = index_file_path.empty() ? 0 : image_fingerprint();
+        if (index_file_path.empty() || !index->open_mmap(index_file_path.c_str(), fingerprint)) {
+            // COUT_THIS("Bulk loading.");
+            index->bulk_load(init_key_values, init_keys.size());
+            if (!index_file_path.empty() && !index->save(index_file_path.c_str(), fingerprint)) {
+                COUT_THIS("Could not save the index to " << index_file_path);
+            }
+        }
+        stat.bulk_load_ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - load_start).count();
+        if (numa) {
+            // the root is read by every lookup, the subtrees below go to the
+            // node whose threads work on their keys
+            std::vector<int> numa_nodes;
+            for (auto &socket : sockets) {
+                numa_nodes.push_back(socket->numa_node);
+            }
+            const size_t pages = index->place_numa(1, socket_boundaries, numa_nodes);
+            COUT_THIS("NUMA: " << sockets.size() << " nodes, " << pages << " index pages placed");
+        }
+        if (root_cache) {
+            index->enable_root_cache(true);
+        }
+        if (htm && !index->enable_htm(true)) {
+            COUT_THIS("HTM: no RTM in this build or CPU, inserts lock");
+        }
+    }
+
+    static uint64_t mix(uint64_t x) {
+        x += 0x9e3779b97f4a7c15ull;
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+        return x ^ (x >> 31);
+    }
+
+    /// what an --index_file image must have been saved with: a hash of the
+    /// loaded keys, which covers the keys file, table_size, init_table_ratio,
+    /// seed and append, and of the config the tree's shape depends on
+    uint64_t image_fingerprint() const {
+        uint64_t keys_hash = 0;
+#pragma omp parallel for num_threads(thread_num) reduction(+:keys_hash)
+        for (size_t i = 0; i < init_keys.size(); i++) {
+            keys_hash += mix(static_cast<uint64_t>(init_keys[i]) ^ mix(i));
+        }
+        uint64_t ratio_bits;
+        memcpy(&ratio_bits, &init_table_ratio, sizeof(ratio_bits));
+        uint64_t lr_bits;
+        memcpy(&lr_bits, &build_lr_remain, sizeof(lr_bits));
+        uint64_t h = mix(keys_hash);
+        for (uint64_t x : {static_cast<uint64_t>(table_size), ratio_bits, static_cast<uint64_t>(random_seed),
+                           static_cast<uint64_t>(append), static_cast<uint64_t>(USE_FMCD), lr_bits}) {
+            h = mix(h ^ x);
+        }
+        return h;
+    }
+
+    /// NUMA nodes with CPUs, and their CPUs
+    static std::vector<std::pair<int, std::vector<int>>> numa_topology() {
+        std::vector<std::pair<int, std::vector<int>>> nodes;
+#if LIPP_NUMA
+        if (numa_available() < 0) return nodes;
+        struct bitmask *mask = numa_allocate_cpumask();
+        for (int n = 0; n <= numa_max_node(); n++) {
+            if (numa_node_to_cpus(n, mask) < 0) continue;
+            std::vector<int> cpus;
+            for (unsigned int cpu = 0; cpu < mask->size; cpu++) {
+                if (numa_bitmask_isbitset(mask, cpu)) cpus.push_back(cpu);
+            }
+            if (!cpus.empty()) nodes.emplace_back(n, std::move(cpus));
+        }
+        numa_free_cpumask(mask);
+#endif
+        return nodes;
+    }
+
+    /// fill sockets, under --numa reorder keys so the loaded keys and the
+    /// keys to insert of each socket are contiguous, by key range
+    void setup_sockets() {
+        std::vector<std::pair<int, std::vector<int>>> nodes(1);
+        if (numa) {
+            nodes = numa_topology();
+            if (nodes.empty()) {
+                COUT_THIS("NUMA mode needs libnuma and a kernel with NUMA support.");
+                exit(1);
+            }
+            nodes.resize(std::min(nodes.size(), thread_num));
+            INVARIANT(init_table_size >= nodes.size());
+        }
+        for (auto &node : nodes) {
+            sockets.emplace_back(new Socket());
+            sockets.back()->numa_node = node.first;
+            sockets.back()->cpus = node.second;
+        }
+        for (size_t i = 1; i < sockets.size(); i++) {
+            socket_boundaries.push_back(init_keys[i * init_keys.size() / sockets.size()]);
+        }
+        // groups keys [begin, end) by socket, keeping their order within it
+        auto split = [&](size_t begin, size_t end, size_t KeyRange::*first, size_t KeyRange::*last) {
+            std::vector<uint8_t> owner(end - begin);
+            std::vector<size_t> start(sockets.size() + 1, 0);
+            for (size_t i = begin; i < end; i++) {
+                owner[i - begin] = std::upper_bound(socket_boundaries.begin(), socket_boundaries.end(), keys[i]) -
+                                   socket_boundaries.begin();
+                start[owner[i - begin] + 1]++;
+            }
+            for (size_t i = 0; i < sockets.size(); i++) {
+                start[i + 1] += start[i];
+                sockets[i]->keys.*first = begin + start[i];
+                sockets[i]->keys.*last = begin + start[i + 1];
+            }
+            if (sockets.size() == 1) return;
+            std::vector<KEY_TYPE> grouped(end - begin);
+            for (size_t i = begin; i < end; i++) {
+                grouped[start[owner[i - begin]]++] = keys[i];
+            }
+            std::copy(grouped.begin(), grouped.end(), keys + begin);
+        };
+        split(0, init_table_size, &KeyRange::loaded_begin, &KeyRange::loaded_end);
+        split(init_table_size, table_size, &KeyRange::insert_begin, &KeyRange::insert_end);
+        for (auto &socket : sockets) {
+            socket->keys.next_insert = &socket->next_insert;
+        }
+    }
+
+    /// socket of thread_id, threads are spread over them in even blocks
+    size_t thread_socket(size_t thread_id) const {
+        return thread_id * sockets.size() / thread_num;
+    }
+
+    inline void parse_args(int argc, char **argv) {
+        auto flags = parse_flags(argc, argv);
+        keys_file_path = get_required(flags, "keys_file");
+        keys_file_type = get_with_default(flags, "keys_file_type", "binary");
+        // --workload=a..f runs a YCSB core workload, else the ratios give the mix
+        const std::string workload_name = get_with_default(flags, "workload", "");
+        if (!workload_name.empty()) {
+            INVARIANT(workload.set_ycsb(workload_name));
+        } else {
+            workload.ratio[READ] = stod(get_required(flags, "read"));
+            workload.ratio[INSERT] = stod(get_with_default(flags, "insert", "0"));
+            workload.ratio[UPDATE] = stod(get_with_default(flags, "update", "0"));
+            workload.ratio[DELETE] = stod(get_with_default(flags, "delete", "0"));
+            workload.ratio[SCAN] = stod(get_with_default(flags, "scan", "0"));
+            workload.ratio[READ_MODIFY_WRITE] = stod(get_with_default(flags, "rmw", "0"));
+        }
+        workload.request_distribution = get_with_default(flags, "sample_distribution", workload.request_distribution);
+        workload.max_scan_length = stoul(get_with_default(flags, "scan_length", std::to_string(workload.max_scan_length)));
+        workload.scan_length_distribution = get_with_default(flags, "scan_length_distribution",
+                                                             workload.scan_length_distribution);
+        append = get_boolean_flag(flags, "append");
+        operations_num = stoul(get_with_default(flags, "operations_num", "800000000"));
+        table_size = stoi(get_with_default(flags, "table_size", "-1"));
+        init_table_ratio = stod(get_with_default(flags, "init_table_ratio", "0.5"));
+        init_table_size = -1;
+        latency_sample = get_boolean_flag(flags, "latency_sample");
+        latency_sample_ratio = stod(get_with_default(flags, "latency_sample_ratio", "0.01"));
+        // the timeline needs the sampled latencies
+        timeline = get_boolean_flag(flags, "timeline");
+        latency_sample = latency_sample || timeline;
+        print_metrics = get_boolean_flag(flags, "metrics");
+        numa = get_boolean_flag(flags, "numa");
+        root_cache = get_boolean_flag(flags, "root_cache");
+        htm = get_boolean_flag(flags, "htm");
+        build_lr_remain = stod(get_with_default(flags, "build_lr_remain", "0"));
+        two_pool_warmup = stoul(get_with_default(flags, "two_pool_warmup", std::to_string(two_pool_warmup)));
+        perf_events = get_with_default(flags, "perf_events", "");
+        json_path = get_with_default(flags, "json_path", "");
+        output_path = get_with_default(flags, "output_path", "./result");
+        index_file_path = get_with_default(flags, "index_file", "");
+        random_seed = stoul(get_with_default(flags, "seed", "1866"));
+        thread_num = stoi(get_with_default(flags, "thread_num", "1"));
+        batch_size = stoi(get_with_default(flags, "batch_size", "1"));
+        background_reclaim = get_boolean_flag(flags, "background_reclaim");
+        gen.seed(random_seed);
+
+        double ratio_sum = workload.ratio_sum();
+        INVARIANT(ratio_sum > 0.9999 && ratio_sum < 1.0001);  // avoid precision lost
+        INVARIANT(workload.request_distribution == "zipf" || workload.request_distribution == "uniform" ||
+                  workload.request_distribution == "latest");
+        INVARIANT(workload.scan_length_distribution == "zipf" || workload.scan_length_distribution == "uniform");
+        INVARIANT(workload.max_scan_length >= 1);
+        INVARIANT(batch_size >= 1);
+        INVARIANT(latency_sample_ratio > 0 && latency_sample_ratio <= 1);
+        INVARIANT(build_lr_remain >= 0 && build_lr_remain <= 1);
+        // appends all land past the last loaded key, in the last node's range
+        INVARIANT(!(numa && append));
+    }
+
+    /// ops are drawn while running, see WorkloadGenerator; this only sets
+    /// where inserts start
+    void generate_operations() {
+        for (auto &socket : sockets) {
+            socket->next_insert = socket->keys.insert_begin;
+        }
+    }
+
+    /// run op against the index, false if it is an insert past the last key
+    inline bool run_op(const DrawnOp &drawn, bool check_reads, PAYLOAD_TYPE &sink) {
+        const WorkloadGenerator::Op &op = drawn.op;
+        const KEY_TYPE key = drawn.key;
+        if (op.op == INSERT) {
+            if (op.key_index == WorkloadGenerator::NO_KEY) return false;
+            index->insert(key, key);
+            return true;
+        }
+        if (op.op == READ) {  // get
+            sink += index->at(key, !check_reads);
+        } else if (op.op == UPDATE) {  // update
+            index->update(key, key);
+        } else if (op.op == DELETE) {  // delete
+            index->erase(key);
+        } else if (op.op == SCAN) {
+            size_t num = 0;
+            index->range_scan(key, std::numeric_limits<KEY_TYPE>::max(), [&](const KEY_TYPE &, const PAYLOAD_TYPE &value) {
+                sink += value;
+                return ++num < op.scan_length;
+            });
+        } else if (op.op == READ_MODIFY_WRITE) {
+            index->update(key, index->at(key, !check_reads) + 1);
+        }
+        return true;
+    }
+
+    void run() {
+        std::thread *thread_array = new std::thread[thread_num];
+        param_t params[thread_num];
+        TSCNS tn;
+        tn.init();
+        if (background_reclaim) {
+            index->ebr->startBackgroundReclaimer();
+        }
+        // reads may miss once keys are deleted or picked among inserts in flight
+        const bool check_reads = workload.ratio[DELETE] == 0 && workload.request_distribution != "latest";
+        std::atomic<size_t> ops_done(0);
+        std::atomic<bool> keys_exhausted(false);
+        PAYLOAD_TYPE sink = 0;
+        // printf("Begin running\n");
+        auto start_time = tn.rdtsc();
+        auto end_time = tn.rdtsc();
+        auto body = [&]() {
+#pragma omp parallel num_threads(thread_num) reduction(+:sink)
+        {
+            // thread specifier
+            auto thread_id = omp_get_thread_num();
+            const size_t socket_id = thread_socket(thread_id);
+            Socket &socket = *sockets[socket_id];
+            if (!socket.cpus.empty()) {
+                size_t first = thread_id;
+                while (first > 0 && thread_socket(first - 1) == socket_id) first--;
+                cpu_set_t cpus;
+                CPU_ZERO(&cpus);
+                CPU_SET(socket.cpus[(thread_id - first) % socket.cpus.size()], &cpus);
+                sched_setaffinity(0, sizeof(cpus), &cpus);
+            }
+            WorkloadGenerator generator(workload, socket.keys, random_seed + thread_id);
+            const size_t thread_ops = operations_num / thread_num + (static_cast<size_t>(thread_id) < operations_num % thread_num);
+            // ops are drawn a chunk at a time and then run, so the lookups
+            // aren't held up behind the generator's RNG chain and their keys
+            // come in order rather than from random spots in keys
+            std::vector<DrawnOp> chunk(OP_CHUNK);
+            size_t chunk_pos = 0, chunk_end = 0, drawn = 0;
+            auto next_op = [&]() -> const DrawnOp & {
+                if (chunk_pos == chunk_end) {
+                    chunk_end = std::min(OP_CHUNK, thread_ops - drawn);
+                    for (size_t i = 0; i < chunk_end; i++) chunk[i].op = generator.next();
+                    // a pass of its own keeps many of the loads in flight
+                    for (size_t i = 0; i < chunk_end; i++) {
+                        chunk[i].key = chunk[i].op.key_index != WorkloadGenerator::NO_KEY ? keys[chunk[i].op.key_index] : 0;
+                    }
+                    drawn += chunk_end;
+                    chunk_pos = 0;
+                }
+                return chunk[chunk_pos++];
+            };
+            size_t done = 0;
+            // Latency Sample Variable
+            int latency_sample_interval = operations_num / (operations_num * latency_sample_ratio);
+            auto latency_sample_start_time = tn.rdtsc();
+            auto latency_sample_end_time = tn.rdtsc();
+            param_t &thread_param = params[thread_id];
+            int64_t thread_start_time = 0;
+            // files a sampled latency under row, and in timeline mode counts
+            // the ops done since the last sample in the current second
+            auto record_latency = [&](int row, int64_t begin, int64_t end) {
+                thread_param.latency[row].record(end - begin);
+                if (!timeline) return;
+                const size_t second = static_cast<size_t>((end - thread_start_time) * tn.tsc_ghz_inv / 1e9);
+                if (second >= thread_param.timeline_ops.size()) {
+                    thread_param.timeline_ops.resize(second + 1, 0);
+                    thread_param.timeline_latency.resize(second + 1);
+                }
+                thread_param.timeline_ops[second] += done - thread_param.timeline_done;
+                thread_param.timeline_done = done;
+                thread_param.timeline_latency[second].record(end - begin);
+            };
+            // waiting all thread ready
+#pragma omp barrier
+#pragma omp master
+            start_time = tn.rdtsc();
+            thread_start_time = tn.rdtsc();
+// running benchmark
+            if (batch_size > 1) {
+                // reads are gathered and resolved with at_batch, the rest run as they come
+                std::vector<KEY_TYPE> read_keys(batch_size);
+                std::vector<PAYLOAD_TYPE> read_values(batch_size);
+                for (size_t b = 0; b < thread_ops && !keys_exhausted.load(std::memory_order_relaxed); b += batch_size) {
+                    const size_t b_end = std::min(thread_ops, b + batch_size);
+                    // the batch is sampled when it holds an op the per-op loop would sample
+                    bool sampled = latency_sample &&
+                        (b + latency_sample_interval - 1) / latency_sample_interval * latency_sample_interval < b_end;
+                    if (sampled)
+                        latency_sample_start_time = tn.rdtsc();
+
+                    // one epoch entry for the whole batch
+                    typename index_t::EpochBatch epochs;
+                    size_t read_num = 0;
+                    for (size_t i = b; i < b_end; i++) {
+                        const DrawnOp &op = next_op();
+                        if (op.op.op == READ) {
+                            read_keys[read_num++] = op.key;
+                        } else if (!run_op(op, check_reads, sink)) {
+                            keys_exhausted = true;
+                            break;
+                        }
+                        done++;
+                    }
+                    index->at_batch(read_keys.data(), read_values.data(), read_num, !check_reads);
+                    for (size_t i = 0; i < read_num; i++) {
+                        sink += read_values[i];
+                    }
+
+                    if (sampled) {
+                        latency_sample_end_time = tn.rdtsc();
+                        record_latency(BATCH, latency_sample_start_time, latency_sample_end_time);
+                    }
+                }
+            } else {
+                for (size_t i = 0; i < thread_ops; i++) {
+                    const DrawnOp &op = next_op();
+
+                    if (latency_sample && i % latency_sample_interval == 0)
+                        latency_sample_start_time = tn.rdtsc();
+
+                    if (!run_op(op, check_reads, sink) || keys_exhausted.load(std::memory_order_relaxed)) {
+                        keys_exhausted = true;
+                        break;
+                    }
+                    done++;
+
+                    if (latency_sample && i % latency_sample_interval == 0) {
+                        latency_sample_end_time = tn.rdtsc();
+                        record_latency(op.op.op, latency_sample_start_time, latency_sample_end_time);
+                    }
+                }
+            }
+            ops_done += done;
+            thread_param.ops = done;
+            if (timeline && !thread_param.timeline_ops.empty()) {
+                thread_param.timeline_ops.back() += done - thread_param.timeline_done;
+            }
+#pragma omp barrier
+#pragma omp master
+            end_time = tn.rdtsc();
+        } // all thread join here
+
+        };
+        if (perf_events.empty()) {
+            body();
+        } else {
+            char perf_path[] = "/tmp/lipp_perf_XXXXXX";
+            const int fd = mkstemp(perf_path);
+            INVARIANT(fd >= 0);
+            close(fd);
+            System::profile_stat(perf_path, perf_events, body);
+            stat.perf = System::read_perf_stat(perf_path);
+            unlink(perf_path);
+            if (stat.perf.empty()) {
+                COUT_THIS("perf stat counted nothing, is perf installed and perf_event_paranoid low enough?");
+            }
+        }
+        auto diff = tn.tsc2ns(end_time) - tn.tsc2ns(start_time);
+        // printf("Finish running\n");
+
+        // gather thread local variable
+        stat.latency.assign(BATCH + 1, LatencyHistogram());
+        stat.ns_per_tick = tn.tsc_ghz_inv;
+        stat.duration_ns = diff;
+        for (auto &p: params) {
+            for (int i = 0; i <= BATCH; i++) {
+                stat.latency[i].merge(p.latency[i]);
+            }
+            if (p.timeline_ops.size() > stat.timeline_ops.size()) {
+                stat.timeline_ops.resize(p.timeline_ops.size(), 0);
+                stat.timeline_latency.resize(p.timeline_ops.size());
+            }
+            for (size_t i = 0; i < p.timeline_ops.size(); i++) {
+                stat.timeline_ops[i] += p.timeline_ops[i];
+                stat.timeline_latency[i].merge(p.timeline_latency[i]);
+            }
+        }
+        // calculate throughput
+        if (keys_exhausted) {
+            COUT_THIS("Inserts ran out of keys after " << ops_done << " operations");
+        }
+        stat.ops = ops_done;
+        stat.throughput = static_cast<uint64_t>(ops_done / (diff/(double) 1000000000));
+        stat.index_bytes = index->index_size(true, false);
+        stat.socket_throughput.assign(sockets.size(), 0);
+        for (size_t i = 0; i < thread_num; i++) {
+            stat.socket_throughput[thread_socket(i)] += static_cast<uint64_t>(params[i].ops / (diff/(double) 1000000000));
+        }
+        print_stat();
+        if (print_metrics) {
+            print_index_metrics();
+        }
+
+        delete[] thread_array;
+    }
+
+    /// one row of the latency table, in ns
+    void print_latency(const char *name, const LatencyHistogram &h) {
+        const double t = stat.ns_per_tick;
+        printf("%s\t%lu\t%.0f\t%.0f\t%.0f\t%.0f\t%.0f\t%.0f\t%.0f\t%.0f\n", name, h.count(),
+               h.mean() * t, std::sqrt(h.variance()) * t, h.percentile(50) * t, h.percentile(90) * t,
+               h.percentile(99) * t, h.percentile(99.9) * t, h.percentile(99.99) * t, h.max() * t);
+    }
+
+    void print_index_metrics() {
+        const typename index_t::Metrics m = index->metrics();
+        printf("Read restarts: local %lu parent %lu root %lu\n", m.read_restarts.local, m.read_restarts.parent,
+               m.read_restarts.root);
+        printf("Insert restarts: root_lock %lu root_grow %lu parent_unlock %lu slot_lock %lu child_check %lu child_lock %lu\n",
+               m.insert_restarts[index_t::INSERT_ROOT_LOCK], m.insert_restarts[index_t::INSERT_ROOT_GROW],
+               m.insert_restarts[index_t::INSERT_PARENT_UNLOCK], m.insert_restarts[index_t::INSERT_SLOT_LOCK],
+               m.insert_restarts[index_t::INSERT_CHILD_CHECK], m.insert_restarts[index_t::INSERT_CHILD_LOCK]);
+        printf("Adjust restarts: node_lock %lu node_unlock %lu local_switch %lu rebuild %lu\n",
+               m.adjust_restarts[index_t::ADJUST_NODE_LOCK], m.adjust_restarts[index_t::ADJUST_NODE_UNLOCK],
+               m.adjust_restarts[index_t::ADJUST_LOCAL_SWITCH], m.adjust_restarts[index_t::ADJUST_REBUILD]);
+        printf("Rebuilds: %lld (local %lld) keys %lld, FMCD success %lld broken %lld\n", m.rebuilds.rebuilds,
+               m.rebuilds.local_rebuilds, m.rebuilds.keys, m.fmcd_success, m.fmcd_broken);
+        printf("Depth: avg %.2f max %d over %lu samples\n", m.avg_depth, m.max_depth, m.depth_samples);
+        printf("Pool: %lu allocations, hit rate %.4f, %lu batch and %lu slab refills\n", m.pool.allocations,
+               m.pool_hit_rate, m.pool.batch_refills, m.pool.slab_refills);
+        printf("EBR: epoch %lu lag %lu, %zu bytes in %zu objects pending, %zu freed\n", m.reclamation.epoch,
+               m.reclamation.epoch_lag, m.reclamation.pending_bytes, m.reclamation.pending_objects,
+               m.reclamation.freed_bytes);
+        printf("Root cache: %lu builds, %lu misses\n", m.root_cache_builds, m.root_cache_misses);
+        printf("HTM: %lu commits, %lu fallbacks, aborts conflict %lu capacity %lu locked %lu other %lu\n",
+               m.htm_commits, m.htm_fallbacks, m.htm_aborts[index_t::HTM_ABORT_CONFLICT],
+               m.htm_aborts[index_t::HTM_ABORT_CAPACITY], m.htm_aborts[index_t::HTM_ABORT_LOCKED],
+               m.htm_aborts[index_t::HTM_ABORT_OTHER]);
+    }
+
+    void print_stat(bool header = false) {
+        LatencyHistogram all;
+        for (auto &h : stat.latency) all.merge(h);
+        const double t = stat.ns_per_tick;
+
+        printf("Thread: %zu\tThroughput: %lu\n", thread_num, stat.throughput);
+        if (numa) {
+            for (size_t i = 0; i < sockets.size(); i++) {
+                printf("NUMA node: %d\tThroughput: %lu\n", sockets[i]->numa_node, stat.socket_throughput[i]);
+            }
+        }
+        if (latency_sample) {
+            printf("Latency(ns)\tcount\tavg\tstddev\tp50\tp90\tp99\tp99.9\tp99.99\tmax\n");
+            for (int i = 0; i <= BATCH; i++) {
+                if (stat.latency[i].count()) {
+                    print_latency(i == BATCH ? "BATCH" : operation_name(static_cast<Operation>(i)), stat.latency[i]);
+                }
+            }
+            print_latency("ALL", all);
+        }
+        for (size_t i = 0; i < stat.timeline_ops.size(); i++) {
+            // the last second may be cut short
+            const double seconds = std::min(1.0, stat.duration_ns / 1e9 - i);
+            printf("Second: %zu\tThroughput: %.0f\tP99: %.0f\n", i, stat.timeline_ops[i] / std::max(seconds, 1e-3),
+                   stat.timeline_latency[i].percentile(99) * t);
+        }
+
+        if (!file_exists(output_path)) {
+            std::ofstream ofile;
+            ofile.open(output_path, std::ios::app);
+            ofile << "key_path" << ",";
+            ofile << "throughput" << ",";
+            ofile << "thread_num" << ",";
+            // over all sampled ops in ns, 0 without --latency_sample
+            ofile << "avg_latency,p50_latency,p90_latency,p99_latency,p999_latency,p9999_latency,max_latency" << std::endl;
+        }
+
+        std::ofstream ofile;
+        ofile.open(output_path, std::ios::app);
+        ofile << keys_file_path << ",";
+        ofile << stat.throughput << ",";
+        ofile << thread_num << ",";
+        auto ns = [&](double ticks) { return static_cast<uint64_t>(ticks * t); };
+        ofile << ns(all.mean()) << "," << ns(all.percentile(50)) << "," << ns(all.percentile(90)) << ","
+              << ns(all.percentile(99)) << "," << ns(all.percentile(99.9)) << "," << ns(all.percentile(99.99)) << ","
+              << ns(all.max()) << std::endl;
+        ofile.close();
+
+        if (!json_path.empty()) {
+            std::ofstream jfile(json_path, std::ios::app);
+            jfile << json_record() << std::endl;
+        }
+    }
+
+    /// the run's config and results as one JSON object on one line, times
+    /// in ns, latencies over the sampled ops by op type and over all of them
+    std::string json_record() const {
+        const double t = stat.ns_per_tick;
+        std::ostringstream o;
+        o.precision(15);
+        o << "{\"keys_file\":" << json_string(keys_file_path) << ",\"table_size\":" << table_size
+          << ",\"init_table_size\":" << init_table_size << ",\"thread_num\":" << thread_num
+          << ",\"operations_num\":" << operations_num << ",\"batch_size\":" << batch_size << ",\"seed\":" << random_seed;
+        o << ",\"workload\":{";
+        for (int i = 0; i < NUM_OPERATIONS; i++) {
+            o << (i ? "," : "") << json_string(operation_name(static_cast<Operation>(i))) << ":" << workload.ratio[i];
+        }
+        o << "},\"request_distribution\":" << json_string(workload.request_distribution)
+          << ",\"append\":" << (append ? "true" : "false");
+        o << ",\"index\":{\"fmcd\":" << (USE_FMCD ? "true" : "false") << ",\"build_lr_remain\":" << build_lr_remain
+          << ",\"two_pool_warmup\":" << two_pool_warmup << ",\"root_cache\":" << (root_cache ? "true" : "false")
+          << ",\"htm\":" << (htm ? "true" : "false") << "}";
+        o << ",\"ops\":" << stat.ops << ",\"throughput\":" << stat.throughput
+          << ",\"duration_ns\":" << static_cast<uint64_t>(stat.duration_ns)
+          << ",\"bulk_load_ns\":" << static_cast<uint64_t>(stat.bulk_load_ns) << ",\"index_bytes\":" << stat.index_bytes;
+        LatencyHistogram all;
+        for (auto &h : stat.latency) all.merge(h);
+        auto latency = [&](const char *name, const LatencyHistogram &h) {
+            auto ns = [&](double ticks) { return static_cast<uint64_t>(ticks * t); };
+            o << json_string(name) << ":{\"count\":" << h.count() << ",\"avg\":" << ns(h.mean())
+              << ",\"p50\":" << ns(h.percentile(50)) << ",\"p90\":" << ns(h.percentile(90))
+              << ",\"p99\":" << ns(h.percentile(99)) << ",\"p999\":" << ns(h.percentile(99.9))
+              << ",\"p9999\":" << ns(h.percentile(99.99)) << ",\"max\":" << ns(h.max()) << "}";
+        };
+        o << ",\"latency_ns\":{";
+        latency("ALL", all);
+        for (int i = 0; i <= BATCH; i++) {
+            if (stat.latency[i].count()) {
+                o << ",";
+                latency(i == BATCH ? "BATCH" : operation_name(static_cast<Operation>(i)), stat.latency[i]);
+            }
+        }
+        o << "},\"perf\":{";
+        for (size_t i = 0; i < stat.perf.size(); i++) {
+            o << (i ? "," : "") << json_string(stat.perf[i].first) << ":" << stat.perf[i].second;
+        }
+        o << "}}";
+        return o.str();
+    }
+};
+
+/// run the benchmark argv describes, --fmcd=0 builds the index without FMCD
+template<typename KEY_TYPE, typename PAYLOAD_TYPE>
+void run_benchmark(int argc, char **argv) {
+    auto run = [&](auto &bench) {
+        bench.parse_args(argc, argv);
+        bench.load_keys();
+        bench.generate_operations();
+        bench.run();
+    };
+    if (get_with_default(parse_flags(argc, argv), "fmcd", "1") == "0") {
+        Benchmark<KEY_TYPE, PAYLOAD_TYPE, false> bench;
+        run(bench);
+    } else {
+        Benchmark<KEY_TYPE, PAYLOAD_TYPE, true> bench;
+        run(bench);
+    }
+}
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+/// Log-bucketed latency histogram in the HDR style. Values below
+/// SUB_BUCKETS are counted exactly, larger ones in SUB_BUCKETS buckets per
+/// power of two, so a percentile is reported within 1/SUB_BUCKETS (~3%) of
+/// the true value. Recording is a few shifts, merging adds the counts.
+/// Count, sum and sum of squares are kept exactly for mean and variance.
+class LatencyHistogram {
+public:
+    static constexpr int SUB_BUCKET_BITS = 5;
+    static constexpr uint64_t SUB_BUCKETS = 1ull << SUB_BUCKET_BITS;
+    static constexpr int NUM_BUCKETS = (64 - SUB_BUCKET_BITS + 1) * SUB_BUCKETS;
+
+    LatencyHistogram() : counts_(NUM_BUCKETS, 0) {}
+
+    void record(uint64_t value) {
+        counts_[bucket_of(value)]++;
+        count_++;
+        min_ = std::min(min_, value);
+        max_ = std::max(max_, value);
+        sum_ += value;
+        sum_sq_ += static_cast<double>(value) * value;
+    }
+
+    void merge(const LatencyHistogram &other) {
+        for (int i = 0; i < NUM_BUCKETS; i++) counts_[i] += other.counts_[i];
+        count_ += other.count_;
+        min_ = std::min(min_, other.min_);
+        max_ = std::max(max_, other.max_);
+        sum_ += other.sum_;
+        sum_sq_ += other.sum_sq_;
+    }
+
+    uint64_t count() const { return count_; }
+    uint64_t min() const { return count_ ? min_ : 0; }
+    uint64_t max() const { return max_; }
+    double mean() const { return count_ ? sum_ / count_ : 0; }
+    /// over the final mean, not a running one
+    double variance() const {
+        if (!count_) return 0;
+        const double m = mean();
+        return std::max(0.0, sum_sq_ / count_ - m * m);
+    }
+
+    /// the value q percent of the recorded values are at or below (the top
+    /// of its bucket, capped at max), 0 if nothing was recorded
+    uint64_t percentile(double q) const {
+        if (!count_) return 0;
+        uint64_t rank = static_cast<uint64_t>(std::ceil(q / 100 * count_));
+        rank = std::min(count_, std::max<uint64_t>(rank, 1));
+        uint64_t seen = 0;
+        for (int i = 0; i < NUM_BUCKETS; i++) {
+            seen += counts_[i];
+            if (seen >= rank) return std::min(bucket_top(i), max_);
+        }
+        return max_;
+    }
+
+private:
+    static int bucket_of(uint64_t value) {
+        if (value < SUB_BUCKETS) return static_cast<int>(value);
+        const int shift = 63 - __builtin_clzll(value) - SUB_BUCKET_BITS;
+        return (shift + 1) * SUB_BUCKETS + static_cast<int>((value >> shift) - SUB_BUCKETS);
+    }
+    static uint64_t bucket_top(int i) {
+        if (static_cast<uint64_t>(i) < SUB_BUCKETS) return i;
+        const int shift = i / SUB_BUCKETS - 1;
+        const uint64_t low = (SUB_BUCKETS + i % SUB_BUCKETS) << shift;
+        return low + ((1ull << shift) - 1);
+    }
+
+    std::vector<uint64_t> counts_;
+    uint64_t count_ = 0;
+    uint64_t min_ = std::numeric_limits<uint64_t>::max();
+    uint64_t max_ = 0;
+    double sum_ = 0;
+    double sum_sq_ = 0;
+};
@@ -0,0 +1,268 @@
+// Runs the benchmark over every combination of the listed datasets, sizes,
+// thread counts, workloads, key distributions and index configs, and
+// writes one JSON document with a record per run, see usage(). With
+// --baseline it compares throughput against the document of an earlier
+// sweep, say the previous commit, and fails if a combination got slower.
+//
+// Every run is forked off, so each starts from a fresh process: the
+// two-key node pool and the epoch manager are per process singletons, and
+// a run that aborts doesn't take the sweep with it.
+
+#include <sys/wait.h>
+#include <map>
+#include <set>
+
+#include "benchmark.h"
+
+namespace {
+
+const std::set<std::string> SWEEP_FLAGS = {
+    "keys_files", "keys_file_type", "table_sizes", "thread_nums", "workloads", "distributions", "fmcd",
+    "build_lr_remain", "two_pool_warmup", "repeats", "output", "label", "baseline", "regression_threshold", "help"};
+
+void usage() {
+    printf("sweep --keys_files=a,b [flags] [benchmark flags]\n"
+           "  --keys_file_type=binary      of every keys file, binary or text\n"
+           "  --table_sizes=-1             keys taken from each file, -1 for all\n"
+           "  --thread_nums=1              \n"
+           "  --workloads=read=0.5+insert=0.5\n"
+           "                               YCSB workloads a-f, or op=ratio pairs joined by +,\n"
+           "                               ops read, insert, update, delete, scan, rmw\n"
+           "  --distributions=default      uniform, zipf, latest, default keeps the workload's\n"
+           "  --fmcd=1                     1 builds nodes with FMCD, 0 without\n"
+           "  --build_lr_remain=0          \n"
+           "  --two_pool_warmup=65536      two-key nodes pooled up front\n"
+           "  --repeats=1                  runs per combination\n"
+           "  --output=sweep.json          \n"
+           "  --label=                     recorded with the runs, e.g. the commit\n"
+           "  --baseline=                  an earlier sweep.json to compare throughput with\n"
+           "  --regression_threshold=0.05  slowdown of a combination's median throughput\n"
+           "                               that counts as a regression\n"
+           "Other flags, like --operations_num or --perf_events, go to every run as they are.\n");
+}
+
+std::vector<std::string> list_flag(std::map<std::string, std::string> &flags, const std::string &key,
+                                   const std::string &def) {
+    if (flags.find(key) == flags.end()) flags[key] = def;
+    return get_comma_separated(flags, key);
+}
+
+/// the benchmark flags of a workload spec, see usage()
+std::vector<std::string> workload_args(const std::string &spec) {
+    if (spec.find('=') == std::string::npos) return {"--workload=" + spec};
+    std::vector<std::string> args;
+    bool read = false;
+    std::istringstream s(spec);
+    std::string pair;
+    while (std::getline(s, pair, '+')) {
+        args.push_back("--" + pair);
+        read = read || pair.compare(0, 5, "read=") == 0;
+    }
+    // the benchmark needs --read when no YCSB workload is given
+    if (!read) args.push_back("--read=0");
+    return args;
+}
+
+double median(std::vector<double> v) {
+    std::sort(v.begin(), v.end());
+    return v.size() % 2 ? v[v.size() / 2] : (v[v.size() / 2 - 1] + v[v.size() / 2]) / 2;
+}
+
+/// the string value of JSON field name in line, false if there is none
+bool json_string_field(const std::string &line, const std::string &name, std::string &value) {
+    size_t pos = line.find("\"" + name + "\":\"");
+    if (pos == std::string::npos) return false;
+    pos += name.size() + 4;
+    value.clear();
+    for (; pos < line.size() && line[pos] != '"'; pos++) {
+        if (line[pos] == '\\' && pos + 1 < line.size()) pos++;
+        value += line[pos];
+    }
+    return true;
+}
+
+/// throughput of the runs of a sweep document, by combination key. The
+/// sweep writes one run per line, so this needn't parse JSON in general.
+std::map<std::string, std::vector<double>> read_baseline(const std::string &path) {
+    std::map<std::string, std::vector<double>> runs;
+    std::ifstream is(path);
+    std::string line, key;
+    while (std::getline(is, line)) {
+        const size_t pos = line.find("\"throughput\":");
+        if (!json_string_field(line, "key", key) || pos == std::string::npos) continue;
+        runs[key].push_back(atof(line.c_str() + pos + 13));
+    }
+    return runs;
+}
+
+/// fork a benchmark run with args, its JSON record, or an error message
+/// and false
+bool run_child(const std::vector<std::string> &args, std::string &record) {
+    char json_path[] = "/tmp/lipp_sweep_XXXXXX";
+    const int fd = mkstemp(json_path);
+    INVARIANT(fd >= 0);
+    close(fd);
+    std::vector<std::string> child_args = args;
+    child_args.push_back(std::string("--json_path=") + json_path);
+    std::vector<char *> argv;
+    for (auto &arg : child_args) argv.push_back(const_cast<char *>(arg.c_str()));
+    argv.push_back(nullptr);
+
+    // or the child would print what is still buffered again
+    fflush(stdout);
+    std::cout.flush();
+    pid_t pid = fork();
+    if (pid == 0) {
+        run_benchmark<uint64_t, uint64_t>(argv.size() - 1, argv.data());
+        fflush(stdout);
+        std::cout.flush();
+        _exit(0);
+    }
+    int status = 0;
+    if (pid < 0 || waitpid(pid, &status, 0) != pid) {
+        unlink(json_path);
+        record = "fork failed";
+        return false;
+    }
+    std::ifstream is(json_path);
+    std::getline(is, record);
+    unlink(json_path);
+    if (WIFSIGNALED(status)) {
+        record = "killed by signal " + std::to_string(WTERMSIG(status));
+        return false;
+    }
+    if (WEXITSTATUS(status) != 0) {
+        record = "exit status " + std::to_string(WEXITSTATUS(status));
+        return false;
+    }
+    if (record.empty()) {
+        record = "no result, are the flags and keys file right?";
+        return false;
+    }
+    return true;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+    auto flags = parse_flags(argc, argv);
+    if (get_boolean_flag(flags, "help") || !get_boolean_flag(flags, "keys_files")) {
+        usage();
+        return get_boolean_flag(flags, "help") ? 0 : 1;
+    }
+    const std::vector<std::string> keys_files = list_flag(flags, "keys_files", "");
+    const std::string keys_file_type = get_with_default(flags, "keys_file_type", "binary");
+    const std::vector<std::string> table_sizes = list_flag(flags, "table_sizes", "-1");
+    const std::vector<std::string> thread_nums = list_flag(flags, "thread_nums", "1");
+    const std::vector<std::string> workloads = list_flag(flags, "workloads", "read=0.5+insert=0.5");
+    const std::vector<std::string> distributions = list_flag(flags, "distributions", "default");
+    const std::vector<std::string> fmcds = list_flag(flags, "fmcd", "1");
+    const std::vector<std::string> lr_remains = list_flag(flags, "build_lr_remain", "0");
+    const std::vector<std::string> pool_warmups = list_flag(flags, "two_pool_warmup", "65536");
+    const int repeats = stoi(get_with_default(flags, "repeats", "1"));
+    const std::string output = get_with_default(flags, "output", "sweep.json");
+    const std::string label = get_with_default(flags, "label", "");
+    const std::string baseline = get_with_default(flags, "baseline", "");
+    const double threshold = stod(get_with_default(flags, "regression_threshold", "0.05"));
+    INVARIANT(repeats >= 1);
+    std::vector<std::string> passed;
+    for (auto &flag : flags) {
+        if (SWEEP_FLAGS.count(flag.first)) continue;
+        passed.push_back("--" + flag.first + (flag.second.empty() ? "" : "=" + flag.second));
+    }
+
+    // every combination, as its key and the benchmark flags to run it with
+    std::vector<std::pair<std::string, std::vector<std::string>>> combinations;
+    for (auto &keys_file : keys_files)
+    for (auto &table_size : table_sizes)
+    for (auto &thread_num : thread_nums)
+    for (auto &workload : workloads)
+    for (auto &distribution : distributions)
+    for (auto &fmcd : fmcds)
+    for (auto &lr_remain : lr_remains)
+    for (auto &pool_warmup : pool_warmups) {
+        const std::string key = "keys=" + keys_file + "|size=" + table_size + "|threads=" + thread_num +
+                                "|workload=" + workload + "|dist=" + distribution + "|fmcd=" + fmcd +
+                                "|lr_remain=" + lr_remain + "|pool=" + pool_warmup;
+        std::vector<std::string> args = {argv[0], "--keys_file=" + keys_file, "--keys_file_type=" + keys_file_type,
+                                         "--table_size=" + table_size, "--thread_num=" + thread_num,
+                                         "--fmcd=" + fmcd, "--build_lr_remain=" + lr_remain,
+                                         "--two_pool_warmup=" + pool_warmup, "--latency_sample",
+                                         "--output_path=/dev/null"};
+        for (auto &arg : workload_args(workload)) args.push_back(arg);
+        if (distribution != "default") args.push_back("--sample_distribution=" + distribution);
+        // flags given to the sweep come last, they win
+        args.insert(args.end(), passed.begin(), passed.end());
+        combinations.emplace_back(key, args);
+    }
+
+    std::ofstream out(output);
+    if (!out.is_open()) {
+        COUT_THIS("Could not open " << output);
+        return 1;
+    }
+    std::ostringstream command;
+    for (int i = 1; i < argc; i++) command << (i > 1 ? " " : "") << argv[i];
+    out << "{\"label\":" << json_string(label) << ",\"command\":" << json_string(command.str())
+        << ",\"runs\":[" << std::endl;
+    // throughput of the runs that finished, by key
+    std::map<std::string, std::vector<double>> results;
+    size_t failed = 0, n = 0;
+    const size_t total = combinations.size() * repeats;
+    for (auto &combination : combinations) {
+        for (int r = 0; r < repeats; r++) {
+            printf("[%zu/%zu] %s\n", ++n, total, combination.first.c_str());
+            std::string record;
+            const bool ok = run_child(combination.second, record);
+            out << (n > 1 ? "," : "") << "{\"key\":" << json_string(combination.first) << ",\"repeat\":" << r << ","
+                << (ok ? "\"result\":" + record : "\"error\":" + json_string(record)) << "}" << std::endl;
+            if (ok) {
+                const size_t pos = record.find("\"throughput\":");
+                results[combination.first].push_back(atof(record.c_str() + pos + 13));
+            } else {
+                COUT_THIS("Run failed: " << record);
+                failed++;
+            }
+        }
+    }
+    out << "]}" << std::endl;
+    out.close();
+    printf("%zu runs, %zu failed, written to %s\n", total, failed, output.c_str());
+
+    if (baseline.empty()) return failed ? 1 : 0;
+    const auto base = read_baseline(baseline);
+    if (base.empty()) {
+        COUT_THIS("No runs in baseline " << baseline);
+        return 1;
+    }
+    size_t regressions = 0, compared = 0;
+    // a renamed flag or a changed default shows up as combinations the
+    // baseline doesn't have, so they are listed rather than dropped
+    std::vector<std::string> skipped;
+    printf("median throughput\tbaseline\tcurrent\tchange\n");
+    for (auto &combination : combinations) {
+        auto b = base.find(combination.first);
+        auto c = results.find(combination.first);
+        if (b == base.end() || c == results.end()) {
+            skipped.push_back(combination.first + (b == base.end() ? "\tnot in baseline" : "\tno finished run"));
+            continue;
+        }
+        compared++;
+        const double was = median(b->second), now = median(c->second);
+        const double change = was > 0 ? now / was - 1 : 0;
+        const bool regressed = change < -threshold;
+        regressions += regressed;
+        printf("%s\t%.0f\t%.0f\t%+.1f%%%s\n", combination.first.c_str(), was, now, change * 100,
+               regressed ? "\tREGRESSION" : "");
+    }
+    for (auto &combination : skipped) {
+        printf("%s, skipped\n", combination.c_str());
+    }
+    printf("%zu regressions beyond %.1f%% in %zu compared combinations, %zu skipped\n", regressions,
+           threshold * 100, compared, skipped.size());
+    if (compared == 0) {
+        COUT_THIS("No combination of this sweep is in baseline " << baseline);
+        return 1;
+    }
+    return failed || regressions ? 1 : 0;
+}
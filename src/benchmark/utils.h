@@ -6,6 +6,7 @@
 #include <iostream>
 #include <functional>
 #include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <sys/types.h>
@@ -13,7 +14,9 @@
 #include <signal.h>
 #include "zipf.h"
 #include "omp.h"
+#include <atomic>
 #include <cassert>
+#include <charconv>
 #include <chrono>
 #include <cstring>
 #include <fstream>
@@ -137,6 +140,59 @@ struct System {
     static void profile(std::function<void()> body) {
         profile("perf.data", body);
     }
+
+    /// Count events (perf's comma-separated list) in this process while
+    /// body runs with perf stat, written to file as perf's CSV, see
+    /// read_perf_stat. Nothing is written if perf can't be run.
+    static void profile_stat(const std::string &file, const std::string &events, std::function<void()> body) {
+        const std::string pid = std::to_string(getpid());
+        pid_t perf = fork();
+        if (perf == 0) {
+            auto fd = open("/dev/null", O_RDWR);
+            dup2(fd, 1);
+            dup2(fd, 2);
+            execlp("perf", "perf", "stat", "-x", ",", "-e", events.c_str(), "-o", file.c_str(), "-p", pid.c_str(),
+                   nullptr);
+            _exit(127);
+        }
+        // perf counts from when it attached, not from the fork. It writes
+        // its header to file right before it attaches; without perf the
+        // child exits at once and there is nothing to wait for.
+        for (int waited_ms = 0; perf > 0 && waited_ms < 1000; waited_ms += 10) {
+            struct stat st;
+            if (waitpid(perf, nullptr, WNOHANG) == perf) {
+                perf = -1;
+            } else {
+                const bool started = stat(file.c_str(), &st) == 0 && st.st_size > 0;
+                usleep(10000);
+                if (started) break;
+            }
+        }
+        body();
+        if (perf > 0) {
+            kill(perf, SIGINT);
+            waitpid(perf, nullptr, 0);
+        }
+    }
+
+    /// the events and counts of a profile_stat file, events perf could not
+    /// count are left out
+    static std::vector<std::pair<std::string, double>> read_perf_stat(const std::string &file) {
+        std::vector<std::pair<std::string, double>> counters;
+        std::ifstream is(file);
+        std::string line;
+        while (std::getline(is, line)) {
+            if (line.empty() || line[0] == '#') continue;
+            // value,unit,event,...
+            std::vector<std::string> fields;
+            std::istringstream ss(line);
+            std::string field;
+            while (std::getline(ss, field, ',')) fields.push_back(field);
+            if (fields.size() < 3 || fields[0].empty() || fields[0][0] == '<') continue;
+            counters.emplace_back(fields[2], atof(fields[0].c_str()));
+        }
+        return counters;
+    }
 };
 
 template<class T>
@@ -190,6 +246,146 @@ long long load_text_data(T *&array, long long length, const std::string &file_pa
     return temp_keys.size();
 }
 
+/// Map a SOSD-format binary key file (count, then the keys) and point data
+/// at its keys, without reading or copying them. The mapping is private, so
+/// sorting or shuffling data in place only copies the pages it writes and
+/// never changes the file. Returns the number of keys, 0 if the file can't
+/// be mapped.
+template<class T>
+long long map_binary_data(T *&data, long long int length, const std::string &file_path) {
+    int fd = open(file_path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+    struct stat st;
+    T max_size;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(T)
+        || pread(fd, &max_size, sizeof(T), 0) != (ssize_t) sizeof(T)) {
+        close(fd);
+        return 0;
+    }
+    long long available = (st.st_size - sizeof(T)) / sizeof(T);
+    if (length < 0 || length > (long long) max_size) length = max_size;
+    if (length > available) length = available;
+
+    void *base = mmap(nullptr, sizeof(T) * (length + 1), PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        return 0;
+    }
+    data = reinterpret_cast<T *>(base) + 1;
+    return length;
+}
+
+/// Parse a text key file, one key per line, with num_threads threads. The
+/// file is mapped and split into chunks at line ends; a first pass counts
+/// the keys of every chunk so the second parses them straight into their
+/// place in array. Empty lines are skipped. Returns the number of keys,
+/// or -1 after printing the file and line of the first line that isn't a
+/// key.
+template<class T>
+long long parse_text_data(T *&array, long long length, const std::string &file_path, int num_threads) {
+    int fd = open(file_path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+    const size_t file_size = st.st_size;
+    void *base = mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        return 0;
+    }
+    const char *text = static_cast<const char *>(base);
+    const char *text_end = text + file_size;
+
+    // chunk i covers [bounds[i], bounds[i + 1]), every chunk starts a line
+    std::vector<const char *> bounds(num_threads + 1);
+    bounds[0] = text;
+    for (int i = 1; i < num_threads; i++) {
+        // the line under the even split point stays in the previous chunk
+        const char *p = std::max(bounds[i - 1], text + file_size / num_threads * i);
+        const char *eol = static_cast<const char *>(memchr(p, '\n', text_end - p));
+        bounds[i] = eol ? eol + 1 : text_end;
+    }
+    bounds[num_threads] = text_end;
+
+    // calls f(line, line_end) for every non-empty line of chunk i
+    auto for_each_line = [&](int i, auto &&f) {
+        const char *p = bounds[i];
+        const char *end = bounds[i + 1];
+        while (p < end) {
+            const char *eol = static_cast<const char *>(memchr(p, '\n', end - p));
+            if (eol == nullptr) eol = end;
+            const char *line_end = (eol > p && eol[-1] == '\r') ? eol - 1 : eol;
+            if (line_end > p) f(p, line_end);
+            p = eol + 1;
+        }
+    };
+
+    std::vector<long long> offsets(num_threads + 1, 0);
+#pragma omp parallel for num_threads(num_threads)
+    for (int i = 0; i < num_threads; i++) {
+        long long count = 0;
+        for_each_line(i, [&](const char *, const char *) { count++; });
+        offsets[i + 1] = count;
+    }
+    for (int i = 0; i < num_threads; i++) {
+        offsets[i + 1] += offsets[i];
+    }
+    long long total = offsets[num_threads];
+    if (length >= 0 && length < total) total = length;
+
+    array = new T[total];
+    // the first line that isn't a key, file_size if every line is one
+    std::atomic<size_t> bad_line{file_size};
+#pragma omp parallel for num_threads(num_threads)
+    for (int i = 0; i < num_threads; i++) {
+        long long j = offsets[i];
+        for_each_line(i, [&](const char *line, const char *line_end) {
+            if (j >= total) return;
+            const char *key_begin = line;
+            while (key_begin < line_end && (*key_begin == ' ' || *key_begin == '\t')) key_begin++;
+            while (line_end > key_begin && (line_end[-1] == ' ' || line_end[-1] == '\t')) line_end--;
+            T key = T();
+            const auto result = std::from_chars(key_begin, line_end, key);
+            if (result.ec != std::errc() || result.ptr != line_end) {
+                size_t offset = line - text;
+                size_t seen = bad_line.load();
+                while (offset < seen && !bad_line.compare_exchange_weak(seen, offset)) {}
+            }
+            array[j++] = key;
+        });
+    }
+    if (bad_line.load() < file_size) {
+        const char *line = text + bad_line.load();
+        const char *eol = static_cast<const char *>(memchr(line, '\n', text_end - line));
+        std::cerr << file_path << ":" << std::count(text, line, '\n') + 1 << ": not a key: \""
+                  << std::string(line, eol ? eol : text_end) << "\"" << std::endl;
+        delete[] array;
+        array = nullptr;
+        munmap(base, file_size);
+        return -1;
+    }
+    munmap(base, file_size);
+    return total;
+}
+
+/// true if data[0, n) is in ascending order, checked with num_threads threads
+template<class T>
+bool is_sorted_parallel(const T *data, long long n, int num_threads) {
+    bool sorted = true;
+#pragma omp parallel for num_threads(num_threads) reduction(&&:sorted)
+    for (long long i = 1; i < n; i++) {
+        sorted = sorted && !(data[i] < data[i - 1]);
+    }
+    return sorted;
+}
+
 template<class T>
 T *get_search_keys(T array[], int num_keys, int num_searches, size_t *seed = nullptr) {
     auto *keys = new T[num_searches];
@@ -0,0 +1,160 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <random>
+#include <string>
+
+#include "zipf.h"
+
+enum Operation {
+    READ = 0, INSERT, DELETE, SCAN, UPDATE, READ_MODIFY_WRITE, NUM_OPERATIONS
+};
+
+inline const char *operation_name(Operation op) {
+    static const char *names[NUM_OPERATIONS] = {"READ", "INSERT", "DELETE", "SCAN", "UPDATE", "READ_MODIFY_WRITE"};
+    return names[op];
+}
+
+/// What a run does: the mix of operations, how their keys are picked and
+/// how long scans are.
+struct WorkloadSpec {
+    double ratio[NUM_OPERATIONS] = {};
+    // uniform and zipf pick among the bulk loaded keys, latest among all
+    // keys inserted so far, skewed to the newest
+    std::string request_distribution = "uniform";
+    size_t max_scan_length = 100;
+    std::string scan_length_distribution = "uniform"; // in [1, max_scan_length], uniform or zipf
+
+    /// the YCSB core workload name ("a" to "f"), false if name isn't one
+    bool set_ycsb(const std::string &name) {
+        std::fill(ratio, ratio + NUM_OPERATIONS, 0);
+        request_distribution = "zipf";
+        if (name == "a" || name == "A") {
+            ratio[READ] = 0.5;
+            ratio[UPDATE] = 0.5;
+        } else if (name == "b" || name == "B") {
+            ratio[READ] = 0.95;
+            ratio[UPDATE] = 0.05;
+        } else if (name == "c" || name == "C") {
+            ratio[READ] = 1;
+        } else if (name == "d" || name == "D") {
+            ratio[READ] = 0.95;
+            ratio[INSERT] = 0.05;
+            request_distribution = "latest";
+        } else if (name == "e" || name == "E") {
+            ratio[SCAN] = 0.95;
+            ratio[INSERT] = 0.05;
+            max_scan_length = 100;
+            scan_length_distribution = "uniform";
+        } else if (name == "f" || name == "F") {
+            ratio[READ] = 0.5;
+            ratio[READ_MODIFY_WRITE] = 0.5;
+        } else {
+            return false;
+        }
+        return true;
+    }
+
+    double ratio_sum() const {
+        double sum = 0;
+        for (double r : ratio) sum += r;
+        return sum;
+    }
+};
+
+/// The keys a generator draws from, as indices into the benchmark's key
+/// array: the bulk loaded ones in [loaded_begin, loaded_end), inserts take
+/// the next index off the shared *next_insert, from insert_begin on and
+/// before insert_end.
+struct KeyRange {
+    size_t loaded_begin = 0;
+    size_t loaded_end = 0;
+    size_t insert_begin = 0;
+    size_t insert_end = 0;
+    std::atomic<size_t> *next_insert = nullptr;
+};
+
+/// Draws the operations of one thread on the fly from its own seeded
+/// streams, so a run needs no memory per operation. Keys are returned as
+/// indices into the benchmark's key array, see KeyRange.
+class WorkloadGenerator {
+public:
+    static constexpr size_t NO_KEY = ~size_t(0);
+
+    struct Op {
+        Operation op;
+        size_t key_index; // NO_KEY for an INSERT once the range's keys ran out
+        size_t scan_length;
+    };
+
+    WorkloadGenerator(const WorkloadSpec &spec, const KeyRange &keys, size_t seed)
+        : keys_(keys),
+          zipf_seed_(seed ^ 0x9e3779b97f4a7c15ull), scan_seed_(seed ^ 0xbf58476d1ce4e5b9ull),
+          gen_(seed), dis_(0, 1), key_dis_(keys.loaded_begin, keys.loaded_end - 1), scan_dis_(1, spec.max_scan_length),
+          zipf_(static_cast<int>(keys.loaded_end - keys.loaded_begin), &zipf_seed_),
+          scan_zipf_(static_cast<int>(spec.max_scan_length), &scan_seed_),
+          zipf_keys_(spec.request_distribution == "zipf"), latest_keys_(spec.request_distribution == "latest"),
+          zipf_scans_(spec.scan_length_distribution == "zipf") {
+        double sum = 0;
+        last_ = READ;
+        for (int i = 0; i < NUM_OPERATIONS; i++) {
+            sum += spec.ratio[i];
+            cumulative_[i] = sum;
+            if (spec.ratio[i] > 0) last_ = i;
+        }
+    }
+
+    Op next() {
+        Op op;
+        const double p = dis_(gen_);
+        int i = 0;
+        while (i < last_ && p >= cumulative_[i]) i++;
+        op.op = static_cast<Operation>(i);
+        op.scan_length = 0;
+        if (op.op == INSERT) {
+            const size_t i = keys_.next_insert->fetch_add(1, std::memory_order_relaxed);
+            op.key_index = i < keys_.insert_end ? i : NO_KEY;
+            return op;
+        }
+        op.key_index = next_key();
+        if (op.op == SCAN) {
+            op.scan_length = zipf_scans_ ? scan_zipf_.nextRank() + 1 : scan_dis_(gen_);
+        }
+        return op;
+    }
+
+private:
+    size_t next_key() {
+        if (zipf_keys_) {
+            return keys_.loaded_begin + zipf_.nextValue();
+        }
+        if (latest_keys_) {
+            // newest first: the inserted keys backwards, then the loaded ones
+            const size_t inserted = std::min(keys_.insert_end, keys_.next_insert->load(std::memory_order_relaxed)) -
+                                    keys_.insert_begin;
+            const size_t rank = zipf_.nextRank();
+            if (rank < inserted) return keys_.insert_begin + inserted - 1 - rank;
+            return keys_.loaded_end - 1 - std::min(rank - inserted, keys_.loaded_end - keys_.loaded_begin - 1);
+        }
+        return key_dis_(gen_);
+    }
+
+    KeyRange keys_;
+    double cumulative_[NUM_OPERATIONS];
+    int last_; // last operation with a share, takes what rounding leaves
+    // the zipf generators draw from streams of their own
+    size_t zipf_seed_;
+    size_t scan_seed_;
+
+    std::mt19937_64 gen_;
+    std::uniform_real_distribution<double> dis_;
+    std::uniform_int_distribution<size_t> key_dis_;
+    std::uniform_int_distribution<size_t> scan_dis_;
+    ScrambledZipfianGenerator zipf_;
+    ScrambledZipfianGenerator scan_zipf_;
+    // the spec's distribution names, looked at once rather than per op
+    bool zipf_keys_;
+    bool latest_keys_;
+    bool zipf_scans_;
+};
@@ -1,5 +1,8 @@
 // Copyright (c) Microsoft Corporation.
 // Licensed under the MIT license.
+#pragma once
+#include <algorithm>
+#include <cmath>
 #include <iomanip>
 #include <fstream>
 #include <iostream>
@@ -12,29 +15,36 @@
 
 class ScrambledZipfianGenerator {
  public:
-  static constexpr double ZETAN = 26.46902820178302;
   static constexpr double ZIPFIAN_CONSTANT = 0.99;
+  // zeta() sums this many terms, the rest is integrated
+  static constexpr long ZETA_EXACT_TERMS = 10000;
 
   int num_keys_;
+  double zetan_; // zeta(num_keys_)
   double alpha_;
   double eta_;
   std::mt19937_64 gen_;
   std::uniform_real_distribution<double> dis_;
 
   explicit ScrambledZipfianGenerator(int num_keys, size_t *seed)
-      : num_keys_(num_keys), gen_(std::random_device{}()), dis_(0, 1) {
+      : num_keys_(num_keys), zetan_(zeta(num_keys)), gen_(std::random_device{}()), dis_(0, 1) {
     if(seed) {
       gen_.seed(*seed);
     }
     double zeta2theta = zeta(2);
     alpha_ = 1. / (1. - ZIPFIAN_CONSTANT);
     eta_ = (1 - std::pow(2. / num_keys_, 1 - ZIPFIAN_CONSTANT)) /
-           (1 - zeta2theta / ZETAN);
+           (1 - zeta2theta / zetan_);
   }
 
   int nextValue() {
+    return fnv1a(nextRank()) % num_keys_;
+  }
+
+  /// zipfian rank before scrambling, 0 is the most popular
+  int nextRank() {
     double u = dis_(gen_);
-    double uz = u * ZETAN;
+    double uz = u * zetan_;
 
     int ret;
     if (uz < 1.0) {
@@ -44,16 +54,21 @@ class ScrambledZipfianGenerator {
     } else {
       ret = (int)(num_keys_ * std::pow(eta_ * u - eta_ + 1, alpha_));
     }
-
-    ret = fnv1a(ret) % num_keys_;
     return ret;
   }
 
-  double zeta(long n) {
+  /// sum of 1 / i^ZIPFIAN_CONSTANT for i in [1, n]. Past ZETA_EXACT_TERMS
+  /// the terms are integrated over [i - 0.5, i + 0.5], which is off by
+  /// less than 1e-9 there and keeps large key spaces cheap.
+  static double zeta(long n) {
     double sum = 0.0;
-    for (long i = 0; i < n; i++) {
+    for (long i = 0; i < std::min(n, ZETA_EXACT_TERMS); i++) {
       sum += 1 / std::pow(i + 1, ZIPFIAN_CONSTANT);
     }
+    if (n > ZETA_EXACT_TERMS) {
+      const double e = 1 - ZIPFIAN_CONSTANT;
+      sum += (std::pow(n + 0.5, e) - std::pow(ZETA_EXACT_TERMS + 0.5, e)) / e;
+    }
     return sum;
   }
 
@@ -69,6 +69,7 @@
 
   // optimistic lock implementation is based on https://github.com/wangziqi2016/index-microbench/blob/master/BTreeOLC/BTreeOLC_child_layout.h
   struct OptLock {
+    static constexpr bool concurrent = true;
     std::atomic<uint64_t> typeVersionLockObsolete{0b100};
 
     OptLock() = default;
@@ -128,6 +129,8 @@
     }
 
     void readUnlockOrRestart(uint64_t startRead, bool &needRestart) const {
+      // keep the protected reads before the version check (seqlock read side)
+      std::atomic_thread_fence(std::memory_order_acquire);
       needRestart = (startRead != typeVersionLockObsolete.load());
     }
 
@@ -150,6 +153,33 @@
     }
 
   };
+  // OptLock's interface for structures only one thread uses at a time: plain
+  // version word, nothing blocks and reads never restart. Obsolete marks are
+  // kept so retired nodes still read as retired.
+  struct NoLock {
+    static constexpr bool concurrent = false;
+    uint64_t typeVersionLockObsolete = 0b100;
+
+    NoLock() = default;
+    NoLock(const NoLock& other) {
+      typeVersionLockObsolete = 0b100;
+    }
+
+    uint64_t get_version_number() { return typeVersionLockObsolete; }
+    bool isLocked(uint64_t version) { return false; }
+    bool isLocked() { return false; }
+    void writeLockOrRestart(bool &needRestart) {}
+    void upgradeToWriteLockOrRestart(uint64_t &version, bool &needRestart) {}
+    void writeUnlock() {}
+    void checkOrRestart(uint64_t startRead, bool &needRestart) const { needRestart = false; }
+    uint64_t readLockOrRestart(bool &needRestart) { return typeVersionLockObsolete; }
+    void readUnlockOrRestart(uint64_t startRead, bool &needRestart) const { needRestart = false; }
+    void writeUnlockObsolete() { typeVersionLockObsolete |= 1; }
+    void labelObsolete() { typeVersionLockObsolete |= 1; }
+    bool isObsolete(uint64_t version) { return (version & 1) == 1; }
+    bool isObsolete() { return (typeVersionLockObsolete & 1) == 1; }
+  };
+
   // typedef tbb::spin_rw_mutex Alex_rw_mutex;
   // typedef OptLock Alex_mutex;
   // typedef Alex_rw_mutex::scoped_lock Alex_rw_lock;
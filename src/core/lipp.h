@@ -5,35 +5,60 @@
 #include "lipp_base.h"
 #include "omp.h"
 #include "tbb/combinable.h"
+#include "tbb/concurrent_unordered_map.h"
 #include "tbb/enumerable_thread_specific.h"
+#include "tbb/parallel_for.h"
+#include "tbb/task_group.h"
 #include <atomic>
 #include <cassert>
 #include <cstdio>
+#include <condition_variable>
+#include <cpuid.h>
 #include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <immintrin.h>
 #include <iostream>
 #include <limits>
 #include <list>
 #include <math.h>
+#include <memory>
+#include <mutex>
 #include <sstream>
 #include <stack>
 #include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <thread>
+#include <tuple>
+#include <unistd.h>
 #include <vector>
 
-typedef uint8_t bitmap_t;
+// bitmap_t is the bitmap word type of the LIPP instance, see LIPPPolicy
 #define BITMAP_WIDTH (sizeof(bitmap_t) * 8)
 #define BITMAP_SIZE(num_items) (((num_items) + BITMAP_WIDTH - 1) / BITMAP_WIDTH)
 #define BITMAP_GET(bitmap, pos) (((bitmap)[(pos) / BITMAP_WIDTH] >> ((pos) % BITMAP_WIDTH)) & 1)
-#define BITMAP_SET(bitmap, pos) ((bitmap)[(pos) / BITMAP_WIDTH] |= 1 << ((pos) % BITMAP_WIDTH))
-#define BITMAP_CLEAR(bitmap, pos) ((bitmap)[(pos) / BITMAP_WIDTH] &= ~bitmap_t(1 << ((pos) % BITMAP_WIDTH)))
-#define BITMAP_NEXT_1(bitmap_item) __builtin_ctz((bitmap_item))
+#define BITMAP_SET(bitmap, pos) ((bitmap)[(pos) / BITMAP_WIDTH] |= bitmap_t(1) << ((pos) % BITMAP_WIDTH))
+#define BITMAP_CLEAR(bitmap, pos) ((bitmap)[(pos) / BITMAP_WIDTH] &= bitmap_t(~(bitmap_t(1) << ((pos) % BITMAP_WIDTH))))
+#define BITMAP_NEXT_1(bitmap_item) bitmap_next_1((bitmap_item))
+
+/// index of the lowest set bit, tzcnt with BMI
+template <class W>
+static inline int bitmap_next_1(W bitmap_item) {
+    static_assert(std::is_unsigned<W>::value && sizeof(W) <= 8, "bitmap words are unsigned, at most 64 bits");
+    if constexpr (sizeof(W) == 8) {
+        return __builtin_ctzll(bitmap_item);
+    } else {
+        return __builtin_ctz(bitmap_item);
+    }
+}
 
 // runtime assert
 #define RT_ASSERT(expr) \
 { \
     if (!(expr)) { \
         fprintf(stderr, "RT_ASSERT Error at %s:%d, `%s`\n", __FILE__, __LINE__, #expr); \
-        exit(0); \
+        abort(); \
     } \
 }
 
@@ -41,21 +66,75 @@ typedef void (*dealloc_func)(void *ptr);
 
 #define COLLECT_TIME 0
 
+// 1: a node's header, bitmaps and items share one 64-byte aligned block.
+// 0: they come from three separate allocators.
+#ifndef LIPP_COALLOC_NODE
+#define LIPP_COALLOC_NODE 1
+#endif
+
+// 1: place_numa() moves node pages between NUMA nodes and the root cache
+// keeps a replica per NUMA node, link with -lnuma.
+// 0: place_numa() does nothing, the root cache has one replica.
+#ifndef LIPP_NUMA
+#define LIPP_NUMA 0
+#endif
+
 #if COLLECT_TIME
 #include <chrono>
 #endif
+#if LIPP_NUMA
+#include <numa.h>
+#include <numaif.h>
+#include <sched.h>
+#endif
 
-template<class T, class P, bool USE_FMCD = true>
-class LIPP
+/// Compile-time knobs of LIPP:
+/// Bitmap, word type of the none/child bitmaps (uint8_t, uint32_t or uint64_t),
+/// wider words skip more empty slots per step in scans;
+/// Lock, node lock, OptLock or NoLock for an index only one thread uses;
+/// SplitValues, SoA slots: payloads in an array parallel to the key/child
+/// array, so descents and misses only touch keys, and a 4-byte payload
+/// (or an offset into an external value log) isn't padded to the key width;
+/// gap_count(size), free slots per key when a node is built for size keys;
+/// rebuild_gap_count(gaps, heat), gap count of a node rebuilt by adjust()
+/// whose keys took heat times the rebuilt subtree's average share of inserts
+/// since its last build, gaps is gap_count(size). Hot ranges get more slack,
+/// cold ones less. A policy derived from this one can hide either.
+template<class Bitmap = uint8_t, class Lock = OptLock, bool SplitValues = false>
+struct LIPPPolicy
 {
-    static_assert(std::is_arithmetic<T>::value, "LIPP key type must be numeric.");
+    typedef Bitmap bitmap_t;
+    typedef Lock lock_t;
+    static constexpr bool split_values = SplitValues;
 
-    inline int compute_gap_count(int size) {
+    static int gap_count(int size) {
         if (size >= 1000000) return 1;
         if (size >= 100000) return 2;
         return 5;
     }
 
+    static int rebuild_gap_count(int gaps, double heat) {
+        if (heat >= 1.5) return gaps * 2;
+        if (heat <= 0.5) return std::max(1, gaps / 2);
+        return gaps;
+    }
+};
+
+template<class T, class P, bool USE_FMCD = true, class Policy = LIPPPolicy<>>
+class LIPP
+{
+    static_assert(KeyTraits<T>::specialized, "LIPP key type needs a KeyTraits specialization.");
+    static_assert(std::is_trivially_copyable<T>::value, "LIPP keys are stored inline in items.");
+
+    typedef typename Policy::bitmap_t bitmap_t;
+    typedef typename Policy::lock_t lock_t;
+    static constexpr bool SOA = Policy::split_values;
+    static_assert(std::is_unsigned<bitmap_t>::value && sizeof(bitmap_t) <= 8, "bitmap words are unsigned, at most 64 bits");
+
+    inline int compute_gap_count(int size) {
+        return Policy::gap_count(size);
+    }
+
     struct Node ;
     inline int PREDICT_POS(Node* node, T key) const {
         double v = node->model.predict_double(key);
@@ -68,16 +147,83 @@ class LIPP
         return std::min(node->num_items - 1, static_cast<int>(v));
     }
 
+    /// PREDICT_POS of n keys into out, vectorized for 64-bit keys; lanes
+    /// compute the same fma and clamp, so positions match PREDICT_POS exactly
+    void predict_positions(const Node* node, const T* keys, int n, int* out) const {
+        const LinearModel<T>& model = node->model;
+        const int last = node->num_items - 1;
+        int i = 0;
+        if constexpr (std::is_same<T, uint64_t>::value || std::is_same<T, int64_t>::value) {
+#if defined(__AVX512F__) && defined(__AVX512DQ__)
+            const __m512d va = _mm512_set1_pd(model.a);
+            const __m512d vc = _mm512_set1_pd(model.c);
+            const __m512d vlast = _mm512_set1_pd(last);
+            const __m512d zero = _mm512_setzero_pd();
+            const __m512i vbase = _mm512_set1_epi64(static_cast<long long>(model.base));
+            const __mmask8 all = 0xff;
+            for (; i + 8 <= n; i += 8) {
+                const __m512i k = _mm512_loadu_si512(keys + i);
+                const __mmask8 below = std::is_signed<T>::value ? _mm512_cmplt_epi64_mask(k, vbase)
+                                                                : _mm512_cmplt_epu64_mask(k, vbase);
+                const __m512i dist = _mm512_mask_blend_epi64(below, _mm512_sub_epi64(k, vbase),
+                                                             _mm512_sub_epi64(vbase, k));
+                __m512d d = _mm512_cvtepu64_pd(dist);
+                d = _mm512_mask_sub_pd(d, below, zero, d);
+                __m512d v = _mm512_fmadd_pd(va, d, vc);
+                // maskz forms, the plain ones trip -Wmaybe-uninitialized in gcc 12 headers
+                v = _mm512_maskz_min_pd(all, _mm512_maskz_max_pd(all, v, zero), vlast);
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), _mm512_maskz_cvttpd_epi32(all, v));
+            }
+#elif defined(__AVX2__) && defined(__FMA__)
+            // no unsigned 64-bit compare or convert: compare with flipped sign
+            // bits, convert the 32-bit halves exactly and round once on the sum
+            const __m256d va = _mm256_set1_pd(model.a);
+            const __m256d vc = _mm256_set1_pd(model.c);
+            const __m256d vlast = _mm256_set1_pd(last);
+            const __m256d zero = _mm256_setzero_pd();
+            const __m256i vbase = _mm256_set1_epi64x(static_cast<long long>(model.base));
+            const __m256i flip = _mm256_set1_epi64x(std::is_signed<T>::value ? 0 : 0x8000000000000000ll);
+            const __m256i lo_mask = _mm256_set1_epi64x(0xffffffffll);
+            const __m256i lo_bias = _mm256_set1_epi64x(0x4330000000000000ll); // 2^52
+            const __m256i hi_bias = _mm256_set1_epi64x(0x4530000000000000ll); // 2^84
+            const __m256d lo_sub = _mm256_castsi256_pd(lo_bias);
+            const __m256d hi_sub = _mm256_castsi256_pd(hi_bias);
+            for (; i + 4 <= n; i += 4) {
+                const __m256i k = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(keys + i));
+                const __m256i below = _mm256_cmpgt_epi64(_mm256_xor_si256(vbase, flip), _mm256_xor_si256(k, flip));
+                const __m256i dist = _mm256_blendv_epi8(_mm256_sub_epi64(k, vbase), _mm256_sub_epi64(vbase, k), below);
+                const __m256d lo = _mm256_sub_pd(_mm256_castsi256_pd(_mm256_or_si256(_mm256_and_si256(dist, lo_mask), lo_bias)), lo_sub);
+                const __m256d hi = _mm256_sub_pd(_mm256_castsi256_pd(_mm256_or_si256(_mm256_srli_epi64(dist, 32), hi_bias)), hi_sub);
+                __m256d d = _mm256_add_pd(hi, lo);
+                d = _mm256_blendv_pd(d, _mm256_sub_pd(zero, d), _mm256_castsi256_pd(below));
+                __m256d v = _mm256_fmadd_pd(va, d, vc);
+                v = _mm256_min_pd(_mm256_max_pd(v, zero), vlast);
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm256_cvttpd_epi32(v));
+            }
+#else
+            (void) model;
+            (void) last;
+#endif
+        }
+        for (; i < n; i ++) {
+            out[i] = PREDICT_POS(const_cast<Node*>(node), keys[i]);
+        }
+    }
+
     static void remove_last_bit(bitmap_t& bitmap_item) {
-        bitmap_item -= 1 << BITMAP_NEXT_1(bitmap_item);
+        bitmap_item -= bitmap_t(1) << BITMAP_NEXT_1(bitmap_item);
     }
 
     const double BUILD_LR_REMAIN;
     const bool QUIET;
 
     struct {
-        long long fmcd_success_times = 0;
-        long long fmcd_broken_times = 0;
+        std::atomic<long long> fmcd_success_times{0};
+        std::atomic<long long> fmcd_broken_times{0};
+        std::atomic<long long> rebuilds{0};
+        std::atomic<long long> local_rebuilds{0};
+        std::atomic<long long> rebuild_keys{0};
+        std::atomic<long long> full_rebuild_keys{0};
         #if COLLECT_TIME
         double time_scan_and_destory_tree = 0;
         double time_build_tree_bulk = 0;
@@ -86,16 +232,40 @@ class LIPP
 
 public:
     // Epoch based Memory Reclaim
+    struct ReclamationStats {
+        uint64_t epoch = 0; // epoch advances so far
+        uint64_t epoch_lag = 0; // epochs since the oldest garbage still pending was retired
+        size_t pending_bytes = 0; // retired, not freed yet
+        size_t pending_objects = 0;
+        size_t freed_bytes = 0;
+    };
+
+    class EpochBasedMemoryReclamationStrategy;
     class ThreadSpecificEpochBasedReclamationInformation {
+        friend class EpochBasedMemoryReclamationStrategy;
+        static constexpr uint64_t OUTSIDE = ~uint64_t(0);
+
+        // garbage retired in epoch e is kept in list e % 3, tagged e (OUTSIDE
+        // while empty)
         std::array<std::vector<std::pair<void *, dealloc_func>>, 3> mFreeLists;
-        std::atomic<uint32_t> mLocalEpoch;
-        uint32_t mPreviouslyAccessedEpoch;
+        std::array<size_t, 3> mFreeBytes;
+        std::array<std::atomic<uint64_t>, 3> mFreeEpochs;
+        std::atomic<uint64_t> mLocalEpoch;
+        uint64_t mPreviouslyAccessedEpoch;
         bool mThreadWantsToAdvance;
+        uint32_t mEntersInEpoch; // enters since the thread last saw the epoch change
+        int mDepth; // nested critical sections
+        bool mBatch; // the outermost one is an EpochBatch
+        uint32_t mBatchOps;
+        std::atomic<size_t> mPendingBytes;
+        std::atomic<size_t> mPendingObjects;
+        std::atomic<size_t> mFreedBytes;
 
     public:
         ThreadSpecificEpochBasedReclamationInformation()
-            : mFreeLists(), mLocalEpoch(3), mPreviouslyAccessedEpoch(3),
-            mThreadWantsToAdvance(false) {}
+            : mFreeLists(), mFreeBytes(), mFreeEpochs{OUTSIDE, OUTSIDE, OUTSIDE}, mLocalEpoch(OUTSIDE), mPreviouslyAccessedEpoch(OUTSIDE),
+            mThreadWantsToAdvance(false), mEntersInEpoch(0), mDepth(0), mBatch(false), mBatchOps(0),
+            mPendingBytes(0), mPendingObjects(0), mFreedBytes(0) {}
 
         ThreadSpecificEpochBasedReclamationInformation(
             ThreadSpecificEpochBasedReclamationInformation const &other) = delete;
@@ -105,53 +275,94 @@ public:
 
         ~ThreadSpecificEpochBasedReclamationInformation() {
             for (uint32_t i = 0; i < 3; ++i) {
-                freeForEpoch(i);
+                freeList(i);
             }
         }
 
-        void scheduleForDeletion(std::pair<void *, dealloc_func> func_pair) {
-            assert(mLocalEpoch != 3);
-            std::vector<std::pair<void *, dealloc_func>> &currentFreeList =
-                mFreeLists[mLocalEpoch];
+        /// bytes is what freeing the object gives back, it paces the epoch
+        void scheduleForDeletion(std::pair<void *, dealloc_func> func_pair, size_t bytes) {
+            const uint64_t epoch = mLocalEpoch.load(std::memory_order_relaxed);
+            assert(epoch != OUTSIDE);
+            const uint32_t i = epoch % 3;
+            std::vector<std::pair<void *, dealloc_func>> &currentFreeList = mFreeLists[i];
+            if (currentFreeList.empty()) mFreeEpochs[i].store(epoch, std::memory_order_relaxed);
             currentFreeList.emplace_back(func_pair);
-            mThreadWantsToAdvance = (currentFreeList.size() % 64u) == 0;
+            mFreeBytes[i] += bytes;
+            bump(mPendingBytes, bytes);
+            bump(mPendingObjects, 1);
+            mThreadWantsToAdvance = (currentFreeList.size() % RETIRE_BATCH) == 0 || mFreeBytes[i] >= ADVANCE_BYTES;
         }
 
-        uint32_t getLocalEpoch() const {
+        uint64_t getLocalEpoch() const {
             return mLocalEpoch.load(std::memory_order_acquire);
         }
 
-        void enter(uint32_t newEpoch) {
-            assert(mLocalEpoch == 3);
+        void enter(uint64_t newEpoch) {
+            assert(mLocalEpoch == OUTSIDE);
             if (mPreviouslyAccessedEpoch != newEpoch) {
-                freeForEpoch(newEpoch);
+                // three advances since anything in this list was retired
+                freeList(newEpoch % 3);
                 mThreadWantsToAdvance = false;
                 mPreviouslyAccessedEpoch = newEpoch;
+                mEntersInEpoch = 0;
+            } else if (++ mEntersInEpoch % IDLE_ADVANCE_ENTERS == 0 &&
+                       mPendingObjects.load(std::memory_order_relaxed) > 0) {
+                // the thread stopped retiring but still holds garbage, which
+                // only three more advances free
+                mThreadWantsToAdvance = true;
             }
             mLocalEpoch.store(newEpoch, std::memory_order_release);
         }
 
-        void leave() { mLocalEpoch.store(3, std::memory_order_release); }
+        void leave() { mLocalEpoch.store(OUTSIDE, std::memory_order_release); }
 
         bool doesThreadWantToAdvanceEpoch() { return (mThreadWantsToAdvance); }
 
     private:
-        void freeForEpoch(uint32_t epoch) {
-            std::vector<std::pair<void *, dealloc_func>> &previousFreeList =
-                mFreeLists[epoch];
-            for (std::pair<void *, dealloc_func> func_pair : previousFreeList) {
+        /// counters only the owning thread writes
+        static void bump(std::atomic<size_t> &counter, size_t delta) {
+            counter.store(counter.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+        }
+        /// empty list i, moving its objects to out if given. Returns its bytes.
+        size_t clearList(uint32_t i, std::vector<std::pair<void *, dealloc_func>> *out) {
+            const size_t bytes = mFreeBytes[i];
+            bump(mPendingBytes, -bytes);
+            bump(mPendingObjects, -mFreeLists[i].size());
+            if (out) out->swap(mFreeLists[i]);
+            mFreeLists[i].resize(0u);
+            mFreeBytes[i] = 0;
+            mFreeEpochs[i].store(OUTSIDE, std::memory_order_relaxed);
+            return bytes;
+        }
+        size_t takeList(uint32_t i, std::vector<std::pair<void *, dealloc_func>> &out) {
+            return clearList(i, &out);
+        }
+        void freeList(uint32_t i) {
+            for (std::pair<void *, dealloc_func> func_pair : mFreeLists[i]) {
                 func_pair.second(func_pair.first);
             }
-            previousFreeList.resize(0u);
+            bump(mFreedBytes, clearList(i, nullptr));
         }
     };
 
+    // a thread asks for the next epoch every RETIRE_BATCH retired objects or
+    // ADVANCE_BYTES retired bytes, a big rebuild retires few large nodes
+    static constexpr size_t RETIRE_BATCH = 64;
+    static constexpr size_t ADVANCE_BYTES = size_t(1) << 20;
+    // an EpochBatch passes through a quiescent point every BATCH_OPS operations
+    static constexpr uint32_t BATCH_OPS = 64;
+    // a thread holding garbage asks for the next epoch every IDLE_ADVANCE_ENTERS
+    // enters in one epoch, even if it retires nothing more
+    static constexpr uint32_t IDLE_ADVANCE_ENTERS = 1024;
+
     class EpochBasedMemoryReclamationStrategy {
+        typedef ThreadSpecificEpochBasedReclamationInformation ThreadInfo;
     public:
-        uint32_t NEXT_EPOCH[3] = {1, 2, 0};
-        uint32_t PREVIOUS_EPOCH[3] = {2, 0, 1};
-
-        std::atomic<uint32_t> mCurrentEpoch;
+        // monotonic from 1, the free lists are indexed by epoch % 3. Epoch 0
+        // is never entered: canAdvance() of epoch 0 would look for threads
+        // in epoch ~0, which is OUTSIDE
+        std::atomic<uint64_t> mCurrentEpoch;
+        std::array<std::atomic<int>, 3> mPinned{}; // snapshots holding each epoch % 3, see pin()
         tbb::enumerable_thread_specific<
             ThreadSpecificEpochBasedReclamationInformation,
             tbb::cache_aligned_allocator<
@@ -160,8 +371,109 @@ public:
             mThreadSpecificInformations;
 
     private:
+        // garbage handed over to the background reclaimer, tagged with the
+        // epoch it was retired in
+        struct Limbo {
+            uint64_t epoch;
+            size_t bytes;
+            std::vector<std::pair<void *, dealloc_func>> objects;
+        };
+        std::mutex mLimboMutex;
+        std::deque<Limbo> mLimbo;
+        std::atomic<size_t> mLimboBytes{0};
+        std::atomic<size_t> mLimboObjects{0};
+        std::atomic<size_t> mLimboFreedBytes{0};
+        std::atomic<bool> mReclaiming{false};
+        std::thread mReclaimer;
+        std::mutex mReclaimerMutex;
+        std::condition_variable mReclaimerCv;
+        bool mReclaimerStop = false;
+
         EpochBasedMemoryReclamationStrategy()
-            : mCurrentEpoch(0), mThreadSpecificInformations() {}
+            : mCurrentEpoch(1), mThreadSpecificInformations() {}
+
+        ~EpochBasedMemoryReclamationStrategy() {
+            stopBackgroundReclaimer();
+            for (Limbo& limbo : mLimbo) {
+                freeLimbo(limbo);
+            }
+        }
+
+        /// this thread's information, looked up in the ets once per thread
+        ThreadInfo &local() {
+            thread_local ThreadInfo *info = nullptr;
+            if (info == nullptr) info = &mThreadSpecificInformations.local();
+            return *info;
+        }
+
+        void enterEpoch(ThreadInfo &currentMemoryInformation) {
+            uint64_t currentEpoch = mCurrentEpoch.load(std::memory_order_acquire);
+            if (mReclaiming.load(std::memory_order_relaxed) &&
+                currentMemoryInformation.mPreviouslyAccessedEpoch != currentEpoch) {
+                handOver(currentMemoryInformation);
+            }
+            currentMemoryInformation.enter(currentEpoch);
+            if (currentMemoryInformation.doesThreadWantToAdvanceEpoch() &&
+                canAdvance(currentEpoch)) {
+                mCurrentEpoch.compare_exchange_strong(currentEpoch, currentEpoch + 1);
+            }
+        }
+
+        /// move the thread's garbage to the background reclaimer, so a thread
+        /// that stops entering doesn't keep it
+        void handOver(ThreadInfo &currentMemoryInformation) {
+            for (uint32_t i = 0; i < 3; i ++) {
+                if (currentMemoryInformation.mFreeLists[i].empty()) continue;
+                Limbo limbo;
+                limbo.epoch = currentMemoryInformation.mFreeEpochs[i].load(std::memory_order_relaxed);
+                limbo.bytes = currentMemoryInformation.takeList(i, limbo.objects);
+                mLimboBytes.fetch_add(limbo.bytes, std::memory_order_relaxed);
+                mLimboObjects.fetch_add(limbo.objects.size(), std::memory_order_relaxed);
+                std::lock_guard<std::mutex> lock(mLimboMutex);
+                mLimbo.push_back(std::move(limbo));
+            }
+        }
+
+        void freeLimbo(Limbo &limbo) {
+            for (std::pair<void *, dealloc_func> func_pair : limbo.objects) {
+                func_pair.second(func_pair.first);
+            }
+            mLimboBytes.fetch_sub(limbo.bytes, std::memory_order_relaxed);
+            mLimboObjects.fetch_sub(limbo.objects.size(), std::memory_order_relaxed);
+            mLimboFreedBytes.fetch_add(limbo.bytes, std::memory_order_relaxed);
+        }
+
+        void reclaimerLoop(std::chrono::microseconds period) {
+            std::unique_lock<std::mutex> lock(mReclaimerMutex);
+            while (!mReclaimerStop) {
+                mReclaimerCv.wait_for(lock, period);
+                uint64_t currentEpoch = mCurrentEpoch.load(std::memory_order_acquire);
+                if (mLimboObjects.load(std::memory_order_relaxed) > 0 && canAdvance(currentEpoch)) {
+                    mCurrentEpoch.compare_exchange_strong(currentEpoch, currentEpoch + 1);
+                }
+                reclaimLimbo();
+            }
+        }
+
+        /// free the handed over garbage retired at least three epochs ago
+        void reclaimLimbo() {
+            const uint64_t currentEpoch = mCurrentEpoch.load(std::memory_order_acquire);
+            std::deque<Limbo> ready;
+            {
+                std::lock_guard<std::mutex> lock(mLimboMutex);
+                for (auto it = mLimbo.begin(); it != mLimbo.end(); ) {
+                    if (it->epoch + 3 <= currentEpoch) {
+                        ready.push_back(std::move(*it));
+                        it = mLimbo.erase(it);
+                    } else {
+                        ++ it;
+                    }
+                }
+            }
+            for (Limbo& limbo : ready) {
+                freeLimbo(limbo);
+            }
+        }
 
     public:
         static EpochBasedMemoryReclamationStrategy *getInstance() {
@@ -169,21 +481,27 @@ public:
         return &instance;
         }
 
+        /// Nested sections only count. Inside an EpochBatch, every BATCH_OPS
+        /// directly nested sections (or sooner when the thread holds a lot of
+        /// garbage) re-enter the current epoch first: operations take no
+        /// pointers from one to the next, so between them is quiescent.
         void enterCriticalSection() {
-            ThreadSpecificEpochBasedReclamationInformation &currentMemoryInformation =
-                mThreadSpecificInformations.local();
-            uint32_t currentEpoch = mCurrentEpoch.load(std::memory_order_acquire);
-            currentMemoryInformation.enter(currentEpoch);
-            if (currentMemoryInformation.doesThreadWantToAdvanceEpoch() &&
-                canAdvance(currentEpoch)) {
-                mCurrentEpoch.compare_exchange_strong(currentEpoch,
-                                                    NEXT_EPOCH[currentEpoch]);
+            ThreadInfo &currentMemoryInformation = local();
+            if (currentMemoryInformation.mDepth++ > 0) {
+                if (currentMemoryInformation.mBatch && currentMemoryInformation.mDepth == 2 &&
+                    (++ currentMemoryInformation.mBatchOps % BATCH_OPS == 0 ||
+                     currentMemoryInformation.doesThreadWantToAdvanceEpoch())) {
+                    currentMemoryInformation.leave();
+                    enterEpoch(currentMemoryInformation);
+                }
+                return;
             }
+            enterEpoch(currentMemoryInformation);
         }
 
-        bool canAdvance(uint32_t currentEpoch) {
-            uint32_t previousEpoch = PREVIOUS_EPOCH[currentEpoch];
-            return !std::any_of(
+        bool canAdvance(uint64_t currentEpoch) {
+            uint64_t previousEpoch = currentEpoch - 1;
+            return mPinned[previousEpoch % 3].load() == 0 && !std::any_of(
                 mThreadSpecificInformations.begin(),
                 mThreadSpecificInformations.end(),
                 [previousEpoch](ThreadSpecificEpochBasedReclamationInformation const
@@ -193,13 +511,96 @@ public:
         }
 
         void leaveCriticialSection() {
-            ThreadSpecificEpochBasedReclamationInformation &currentMemoryInformation =
-                mThreadSpecificInformations.local();
-            currentMemoryInformation.leave();
+            ThreadInfo &currentMemoryInformation = local();
+            if (-- currentMemoryInformation.mDepth == 0) {
+                currentMemoryInformation.mBatch = false;
+                currentMemoryInformation.leave();
+            }
+        }
+
+        /// one critical section over many operations of this thread, see
+        /// EpochBatch
+        void enterBatch() {
+            enterCriticalSection();
+            ThreadInfo &currentMemoryInformation = local();
+            if (currentMemoryInformation.mDepth == 1) {
+                currentMemoryInformation.mBatch = true;
+                currentMemoryInformation.mBatchOps = 0;
+            }
+        }
+        void leaveBatch() { leaveCriticialSection(); }
+
+        void scheduleForDeletion(std::pair<void *, dealloc_func> func_pair, size_t bytes) {
+            ThreadInfo &currentMemoryInformation = local();
+            currentMemoryInformation.scheduleForDeletion(func_pair, bytes);
+            if (mReclaiming.load(std::memory_order_relaxed) &&
+                currentMemoryInformation.doesThreadWantToAdvanceEpoch()) {
+                handOver(currentMemoryInformation);
+            }
+        }
+
+        /// hold the current epoch like a thread that never leaves its
+        /// critical section, without tying it to a thread: nothing retired
+        /// from now on is freed until unpin()
+        uint64_t pin() {
+            while (true) {
+                uint64_t epoch = mCurrentEpoch.load();
+                mPinned[epoch % 3].fetch_add(1);
+                if (mCurrentEpoch.load() == epoch) return epoch;
+                mPinned[epoch % 3].fetch_sub(1);
+            }
+        }
+        void unpin(uint64_t epoch) { mPinned[epoch % 3].fetch_sub(1); }
+
+        /// Opt-in reclaimer thread. Threads then hand their garbage over in
+        /// batches instead of freeing it when they enter a new epoch, which
+        /// takes the frees off the operations and bounds what a thread that
+        /// stops calling into the index holds to one batch. The thread also
+        /// advances the epoch itself every period while garbage waits.
+        void startBackgroundReclaimer(std::chrono::microseconds period = std::chrono::microseconds(1000)) {
+            stopBackgroundReclaimer();
+            mReclaimerStop = false;
+            mReclaiming = true;
+            mReclaimer = std::thread(&EpochBasedMemoryReclamationStrategy::reclaimerLoop, this, period);
+        }
+        /// garbage already handed over is freed later, by the next reclaimer
+        /// or at exit
+        void stopBackgroundReclaimer() {
+            if (!mReclaimer.joinable()) return;
+            mReclaiming = false;
+            {
+                std::lock_guard<std::mutex> lock(mReclaimerMutex);
+                mReclaimerStop = true;
+            }
+            mReclaimerCv.notify_all();
+            mReclaimer.join();
+            reclaimLimbo();
         }
 
-        void scheduleForDeletion(std::pair<void *, dealloc_func> func_pair) {
-            mThreadSpecificInformations.local().scheduleForDeletion(func_pair);
+        ReclamationStats stats() {
+            ReclamationStats ret;
+            const uint64_t currentEpoch = mCurrentEpoch.load();
+            ret.epoch = currentEpoch - 1;
+            uint64_t oldest = currentEpoch;
+            for (ThreadInfo const &threadInformation : mThreadSpecificInformations) {
+                ret.pending_bytes += threadInformation.mPendingBytes.load(std::memory_order_relaxed);
+                ret.pending_objects += threadInformation.mPendingObjects.load(std::memory_order_relaxed);
+                ret.freed_bytes += threadInformation.mFreedBytes.load(std::memory_order_relaxed);
+                for (uint32_t i = 0; i < 3; i ++) {
+                    oldest = std::min(oldest, threadInformation.mFreeEpochs[i].load(std::memory_order_relaxed));
+                }
+            }
+            {
+                std::lock_guard<std::mutex> lock(mLimboMutex);
+                for (const Limbo& limbo : mLimbo) {
+                    oldest = std::min(oldest, limbo.epoch);
+                }
+            }
+            ret.pending_bytes += mLimboBytes.load(std::memory_order_relaxed);
+            ret.pending_objects += mLimboObjects.load(std::memory_order_relaxed);
+            ret.freed_bytes += mLimboFreedBytes.load(std::memory_order_relaxed);
+            ret.epoch_lag = currentEpoch - oldest;
+            return ret;
         }
     };
 
@@ -215,216 +616,771 @@ public:
         ~EpochGuard() { instance->leaveCriticialSection(); }
     };
 
+    /// Amortizes epoch entry over the operations a thread runs while it
+    /// holds one. Don't block in a batch: the epoch only moves when the
+    /// thread runs operations.
+    class EpochBatch {
+        EpochBasedMemoryReclamationStrategy *instance;
+
+    public:
+        EpochBatch() {
+            instance = EpochBasedMemoryReclamationStrategy::getInstance();
+            instance->enterBatch();
+        }
+
+        ~EpochBatch() { instance->leaveBatch(); }
+    };
+
     EpochBasedMemoryReclamationStrategy *ebr;
     
     typedef std::pair<T, P> V;
 
-    LIPP(double BUILD_LR_REMAIN = 0, bool QUIET = true)
+    struct ReadRestartStats {
+        uint64_t local = 0; // re-read the same node after a failed validation
+        uint64_t parent = 0; // node became obsolete, went back to its parent
+        uint64_t root = 0; // root changed under the reader
+    };
+    /// goto restart sites of insert_tree()
+    enum InsertRestartSite {
+        INSERT_ROOT_LOCK = 0, // root changed or locked on entry
+        INSERT_ROOT_GROW, // root grown for the key first
+        INSERT_PARENT_UNLOCK, // parent changed after the descent left it
+        INSERT_SLOT_LOCK, // node of the target slot changed before it was locked
+        INSERT_CHILD_CHECK, // node changed while its child pointer was read
+        INSERT_CHILD_LOCK, // child locked or obsolete
+        INSERT_RESTART_SITES
+    };
+    /// goto restart sites of adjust()
+    enum AdjustRestartSite {
+        ADJUST_NODE_LOCK = 0, // a path node changed before its counters were read
+        ADJUST_NODE_UNLOCK, // ... while it was found to need nothing
+        ADJUST_LOCAL_SWITCH, // ... on the way to the child a local rebuild picked
+        ADJUST_REBUILD, // rebuild_locked() found the subtree changed
+        ADJUST_RESTART_SITES
+    };
+    // why enable_htm()'s transactions aborted, indices into htm_aborts
+    enum HtmAbortCause {
+        HTM_ABORT_CONFLICT, // another core touched its cache lines
+        HTM_ABORT_CAPACITY, // its lines didn't fit the cache
+        HTM_ABORT_LOCKED, // the leaf was locked or changed since it was read
+        HTM_ABORT_OTHER, // interrupts, faults, unsupported instructions
+        HTM_ABORT_CAUSES
+    };
+    struct PoolStats {
+        uint64_t allocations = 0; // two-key node blocks handed out
+        uint64_t local_hits = 0; // of them, from the thread's own cache
+        uint64_t batch_refills = 0; // a thread's cache refilled from the shared list
+        uint64_t slab_refills = 0; // or from a new slab
+    };
+    static constexpr uint32_t DEPTH_SAMPLE_PERIOD = 64;
+
+    LIPP(double BUILD_LR_REMAIN = 0, bool QUIET = true, size_t TWO_POOL_WARMUP = 1 << 16)
         : BUILD_LR_REMAIN(BUILD_LR_REMAIN), QUIET(QUIET) {
         {
-            std::vector<Node*> nodes;
-            for (int _ = 0; _ < 1e7; _ ++) {
-                Node* node = build_tree_two(T(0), P(), T(1), P());
-                nodes.push_back(node);
-            }
-            for (auto node : nodes) {
-                destroy_tree(node);
-            }
+            TwoNodePool* pool = TwoNodePool::getInstance();
+            pool->reserve(TWO_POOL_WARMUP);
             if (!QUIET) {
-                printf("initial memory pool size = %lu\n", pending_two.size());
+                printf("initial memory pool size = %lu\n", pool->reserved());
             }
         }
-        if (USE_FMCD && !QUIET) {
-            printf("enable FMCD\n");
+        if constexpr (USE_FMCD) {
+            if (!QUIET) printf("enable FMCD\n");
         }
 
-        root = build_tree_none();
+        root = stripe_root(build_tree_none());
         ebr = EpochBasedMemoryReclamationStrategy::getInstance();
     }
     ~LIPP() {
-        destroy_tree(root);
+        stop_rebuild_workers();
+        destroy_root();
         root = NULL;
-        destory_pending();
+    }
+
+    /// Opt-in background rebuild: with num_workers > 0, adjust() only queues
+    /// subtrees that need a rebuild and dedicated threads rebuild them, so
+    /// inserting threads never run a large rebuild inline.
+    void start_rebuild_workers(int num_workers) {
+        RT_ASSERT(num_workers == 0 || lock_t::concurrent);
+        stop_rebuild_workers();
+        rebuild_stop = false;
+        for (int i = 0; i < num_workers; i ++) {
+            rebuild_workers.emplace_back(&LIPP::rebuild_worker, this);
+        }
+        async_rebuild = num_workers > 0;
+    }
+    /// stop the rebuild threads, subtrees still queued stay as they are and
+    /// are queued again by the next insert that finds them due
+    void stop_rebuild_workers() {
+        async_rebuild = false;
+        {
+            std::lock_guard<std::mutex> lock(rebuild_mutex);
+            rebuild_stop = true;
+        }
+        rebuild_cv.notify_all();
+        for (auto& worker : rebuild_workers) {
+            worker.join();
+        }
+        rebuild_workers.clear();
+        std::deque<std::pair<T, int>> dropped;
+        {
+            std::lock_guard<std::mutex> lock(rebuild_mutex);
+            dropped.swap(rebuild_queue);
+        }
+        EpochGuard guard;
+        for (auto& task : dropped) {
+            unqueue_rebuild(task.first, task.second);
+        }
+    }
+
+    /// Opt-in root cache: operations route the root slot of their key
+    /// through a read-only copy of the root's model and child pointers, one
+    /// per NUMA node, and start below the root without reading its lock
+    /// word, which every write to a root slot bumps. A cached child is only
+    /// taken while the root slot still holds it, so a stale copy costs a
+    /// detour through the root, and enough detours rebuild it. Keys the
+    /// root holds as data, and keys past its end, go through the root.
+    void enable_root_cache(bool on) {
+        RT_ASSERT(!on || lock_t::concurrent);
+        EpochGuard guard;
+        root_cache_on = on;
+        if (on) {
+            refresh_root_cache();
+        } else {
+            drop_root_cache();
+        }
+    }
+
+    /// Opt-in lock elision: insert_tree() writes its leaf slot, and counts
+    /// the insert on the path, in one RTM transaction that checks the
+    /// leaf's version instead of locking it, and takes the lock after
+    /// HTM_RETRIES aborts. Returns whether it's on, never in builds
+    /// without -mrtm, on CPUs without RTM or with NoLock nodes.
+    bool enable_htm(bool on) {
+        htm_on = on && lock_t::concurrent && htm_supported();
+        return htm_on;
     }
 
     void insert(const V& v) {
         insert(v.first, v.second);
     }
+    /// insert key, or replace its value if it is present
     void insert(const T& key, const P& value) {
         EpochGuard guard; // epoch memory reclaimation
-        root = insert_tree(root, key, value);
+        insert_tree(key, value);
+    }
+    /// insert a run of num_keys pairs sorted by key in asc order, a key
+    /// already present gets its value replaced. Made for ingesting
+    /// time-ordered keys: the root is grown to cover the run once and the
+    /// keys are bulk built per root slot, instead of being inserted and
+    /// colliding one by one. The root grows by at most a root width, keys
+    /// past that end up in a subtree below its last slot.
+    void append(const V* vs, int num_keys) {
+        if (num_keys == 0) return;
+        std::vector<T> keys(num_keys);
+        std::vector<P> values(num_keys);
+        for (int i = 0; i < num_keys; i ++) {
+            RT_ASSERT(i == 0 || vs[i].first > vs[i-1].first);
+            keys[i] = vs[i].first;
+            values[i] = vs[i].second;
+        }
+        EpochGuard guard; // epoch memory reclaimation
+        append_tree(keys.data(), values.data(), num_keys);
+    }
+    /// remove key, returns false if it was not present
+    bool erase(const T& key) {
+        EpochGuard guard; // epoch memory reclaimation
+        return erase_tree(key);
+    }
+    /// overwrite the value of an existing key, returns false if absent
+    bool update(const T& key, const P& value) {
+        EpochGuard guard; // epoch memory reclaimation
+        return update_tree(key, value);
     }
     P at(const T& key, bool skip_existence_check = true) const {
-
-        EpochGuard guard ;
-        //printf("At key - %d\n", key);
-        int restartCount = 0;
-        restart:
-        if (restartCount++)
-            yield(restartCount);
-        bool needRestart = false;
-
-         // epoch memory reclaimation
-        Node* node = root;
-
-        //lock
-        uint64_t version = node->readLockOrRestart(needRestart) ;
-        if(needRestart || (node!=root)) {
-            //printf("1At key - %d\n", key);
-            goto restart ;
+        EpochGuard guard;
+        Leaf leaf = read_leaf(key);
+        if (!skip_existence_check) {
+            RT_ASSERT(!leaf.none);
+            RT_ASSERT(leaf.key == key);
+        }
+        return leaf.value;
+    }
+    /// look up n keys at once, out[i] = at(keys[i], skip_existence_check).
+    /// Keys are walked down the tree interleaved, prefetching each key's next
+    /// bitmap byte and item before it's touched. A key whose optimistic
+    /// validation fails restarts alone from the root.
+    void at_batch(const T* keys, P* out, size_t n, bool skip_existence_check = true) const {
+        EpochGuard guard;
+        BatchState st[BATCH_WIDTH];
+        for (size_t base = 0; base < n; base += BATCH_WIDTH) {
+            const int width = static_cast<int>(std::min(n - base, BATCH_WIDTH));
+            const T* bkeys = keys + base;
+            for (int i = 0; i < width; i ++) {
+                st[i].restart_count = 0;
+                batch_restart(st[i], bkeys[i]);
             }
-
-        Node* parent = nullptr ;
-        uint64_t versionParent ;
-
-        while (true) {
-            int pos = PREDICT_POS(node, key) ; 
-            Node* inner = node ;
-
-            if(parent){
-                parent->readUnlockOrRestart(versionParent, needRestart);
-	            if (needRestart) {
-                    //printf("2At key - %d\n", key);
-                    goto restart;
+            int active = width;
+            while (active > 0) {
+                for (int i = 0; i < width; i ++) {
+                    if (st[i].done) continue;
+                    if (!batch_step(st[i], bkeys[i])) continue;
+
+                    Node* node = st[i].node;
+                    const int pos = st[i].pos;
+                    bool needRestart = false;
+                    if (skip_existence_check) {
+                        P value = slot_value(node, pos);
+                        node->readUnlockOrRestart(st[i].version, needRestart);
+                        if (needRestart) {
+                            batch_restart(st[i], bkeys[i]);
+                            continue;
+                        }
+                        out[base + i] = value;
+                    } else {
+                        const bool is_none = BITMAP_GET(node->none_bitmap, pos) == 1;
+                        P value = slot_value(node, pos);
+                        T kkey = node->items[pos].comp.data.key;
+                        node->readUnlockOrRestart(st[i].version, needRestart);
+                        if (needRestart) {
+                            batch_restart(st[i], bkeys[i]);
+                            continue;
+                        }
+                        RT_ASSERT(!is_none);
+                        RT_ASSERT(kkey == bkeys[i]);
+                        out[base + i] = value;
+                    }
+                    st[i].done = true;
+                    active --;
+                }
+            }
+        }
+    }
+    /// out[i] = exists(keys[i]), walked like at_batch.
+    void exists_batch(const T* keys, bool* out, size_t n) const {
+        EpochGuard guard;
+        BatchState st[BATCH_WIDTH];
+        for (size_t base = 0; base < n; base += BATCH_WIDTH) {
+            const int width = static_cast<int>(std::min(n - base, BATCH_WIDTH));
+            const T* bkeys = keys + base;
+            for (int i = 0; i < width; i ++) {
+                st[i].restart_count = 0;
+                batch_restart(st[i], bkeys[i]);
+            }
+            int active = width;
+            while (active > 0) {
+                for (int i = 0; i < width; i ++) {
+                    if (st[i].done) continue;
+                    if (!batch_step(st[i], bkeys[i])) continue;
+
+                    Node* node = st[i].node;
+                    const int pos = st[i].pos;
+                    bool needRestart = false;
+                    const bool is_none = BITMAP_GET(node->none_bitmap, pos) == 1;
+                    T kkey = node->items[pos].comp.data.key;
+                    node->readUnlockOrRestart(st[i].version, needRestart);
+                    if (needRestart) {
+                        batch_restart(st[i], bkeys[i]);
+                        continue;
+                    }
+                    out[base + i] = !is_none && kkey == bkeys[i];
+                    st[i].done = true;
+                    active --;
                 }
             }
+        }
+    }
+    bool exists(const T& key) const {
+        EpochGuard guard; // epoch memory reclaimation
+        Leaf leaf = read_leaf(key);
+        return !leaf.none && leaf.key == key;
+    }
+    /// keys in the index, read off the root's counters without stopping
+    /// writers
+    size_t size() const {
+        EpochGuard guard;
+        return node_size(load_root());
+    }
+    struct RebuildStats {
+        long long rebuilds = 0; // growth rebuilds started by adjust()
+        long long local_rebuilds = 0; // of them, below the node that needed it
+        long long keys = 0; // keys rewritten by them
+        long long full_keys = 0; // keys rebuilding every needing node whole would have rewritten
+    };
+    /// growth rebuilds so far, keys / inserts is the rebuild cost per insert
+    RebuildStats rebuild_stats() const {
+        RebuildStats ret;
+        ret.rebuilds = stats.rebuilds.load();
+        ret.local_rebuilds = stats.local_rebuilds.load();
+        ret.keys = stats.rebuild_keys.load();
+        ret.full_keys = stats.full_rebuild_keys.load();
+        return ret;
+    }
+    /// garbage retired and not freed yet, shared by every LIPP of this type
+    ReclamationStats reclamation_stats() const {
+        return ebr->stats();
+    }
+    /// restarts taken by at()/exists() so far, summed over all threads
+    ReadRestartStats read_restart_stats() const {
+        ReadRestartStats sum;
+        for (const ThreadMetrics& local : thread_metrics) {
+            sum.local += local.read_restarts.local.load(std::memory_order_relaxed);
+            sum.parent += local.read_restarts.parent.load(std::memory_order_relaxed);
+            sum.root += local.read_restarts.root.load(std::memory_order_relaxed);
+        }
+        return sum;
+    }
+    struct Metrics {
+        ReadRestartStats read_restarts; // at()/exists()
+        uint64_t insert_restarts[INSERT_RESTART_SITES] = {};
+        uint64_t adjust_restarts[ADJUST_RESTART_SITES] = {};
+        RebuildStats rebuilds;
+        long long fmcd_success = 0; // nodes built with the FMCD model
+        long long fmcd_broken = 0; // nodes FMCD gave up on for the fallback model
+        uint64_t depth_samples = 0; // one descent in DEPTH_SAMPLE_PERIOD
+        double avg_depth = 0; // nodes on a sampled descent's path
+        int max_depth = 0;
+        PoolStats pool; // shared by every LIPP of this type, as is reclamation
+        double pool_hit_rate = 0; // local_hits / allocations
+        ReclamationStats reclamation;
+        uint64_t root_cache_builds = 0; // root caches published, see enable_root_cache()
+        uint64_t root_cache_misses = 0; // operations that found it stale or missing
+        uint64_t htm_commits = 0; // inserts done in a transaction, see enable_htm()
+        uint64_t htm_aborts[HTM_ABORT_CAUSES] = {};
+        uint64_t htm_fallbacks = 0; // inserts that took the lock after aborts
+    };
+    /// every runtime counter at once. The per-thread shards are summed
+    /// without stopping writers, so a read races only with increments still
+    /// in flight.
+    Metrics metrics() const {
+        Metrics ret;
+        ret.read_restarts = read_restart_stats();
+        uint64_t depth_sum = 0;
+        for (const ThreadMetrics& local : thread_metrics) {
+            constexpr auto relaxed = std::memory_order_relaxed;
+            for (int i = 0; i < INSERT_RESTART_SITES; i ++) ret.insert_restarts[i] += local.insert_restarts[i].load(relaxed);
+            for (int i = 0; i < ADJUST_RESTART_SITES; i ++) ret.adjust_restarts[i] += local.adjust_restarts[i].load(relaxed);
+            ret.depth_samples += local.depth_samples.load(relaxed);
+            depth_sum += local.depth_sum.load(relaxed);
+            ret.max_depth = std::max(ret.max_depth, local.max_depth.load(relaxed));
+            ret.root_cache_misses += local.root_cache_misses.load(relaxed);
+            ret.htm_commits += local.htm_commits.load(relaxed);
+            for (int i = 0; i < HTM_ABORT_CAUSES; i ++) ret.htm_aborts[i] += local.htm_aborts[i].load(relaxed);
+            ret.htm_fallbacks += local.htm_fallbacks.load(relaxed);
+        }
+        if (ret.depth_samples) ret.avg_depth = static_cast<double>(depth_sum) / ret.depth_samples;
+        ret.rebuilds = rebuild_stats();
+        ret.fmcd_success = stats.fmcd_success_times.load();
+        ret.fmcd_broken = stats.fmcd_broken_times.load();
+        ret.pool = TwoNodePool::getInstance()->stats();
+        if (ret.pool.allocations) ret.pool_hit_rate = static_cast<double>(ret.pool.local_hits) / ret.pool.allocations;
+        ret.reclamation = reclamation_stats();
+        ret.root_cache_builds = root_cache_builds.load(std::memory_order_relaxed);
+        return ret;
+    }
+    /// call callback(key, value) for every key in [lo, hi] in ascending
+    /// order until it returns false
+    template<class F>
+    void range_scan(const T& lo, const T& hi, F callback) const {
+        EpochGuard guard;
+        scan_range(lo, true, hi, callback);
+    }
+    /// copy at most max_num pairs with key in [lo, hi] into out, returns the
+    /// number of pairs copied
+    size_t range_scan(const T& lo, const T& hi, V* out, size_t max_num) const {
+        size_t num = 0;
+        if (max_num == 0) return 0;
+        range_scan(lo, hi, [&](const T& key, const P& value) {
+            out[num ++] = V(key, value);
+            return num < max_num;
+        });
+        return num;
+    }
 
-            parent = inner ;
-            versionParent = version ;
+    /// Forward iterator over [lo, hi]. Pairs are fetched in chunks with
+    /// range_scan, so no epoch or lock is held between increments and the
+    /// index may be modified while iterating.
+    class Iterator {
+        static constexpr size_t CHUNK_SIZE = 256;
+
+        const LIPP* index;
+        T hi;
+        std::vector<V> buffer;
+        size_t cur;
+        bool exhausted;
+
+        void fill(const T& lo, bool lo_inclusive) {
+            buffer.clear();
+            cur = 0;
+            index->fill_chunk(lo, lo_inclusive, hi, buffer, CHUNK_SIZE);
+            exhausted = buffer.size() < CHUNK_SIZE;
+        }
 
-            if (BITMAP_GET(node->child_bitmap, pos) == 1) {
-                node = inner->items[pos].comp.child ;
-                //std::cout << node->get_version_number() << std::endl;
-                inner->checkOrRestart(version, needRestart) ;
-                if(needRestart) {
-                    //printf("3At key - %d\n", key);
-                    goto restart;
-                }
-                version = node->readLockOrRestart(needRestart) ;
-                if(needRestart) {
-                    // std::cout << "Version " << node->get_version_number() << " in key " << key << "\n";
-                    // std::cout << node->isObsolete() << " " << node->isLocked() << "\n"; 
-                    //printf("4At key - %d, %d\n", key, &node);
-                    goto restart;
-                }
-                //printf("************************************************************************************************************************************************************************************************************************************************************************************************************************************************************************************************************************************************************************************************************************************************************************\n\n") ;
-            } else {
-                if (skip_existence_check) {
-                    P value = node->items[pos].comp.data.value ;
+    public:
+        Iterator(const LIPP* index, const T& lo, const T& hi)
+            : index(index), hi(hi), cur(0), exhausted(false) {
+            fill(lo, true);
+        }
 
-                    //unlock
-                    node->readUnlockOrRestart(version, needRestart) ;
-                    if(needRestart) {
-                    //printf("5At key - %d\n", key);
-                    goto restart;
-                }
+        bool valid() const { return cur < buffer.size(); }
+        const T& key() const { return buffer[cur].first; }
+        const P& value() const { return buffer[cur].second; }
+        const V& operator*() const { return buffer[cur]; }
+        const V* operator->() const { return &buffer[cur]; }
+
+        Iterator& operator++() {
+            cur ++;
+            if (cur == buffer.size() && !exhausted) {
+                const T last = buffer.back().first;
+                fill(last, false);
+            }
+            return *this;
+        }
+    };
 
-                    return value ;
-                } else {
-                    if (BITMAP_GET(node->none_bitmap, pos) == 1) {
-                        //unlock
-                        node->readUnlockOrRestart(version, needRestart) ;
-                        if(needRestart){
-                            //printf("6At key - %d\n", key);
-                            goto restart;
-                        }
+    /// iterator at the first key >= lo, ending after hi
+    Iterator lower_bound(const T& lo, const T& hi = KeyTraits<T>::max()) const {
+        return Iterator(this, lo, hi);
+    }
 
-                        RT_ASSERT(false);
-                    } else if (BITMAP_GET(node->child_bitmap, pos) == 0) {
-                        P value = node->items[pos].comp.data.value ;
-                        T kkey = node->items[pos].comp.data.key ;
+private:
+    struct SnapshotVersions;
 
-                        //unlock
-                        node->readUnlockOrRestart(version, needRestart) ;
-                        if(needRestart){
-                            //printf("7At key - %d\n", key);
-                            goto restart;
-                        }
+public:
+    /// Read-only view of the index as of snapshot(). Writers keep going: the
+    /// first write to a node after the newest snapshot copies the node's
+    /// slots aside, and a snapshot reads those copies of the nodes changed
+    /// since it was taken. While any snapshot is alive nothing retired is
+    /// freed. Snapshots must be dropped before the LIPP, bulk_load() and
+    /// open_mmap().
+    class Snapshot {
+        friend class LIPP;
+
+        LIPP* index;
+        Node* root;
+        std::shared_ptr<SnapshotVersions> versions;
+        uint64_t epoch;
+
+        Snapshot(LIPP* index, Node* root, std::shared_ptr<SnapshotVersions> versions, uint64_t epoch)
+            : index(index), root(root), versions(std::move(versions)), epoch(epoch) {}
 
-                        RT_ASSERT( kkey == key);
-                        return value ;
-                    }
-                }
-            }
+    public:
+        Snapshot(const Snapshot&) = delete;
+        Snapshot& operator=(const Snapshot&) = delete;
+        Snapshot(Snapshot&& other)
+            : index(other.index), root(other.root), versions(std::move(other.versions)), epoch(other.epoch) {
+            other.index = nullptr;
         }
-    }
-    bool exists(const T& key) const {
-        EpochGuard guard; // epoch memory reclaimation
-        Node* node = root;
-        while (true) {
-            int pos = PREDICT_POS(node, key);
-            if (BITMAP_GET(node->none_bitmap, pos) == 1) {
-                return false;
-            } else if (BITMAP_GET(node->child_bitmap, pos) == 0) {
-                return node->items[pos].comp.data.key == key;
-            } else {
-                node = node->items[pos].comp.child;
+        ~Snapshot() {
+            if (index == nullptr) return;
+            index->release_versions(std::move(versions));
+            index->ebr->unpin(epoch);
+        }
+
+        bool exists(const T& key) const {
+            Leaf leaf = index->snapshot_leaf(*this, key);
+            return !leaf.none && leaf.key == key;
+        }
+        P at(const T& key, bool skip_existence_check = true) const {
+            Leaf leaf = index->snapshot_leaf(*this, key);
+            if (!skip_existence_check) {
+                RT_ASSERT(!leaf.none);
+                RT_ASSERT(leaf.key == key);
             }
+            return leaf.value;
+        }
+        /// call callback(key, value) for every key in [lo, hi] in ascending
+        /// order until it returns false
+        template<class F>
+        void range_scan(const T& lo, const T& hi, F callback) const {
+            index->snapshot_scan(*this, lo, hi, callback);
         }
+        size_t range_scan(const T& lo, const T& hi, V* out, size_t max_num) const {
+            size_t num = 0;
+            if (max_num == 0) return 0;
+            range_scan(lo, hi, [&](const T& key, const P& value) {
+                out[num ++] = V(key, value);
+                return num < max_num;
+            });
+            return num;
+        }
+    };
+
+    /// O(1): no node is copied until a writer first touches it
+    Snapshot snapshot() {
+        const uint64_t epoch = ebr->pin(); // before the root is read
+        std::shared_ptr<SnapshotVersions> versions = std::make_shared<SnapshotVersions>();
+        std::lock_guard<std::mutex> lock(snapshot_mutex);
+        versions->ts = ++ snapshot_clock;
+        if (std::shared_ptr<SnapshotVersions> newest = latest_versions.lock()) {
+            newest->next_raw.store(versions.get(), std::memory_order_release);
+            newest->next = versions;
+        }
+        latest_versions = versions;
+        // a writer that sees the count sees this generation
+        newest_versions.store(versions.get(), std::memory_order_release);
+        num_snapshots.fetch_add(1);
+        return Snapshot(this, load_root(), std::move(versions), epoch);
     }
+
     void bulk_load(const V* vs, int num_keys) {
         if (num_keys == 0) {
-            destroy_tree(root);
-            root = build_tree_none();
+            destroy_root();
+            root = stripe_root(build_tree_none());
             return;
         }
         if (num_keys == 1) {
-            destroy_tree(root);
-            root = build_tree_none();
+            destroy_root();
+            root = stripe_root(build_tree_none());
             insert(vs[0]);
             return;
         }
         if (num_keys == 2) {
-            destroy_tree(root);
-            root = build_tree_two(vs[0].first, vs[0].second, vs[1].first, vs[1].second);
+            destroy_root();
+            root = stripe_root(build_tree_two(vs[0].first, vs[0].second, vs[1].first, vs[1].second));
             return;
         }
 
         RT_ASSERT(num_keys > 2);
-        for (int i = 1; i < num_keys; i ++) {
-            RT_ASSERT(vs[i].first > vs[i-1].first);
-        }
-
         T* keys = new T[num_keys];
         P* values = new P[num_keys];
-        for (int i = 0; i < num_keys; i ++) {
-            keys[i] = vs[i].first;
-            values[i] = vs[i].second;
-        }
-        destroy_tree(root);
-        root = build_tree_bulk(keys, values, num_keys);
+        tbb::parallel_for(tbb::blocked_range<int>(0, num_keys), [&](const tbb::blocked_range<int>& r) {
+            for (int i = r.begin(); i < r.end(); i ++) {
+                RT_ASSERT(i == 0 || vs[i].first > vs[i-1].first);
+                keys[i] = vs[i].first;
+                values[i] = vs[i].second;
+            }
+        });
+        destroy_root();
+        root = stripe_root(build_tree_bulk(keys, values, num_keys));
         delete[] keys;
         delete[] values;
     }
 
-    void show() const {
-        printf("============= SHOW LIPP ================\n");
-
-        std::stack<Node*> s;
-        s.push(root);
-        while (!s.empty()) {
-            Node* node = s.top(); s.pop();
-
-            printf("Node(%p, a = %lf, b = %lf, num_items = %d)", node, node->model.a, node->model.b, node->num_items);
-            printf("[");
-            int first = 1;
-            for (int i = 0; i < node->num_items; i ++) {
-                if (!first) {
-                    printf(", ");
+    /// NUMA placement of the tree as it is, for runs where every thread
+    /// reads the top levels and the threads of each NUMA node work on keys
+    /// of their own. The nodes less than top_levels deep are copied into
+    /// mappings of their own interleaved over numa_nodes, and so is a root
+    /// that later replaces the current one. Each subtree below them moves to numa_nodes[i]
+    /// when its keys are in range i: before boundaries[i] and from
+    /// boundaries[i - 1] on. Nodes built later stay where their builder
+    /// first touches them. Must not run concurrently with writers.
+    /// Returns the pages moved, 0 without LIPP_NUMA.
+    size_t place_numa(int top_levels, const std::vector<T>& boundaries, const std::vector<int>& numa_nodes) {
+        RT_ASSERT(boundaries.size() + 1 == numa_nodes.size());
+        #if LIPP_NUMA
+        EpochGuard guard;
+        numa_interleave = numa_nodes;
+        size_t moved = 0;
+        std::vector<std::vector<void*>> pages(numa_nodes.size());
+        // <node, depth, range of its subtree, -1 above top_levels, parent, slot in it>
+        std::vector<std::tuple<Node*, int, int, Node*, int>> stack;
+        stack.emplace_back(load_root(), 0, -1, nullptr, 0);
+        while (!stack.empty()) {
+            auto [node, depth, range, parent, pos] = stack.back();
+            stack.pop_back();
+            if (node->in_image) continue;
+            if (depth < top_levels) {
+                if (Node* copy = interleave_copy(node)) {
+                    // writers are stopped, readers that still see node restart on it being obsolete
+                    if (parent) {
+                        store_child(parent->items[pos], copy);
+                    } else {
+                        root.store(copy, std::memory_order_release);
+                        drop_root_cache();
+                    }
+                    write_lock_child(node);
+                    node->stripes = nullptr; // the copy's now
+                    retire_nodes({node});
+                    node = copy;
+                    moved += node_block_size(node->num_items) / page_size();
                 }
-                first = 0;
-                if (BITMAP_GET(node->none_bitmap, i) == 1) {
-                    printf("None");
-                } else if (BITMAP_GET(node->child_bitmap, i) == 0) {
-                    std::stringstream s;
-                    s << node->items[i].comp.data.key;
-                    printf("Key(%s)", s.str().c_str());
-                } else {
-                    printf("Child(%p)", node->items[i].comp.child);
-                    s.push(node->items[i].comp.child);
+            } else {
+                if (range < 0) {
+                    T key;
+                    if (!subtree_key(node, key)) continue; // nothing below to keep near
+                    range = std::upper_bound(boundaries.begin(), boundaries.end(), key) - boundaries.begin();
                 }
+                for_node_memory(node, [&](const void* p, size_t bytes) { node_pages(p, bytes, pages[range]); });
             }
-            printf("]\n");
+            for (int i = 0; i < node->num_items; i ++) {
+                if (BITMAP_GET(node->child_bitmap, i) == 1) {
+                    stack.emplace_back(node->items[i].comp.child, depth + 1, range, node, i);
+                }
+            }
+        }
+        for (size_t i = 0; i < pages.size(); i ++) {
+            moved += move_pages_to(pages[i], numa_nodes[i]);
+        }
+        return moved;
+        #else
+        (void) top_levels;
+        return 0;
+        #endif
+    }
+
+    /// Write the tree to path as an image open_mmap() can serve lookups
+    /// from. Nodes are laid out breadth first in their co-allocated block
+    /// layout with pointers written against IMAGE_BASE. Must not run
+    /// concurrently with writers. fingerprint is kept in the header for
+    /// open_mmap() to check, e.g. a hash of the keys and config the tree
+    /// was built from. Returns false on I/O errors.
+    bool save(const char* path, uint64_t fingerprint = 0) const {
+        FILE* file = fopen(path, "wb");
+        if (file == NULL) return false;
+
+        ImageHeader header;
+        memset(&header, 0, sizeof(header));
+        header.magic = IMAGE_MAGIC;
+        header.format_version = IMAGE_FORMAT_VERSION;
+        header.key_size = sizeof(T);
+        header.payload_size = sizeof(P);
+        header.node_size = sizeof(Node);
+        header.item_size = sizeof(Item);
+        header.bitmap_size = sizeof(bitmap_t);
+        header.split_values = SOA;
+        header.fingerprint = fingerprint;
+        header.base = IMAGE_BASE;
+        header.root_offset = sizeof(ImageHeader);
+        bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+
+        // offsets are handed out in the same order the nodes are written
+        std::deque<Node*> queue;
+        std::vector<uint64_t> striped;
+        std::vector<char> block;
+        uint64_t offset = sizeof(ImageHeader);
+        uint64_t next_offset = offset + node_block_size(root.load()->num_items);
+        queue.push_back(root);
+        while (ok && !queue.empty()) {
+            Node* node = queue.front(); queue.pop_front();
+            const int num_items = node->num_items;
+            const int bitmap_size = BITMAP_SIZE(num_items);
+            block.assign(node_block_size(num_items), 0);
+
+            Node* image = reinterpret_cast<Node*>(block.data());
+            memcpy(static_cast<void*>(image), node, sizeof(Node));
+            image->typeVersionLockObsolete = 0b100;
+            image->in_image = 1;
+            image->interleaved = 0;
+            image->rebuild_queued = false;
+            image->stripes = nullptr;
+            image->snapshot_ts = 0;
+            image->counters.size.store(node_size(node), std::memory_order_relaxed);
+            image->counters.num_inserts.store(node_num_inserts(node), std::memory_order_relaxed);
+            image->counters.num_insert_to_data.store(node_num_insert_to_data(node), std::memory_order_relaxed);
+            image->counters.ticks.store(0, std::memory_order_relaxed);
+            image->none_bitmap = reinterpret_cast<bitmap_t*>(IMAGE_BASE + offset + sizeof(Node));
+            image->child_bitmap = image->none_bitmap + bitmap_size;
+            image->items = reinterpret_cast<Item*>(IMAGE_BASE + offset + node_items_offset(num_items));
+            image->values = SOA ? reinterpret_cast<P*>(IMAGE_BASE + offset + node_values_offset(num_items)) : nullptr;
+            if (node->stripes) {
+                striped.push_back(offset);
+            }
+
+            bitmap_t* none_bitmap = reinterpret_cast<bitmap_t*>(block.data() + sizeof(Node));
+            memcpy(none_bitmap, node->none_bitmap, sizeof(bitmap_t) * bitmap_size);
+            memcpy(none_bitmap + bitmap_size, node->child_bitmap, sizeof(bitmap_t) * bitmap_size);
+            Item* items = reinterpret_cast<Item*>(block.data() + node_items_offset(num_items));
+            P* values = reinterpret_cast<P*>(block.data() + node_values_offset(num_items));
+            for (int i = 0; i < num_items; i ++) {
+                if (BITMAP_GET(node->child_bitmap, i) == 1) {
+                    Node* child = node->items[i].comp.child;
+                    items[i].comp.child = reinterpret_cast<Node*>(IMAGE_BASE + next_offset);
+                    next_offset += node_block_size(child->num_items);
+                    queue.push_back(child);
+                } else {
+                    items[i] = node->items[i];
+                    if constexpr (SOA) values[i] = node->values[i];
+                }
+            }
+
+            ok = fwrite(block.data(), block.size(), 1, file) == 1;
+            offset += block.size();
+        }
+
+        header.num_striped = striped.size();
+        header.striped_offset = offset;
+        header.file_size = offset + sizeof(uint64_t) * striped.size();
+        ok = ok && (striped.empty() || fwrite(striped.data(), sizeof(uint64_t), striped.size(), file) == striped.size());
+        ok = ok && fseek(file, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, file) == 1;
+        return fclose(file) == 0 && ok;
+    }
+    /// Replace the tree by the image saved at path. The file is mapped
+    /// private and paged in lazily as lookups touch it: nothing but the
+    /// header and the large nodes is read on open. Writers modify mapped
+    /// nodes in place, the kernel copies a page on its first write; nodes
+    /// retired by rebuilds stay in the mapping until the tree is destroyed or
+    /// replaced. If IMAGE_BASE is taken the image is mapped elsewhere and
+    /// every node is relocated, which reads the whole file. Must not run
+    /// concurrently with other operations. Returns false, leaving the tree
+    /// as it was, if the image can't be opened, was saved by a different
+    /// build or with a fingerprint other than fingerprint.
+    bool open_mmap(const char* path, uint64_t fingerprint = 0) {
+        const int fd = open(path, O_RDONLY);
+        if (fd < 0) return false;
+        ImageHeader header;
+        struct stat st;
+        if (pread(fd, &header, sizeof(header), 0) != sizeof(header)
+            || header.magic != IMAGE_MAGIC
+            || header.format_version != IMAGE_FORMAT_VERSION
+            || header.key_size != sizeof(T) || header.payload_size != sizeof(P)
+            || header.node_size != sizeof(Node) || header.item_size != sizeof(Item)
+            || header.bitmap_size != sizeof(bitmap_t) || header.split_values != SOA
+            || header.fingerprint != fingerprint
+            || fstat(fd, &st) != 0 || static_cast<uint64_t>(st.st_size) < header.file_size) {
+            close(fd);
+            return false;
+        }
+        void* base = mmap(reinterpret_cast<void*>(header.base), header.file_size,
+                          PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (base == MAP_FAILED) return false;
+
+        destroy_root();
+        image_base = base;
+        image_size = header.file_size;
+        char* image = static_cast<char*>(base);
+        Node* image_root = reinterpret_cast<Node*>(image + header.root_offset);
+        if (base != reinterpret_cast<void*>(header.base)) {
+            relocate_image(image_root, image - reinterpret_cast<char*>(header.base));
+        }
+        const uint64_t* striped = reinterpret_cast<const uint64_t*>(image + header.striped_offset);
+        for (uint64_t i = 0; i < header.num_striped; i ++) {
+            Node* node = reinterpret_cast<Node*>(image + striped[i]);
+            node->stripes = new_stripes();
+            image_stripes.push_back(node->stripes);
+        }
+        root = image_root;
+        return true;
+    }
+
+    void show() const {
+        printf("============= SHOW LIPP ================\n");
+
+        std::stack<Node*> s;
+        s.push(root);
+        while (!s.empty()) {
+            Node* node = s.top(); s.pop();
+
+            printf("Node(%p, a = %lf, c = %lf, num_items = %d)", node, node->model.a, node->model.c, node->num_items);
+            printf("[");
+            int first = 1;
+            for (int i = 0; i < node->num_items; i ++) {
+                if (!first) {
+                    printf(", ");
+                }
+                first = 0;
+                if (BITMAP_GET(node->none_bitmap, i) == 1) {
+                    printf("None");
+                } else if (BITMAP_GET(node->child_bitmap, i) == 0) {
+                    std::stringstream s;
+                    s << node->items[i].comp.data.key;
+                    printf("Key(%s)", s.str().c_str());
+                } else {
+                    printf("Child(%p)", node->items[i].comp.child);
+                    s.push(node->items[i].comp.child);
+                }
+            }
+            printf("]\n");
         }
     }
     void print_depth() const {
@@ -462,20 +1418,22 @@ public:
             for (int i = 0; i < node->num_items; i ++) {
                 if (BITMAP_GET(node->child_bitmap, i) == 1) {
                     s.push(node->items[i].comp.child);
-                    sum_size += node->items[i].comp.child->size;
+                    sum_size += node_size(node->items[i].comp.child);
                 } else if (BITMAP_GET(node->none_bitmap, i) != 1) {
                     sum_size ++;
                 }
             }
-            RT_ASSERT(sum_size == node->size);
+            RT_ASSERT(sum_size == node_size(node));
         }
     }
     void print_stats() const {
         printf("======== Stats ===========\n");
-        if (USE_FMCD) {
-            printf("\t fmcd_success_times = %lld\n", stats.fmcd_success_times);
-            printf("\t fmcd_broken_times = %lld\n", stats.fmcd_broken_times);
+        if constexpr (USE_FMCD) {
+            printf("\t fmcd_success_times = %lld\n", stats.fmcd_success_times.load());
+            printf("\t fmcd_broken_times = %lld\n", stats.fmcd_broken_times.load());
         }
+        printf("\t rebuilds = %lld (local %lld), keys rewritten = %lld (whole subtrees %lld)\n",
+               stats.rebuilds.load(), stats.local_rebuilds.load(), stats.rebuild_keys.load(), stats.full_rebuild_keys.load());
         #if COLLECT_TIME
         printf("\t time_scan_and_destory_tree = %lf\n", stats.time_scan_and_destory_tree);
         printf("\t time_build_tree_bulk = %lf\n", stats.time_build_tree_bulk);
@@ -490,22 +1448,22 @@ public:
             Node* node = s.top(); s.pop();
             bool has_child = false;
             if(ignore_child == false) {
-                size += sizeof(*node);
+                size += node_overhead(node->num_items);
             }
             for (int i = 0; i < node->num_items; i ++) {
                 if (ignore_child == true) {
-                    size += sizeof(Item);
+                    size += SLOT_SIZE;
                     has_child = true;
                 } else {
-                    if (total) size += sizeof(Item);
+                    if (total) size += SLOT_SIZE;
                 }
                 if (BITMAP_GET(node->child_bitmap, i) == 1) {
-                    if (!total) size += sizeof(Item);
+                    if (!total) size += SLOT_SIZE;
                     s.push(node->items[i].comp.child);
                 }
             }
             if (ignore_child == true && has_child) {
-                size += sizeof(*node);
+                size += node_overhead(node->num_items);
             }
         }
         return size;
@@ -513,480 +1471,2289 @@ public:
 
 private:
     struct Node;
+    struct ItemData { T key; P value; };
+    struct ItemKey { T key; }; // SoA, the value is in Node::values
     struct Item
     {
         union {
-            struct {
-                T key;
-                P value;
-            } data;
+            typename std::conditional<SOA, ItemKey, ItemData>::type data;
             Node* child;
         } comp;
     };
-    struct Node : public OptLock
+    // bytes allocated per slot
+    static constexpr size_t SLOT_SIZE = sizeof(Item) + (SOA ? sizeof(P) : 0);
+    struct NodeCounters
+    {
+        std::atomic<int> size; // current tree size (include sub nodes)
+        std::atomic<int> num_inserts;
+        std::atomic<int> num_insert_to_data;
+        std::atomic<int> ticks; // inserts and erases counted, paces adjust() checks
+    };
+    struct alignas(64) CounterStripe : NodeCounters {};
+    struct Node : public lock_t
     {
         int is_two; // is special node for only two keys
-        int build_size; // tree size (include sub nodes) when node created
-        int size; // current tree size (include sub nodes)
+        int in_image; // lives in a mapped image (see open_mmap), never freed
+        int interleaved; // a mapping of its own, see interleave_copy()
+        std::atomic<int> build_size; // tree size (include sub nodes) when node created, or last rebased
         int fixed; // fixed node will not trigger rebuild
-        int num_inserts;
-        std::atomic<int> num_insert_to_data;
         int num_items; // size of items
+        NodeCounters counters; // all counts if stripes is null, else the part not made by inserts/erases
+        CounterStripe* stripes; // COUNTER_STRIPES per-thread deltas for large nodes
         LinearModel<T> model;
         Item* items;
+        P* values; // SoA only, payloads parallel to items
         bitmap_t* none_bitmap; // 1 means None, 0 means Data or Child
         bitmap_t* child_bitmap; // 1 means Child. will always be 0 when none_bitmap is 1
+        std::atomic<bool> rebuild_queued; // waiting for a background rebuild
+        uint64_t snapshot_ts; // newest snapshot the slots were copied for, see preserve_for_snapshots()
     };
 
-    Node* root;
-    std::stack<Node*> pending_two;
-
-    static std::allocator<Node> node_allocator;
-    Node* new_nodes(int n)
-    {
-        Node* p = node_allocator.allocate(n);
-        p->typeVersionLockObsolete = 0b100;
+    std::atomic<Node*> root;
+
+    // One generation of node copies per snapshot, holding the slots of the
+    // nodes written after it was taken and before the next one was. A
+    // snapshot reads a node from the first generation, from its own on,
+    // that has a copy of it. Generations are chained oldest to newest and
+    // each snapshot holds its own, which keeps the newer ones alive. Writers
+    // only add to the newest, the map takes inserts alongside lookups.
+    struct SnapshotVersions {
+        uint64_t ts = 0;
+        tbb::concurrent_unordered_map<const Node*, Node*> copies;
+        std::shared_ptr<SnapshotVersions> next; // set once, under snapshot_mutex
+        std::atomic<SnapshotVersions*> next_raw{nullptr}; // next, for readers
+
+        ~SnapshotVersions() {
+            for (auto& copy : copies) {
+                delete_node(copy.second);
+            }
+        }
+        Node* find(const Node* node) const {
+            auto it = copies.find(node);
+            return it == copies.end() ? nullptr : it->second;
+        }
+    };
+    std::mutex snapshot_mutex; // taking and dropping snapshots
+    std::weak_ptr<SnapshotVersions> latest_versions; // under snapshot_mutex
+    // the newest generation for writers, null once no snapshot is left
+    std::atomic<SnapshotVersions*> newest_versions{nullptr};
+    std::atomic<int> num_snapshots{0};
+    uint64_t snapshot_clock = 0; // under snapshot_mutex
+
+    static void delete_versions(void* versions) {
+        delete static_cast<std::shared_ptr<SnapshotVersions>*>(versions);
+    }
+    /// drop a snapshot's hold on its generation through ebr: a writer that
+    /// read it as the newest before a later snapshot was taken may still be
+    /// adding copies to it
+    void release_versions(std::shared_ptr<SnapshotVersions> versions) {
+        std::lock_guard<std::mutex> lock(snapshot_mutex);
+        if (num_snapshots.fetch_sub(1) == 1) newest_versions.store(nullptr, std::memory_order_release);
+        EpochGuard guard;
+        ebr->scheduleForDeletion(std::make_pair(static_cast<void*>(new std::shared_ptr<SnapshotVersions>(std::move(versions))),
+                                                delete_versions), sizeof(SnapshotVersions));
+    }
 
-        RT_ASSERT(p != NULL && p != (Node*)(-1));
-        return p;
+    // image files written by save(), read back by open_mmap()
+    struct alignas(64) ImageHeader {
+        uint64_t magic;
+        uint32_t format_version;
+        uint32_t key_size;
+        uint32_t payload_size;
+        uint32_t node_size;
+        uint32_t item_size;
+        uint32_t bitmap_size; // sizeof(bitmap_t)
+        uint64_t base; // address the pointers in the image are written against
+        uint64_t file_size;
+        uint64_t root_offset;
+        uint64_t num_striped; // large nodes, they get counter stripes on open
+        uint64_t striped_offset; // their offsets, after the last node
+        uint32_t split_values; // SoA slots
+        uint64_t fingerprint; // what the tree was built from, given to save()
+    };
+    static_assert(sizeof(ImageHeader) % 64 == 0, "image nodes are 64-byte aligned");
+    static constexpr uint64_t IMAGE_MAGIC = 0x31474d495050494cull; // "LIPPIMG1"
+    static constexpr uint32_t IMAGE_FORMAT_VERSION = 8;
+    // far from where the heap and shared libraries go on x86-64 Linux
+    static constexpr uint64_t IMAGE_BASE = 0x300000000000ull;
+
+    void* image_base = nullptr;
+    size_t image_size = 0;
+    std::vector<CounterStripe*> image_stripes; // allocated for image nodes on open
+
+    /// destroy the tree and its root cache, and release the image it was
+    /// opened from, if any
+    void destroy_root() {
+        delete root_cache.exchange(nullptr);
+        destroy_tree(root);
+        for (CounterStripe* stripes : image_stripes) {
+            free(stripes);
+        }
+        image_stripes.clear();
+        if (image_base) {
+            munmap(image_base, image_size);
+            image_base = nullptr;
+            image_size = 0;
+        }
     }
-    static void delete_nodes(Node* p, int n)
-    {
-        node_allocator.deallocate(p, n);
+    /// rebase the pointers of an image mapped delta bytes away from its base
+    static void relocate_image(Node* image_root, ptrdiff_t delta) {
+        auto move = [delta](auto* p) {
+            return reinterpret_cast<decltype(p)>(reinterpret_cast<char*>(p) + delta);
+        };
+        std::stack<Node*> s;
+        s.push(image_root);
+        while (!s.empty()) {
+            Node* node = s.top(); s.pop();
+            node->items = move(node->items);
+            if constexpr (SOA) node->values = move(node->values);
+            node->none_bitmap = move(node->none_bitmap);
+            node->child_bitmap = move(node->child_bitmap);
+            for (int i = 0; i < node->num_items; i ++) {
+                if (BITMAP_GET(node->child_bitmap, i) == 1) {
+                    node->items[i].comp.child = move(node->items[i].comp.child);
+                    s.push(node->items[i].comp.child);
+                }
+            }
+        }
     }
 
-    void delete_oneNodes(Node* p)
-    {
-        node_allocator.deallocate(p, 1);
+    Node* load_root() const {
+        return root.load(std::memory_order_acquire);
+    }
+    /// publish a new root, the caller holds the write lock of the old one so
+    /// no other thread can swap it concurrently. The old root is retired by
+    /// the caller through retire_nodes(). After place_numa() the new root
+    /// is published as an interleaved copy and freed; returns the root
+    /// published.
+    Node* swap_root(Node* old_root, Node* new_root) {
+        stripe_root(new_root);
+        #if LIPP_NUMA
+        if (!numa_interleave.empty()) {
+            if (Node* copy = interleave_copy(new_root)) {
+                new_root->stripes = nullptr; // the copy's now
+                delete_all(new_root);
+                new_root = copy;
+            } else {
+                // reported, later roots stay where their builder put them
+                numa_interleave.clear();
+            }
+        }
+        #endif
+        bool swapped = root.compare_exchange_strong(old_root, new_root, std::memory_order_acq_rel);
+        RT_ASSERT(swapped);
+        // before the old root is retired, a cache of it may not outlive it
+        drop_root_cache();
+        return new_root;
     }
 
-    static std::allocator<Item> item_allocator;
-    Item* new_items(int n)
-    {
-        Item* p = item_allocator.allocate(n);
-        RT_ASSERT(p != NULL && p != (Item*)(-1));
-        return p;
+    // One replica of the root cache: the root's model and the children of
+    // its slots, compressed to the child bits of each 64 slots and the
+    // number of children before them, followed by the children in order
+    struct RankedWord {
+        uint64_t bits;
+        uint64_t rank;
+    };
+    struct RootCacheReplica {
+        LinearModel<T> model;
+        int num_items;
+        Item* items; // the root's own, to check a child is still there
+        bitmap_t* child_bitmap;
+        std::vector<RankedWord> words;
+        std::vector<Node*> children;
+    };
+    struct RootCache {
+        Node* root;
+        std::vector<std::unique_ptr<RootCacheReplica>> replicas; // by NUMA node
+        // misses of a thread before it rebuilds the cache, a miss costs a
+        // detour through the root and a build copies the whole thing
+        uint64_t refresh_misses;
+    };
+    static constexpr uint64_t ROOT_CACHE_REFRESH_PERIOD = 64; // least misses per refresh attempt
+
+    std::atomic<bool> root_cache_on{false};
+    std::atomic<bool> htm_on{false}; // see enable_htm()
+    mutable std::atomic<RootCache*> root_cache{nullptr};
+    mutable std::atomic<bool> root_cache_building{false};
+    // a cache is published only for the current root, swap_root() drops it under this
+    mutable std::mutex root_cache_mutex;
+    mutable std::atomic<uint64_t> root_cache_builds{0};
+
+    static void delete_root_cache(void* cache) {
+        delete static_cast<RootCache*>(cache);
     }
-    static void delete_items(Item* p, int n)
-    {
-        item_allocator.deallocate(p, n);
+    static size_t root_cache_bytes(const RootCache* cache) {
+        size_t bytes = sizeof(RootCache);
+        for (const auto& r : cache->replicas) {
+            bytes += sizeof(RootCacheReplica) + r->words.size() * sizeof(RankedWord) + r->children.size() * sizeof(Node*);
+        }
+        return bytes;
+    }
+    /// unpublish the root cache, it is freed once no reader can hold it
+    void drop_root_cache() const {
+        std::lock_guard<std::mutex> lock(root_cache_mutex);
+        RootCache* old = root_cache.exchange(nullptr, std::memory_order_acq_rel);
+        if (old) ebr->scheduleForDeletion(std::make_pair((void *)old, delete_root_cache), root_cache_bytes(old));
     }
 
-    static std::allocator<bitmap_t> bitmap_allocator;
-    bitmap_t* new_bitmap(int n)
-    {
-        bitmap_t* p = bitmap_allocator.allocate(n);
-        RT_ASSERT(p != NULL && p != (bitmap_t*)(-1));
-        return p;
+    /// the NUMA node the calling thread first ran a lookup on
+    static int thread_numa_node() {
+        #if LIPP_NUMA
+        static thread_local const int numa_node = numa_available() < 0 ? 0 : std::max(0, numa_node_of_cpu(sched_getcpu()));
+        return numa_node;
+        #else
+        return 0;
+        #endif
     }
-    static void delete_bitmap(bitmap_t* p, int n)
-    {
-        bitmap_allocator.deallocate(p, n);
+    static int num_root_cache_replicas() {
+        #if LIPP_NUMA
+        if (numa_available() >= 0) return numa_max_node() + 1;
+        #endif
+        return 1;
     }
 
-    /// build an empty tree
-    Node* build_tree_none()
-    {
-        Node* node = new_nodes(1);
-        node->is_two = 0;
-        node->build_size = 0;
-        node->size = 0;
-        node->fixed = 0;
-        node->num_inserts = node->num_insert_to_data = 0;
-        node->num_items = 1;
-        node->model.a = node->model.b = 0;
-        node->items = new_items(1);
-        node->none_bitmap = new_bitmap(1);
-        node->none_bitmap[0] = 0;
-        BITMAP_SET(node->none_bitmap, 0);
-        node->child_bitmap = new_bitmap(1);
-        node->child_bitmap[0] = 0;
-        node->typeVersionLockObsolete = 0b100;
-        return node;
+    /// copy the root's routing part while holding its version, nullptr if
+    /// writers to the root kept it changing
+    RootCache* build_root_cache() const {
+        constexpr int ATTEMPTS = 4;
+        for (int attempt = 0; attempt < ATTEMPTS; attempt ++) {
+            bool needRestart = false;
+            Node* node = load_root();
+            const uint64_t version = node->readLockOrRestart(needRestart);
+            if (needRestart) {
+                yield(attempt + 1);
+                continue;
+            }
+            std::unique_ptr<RootCacheReplica> r(new RootCacheReplica());
+            r->model = node->model;
+            r->num_items = node->num_items;
+            r->items = node->items;
+            r->child_bitmap = node->child_bitmap;
+            r->words.resize((node->num_items + 63) / 64);
+            constexpr int WORDS_PER_64 = 64 / BITMAP_WIDTH;
+            for (size_t w = 0; w < r->words.size(); w ++) {
+                uint64_t bits = 0;
+                for (int j = 0; j < WORDS_PER_64; j ++) {
+                    const size_t i = w * WORDS_PER_64 + j;
+                    if (i < BITMAP_SIZE(node->num_items)) bits |= static_cast<uint64_t>(node->child_bitmap[i]) << (j * BITMAP_WIDTH);
+                }
+                r->words[w].bits = bits;
+                r->words[w].rank = r->children.size();
+                while (bits) {
+                    r->children.push_back(load_child(node->items[w * 64 + __builtin_ctzll(bits)]));
+                    bits &= bits - 1;
+                }
+            }
+            node->readUnlockOrRestart(version, needRestart);
+            if (needRestart) continue;
+
+            RootCache* cache = new RootCache();
+            cache->root = node;
+            cache->refresh_misses = std::max<uint64_t>(ROOT_CACHE_REFRESH_PERIOD, (r->words.size() + r->children.size()) / 64);
+            const int num_replicas = num_root_cache_replicas();
+            for (int n = 1; n < num_replicas; n ++) {
+                cache->replicas.emplace_back(new RootCacheReplica(*r));
+                #if LIPP_NUMA
+                const RootCacheReplica& copy = *cache->replicas.back();
+                std::vector<void*> pages;
+                node_pages(&copy, sizeof(copy), pages);
+                node_pages(copy.words.data(), copy.words.size() * sizeof(RankedWord), pages);
+                node_pages(copy.children.data(), copy.children.size() * sizeof(Node*), pages);
+                move_pages_to(pages, n);
+                #endif
+            }
+            cache->replicas.insert(cache->replicas.begin(), std::move(r));
+            return cache;
+        }
+        return nullptr;
     }
-    /// build a tree with two keys
-    Node* build_tree_two(T key1, P value1, T key2, P value2)
-    {
-        if (key1 > key2) {
-            std::swap(key1, key2);
-            std::swap(value1, value2);
+    /// replace the root cache by a copy of the current root, unless another
+    /// thread is at it already
+    void refresh_root_cache() const {
+        if (root_cache_building.exchange(true, std::memory_order_acquire)) return;
+        RootCache* cache = build_root_cache();
+        if (cache) {
+            std::lock_guard<std::mutex> lock(root_cache_mutex);
+            if (root_cache_on && load_root() == cache->root) {
+                RootCache* old = root_cache.exchange(cache, std::memory_order_acq_rel);
+                if (old) ebr->scheduleForDeletion(std::make_pair((void *)old, delete_root_cache), root_cache_bytes(old));
+                root_cache_builds.fetch_add(1, std::memory_order_relaxed);
+            } else {
+                delete cache;
+            }
         }
-        RT_ASSERT(key1 < key2);
-        static_assert(BITMAP_WIDTH == 8);
-
-        Node* node = NULL;
-        if (pending_two.empty()) {
-            node = new_nodes(1);
-            node->is_two = 1;
-            node->build_size = 2;
-            node->size = 2;
-            node->fixed = 0;
-            node->num_inserts = node->num_insert_to_data = 0;
-
-            node->num_items = 8;
-            node->items = new_items(node->num_items);
-            node->none_bitmap = new_bitmap(1);
-            node->child_bitmap = new_bitmap(1);
-            node->none_bitmap[0] = 0xff;
-            node->child_bitmap[0] = 0;
+        root_cache_building.store(false, std::memory_order_release);
+    }
+    /// count a miss of cache (nullptr if there is none), rebuild it every
+    /// so many misses of this thread
+    void note_root_cache_miss(const RootCache* cache) const {
+        static thread_local uint64_t misses = 0;
+        bump(thread_metrics.local().root_cache_misses);
+        if (++ misses >= (cache ? cache->refresh_misses : ROOT_CACHE_REFRESH_PERIOD)) {
+            misses = 0;
+            refresh_root_cache();
+        }
+    }
+
+    /// The child of the root slot key maps to, read-locked with version and
+    /// found through the root cache without touching the root's header;
+    /// parent is set to the root it hangs off. nullptr if the caller has to go
+    /// through the root: no cache, a data or none slot, a key past the end
+    /// of the root, or a cached child that is no longer in its slot.
+    /// Unlinking a child write-locks it until it is obsolete, so a child
+    /// that is still in its slot and then read-locks is in the tree.
+    Node* cached_child(const T& key, Node*& parent, uint64_t& version) const {
+        if constexpr (!lock_t::concurrent) return nullptr;
+        RootCache* cache = root_cache.load(std::memory_order_acquire);
+        if (!cache) {
+            if (root_cache_on.load(std::memory_order_relaxed)) note_root_cache_miss(nullptr);
+            return nullptr;
+        }
+        const RootCacheReplica& r = *cache->replicas[std::min<size_t>(thread_numa_node(), cache->replicas.size() - 1)];
+        const double v = r.model.predict_double(key);
+        if (!(v < r.num_items)) return nullptr; // may grow the root
+        const int pos = v < 0 ? 0 : static_cast<int>(v);
+        const RankedWord& word = r.words[pos / 64];
+        const uint64_t bit = 1ull << (pos % 64);
+        // the slot as it is now, the child bit read after the pointer
+        Node* now = load_child(r.items[pos]);
+        const bool is_child = BITMAP_GET(r.child_bitmap, pos) == 1;
+        if (!(word.bits & bit)) {
+            if (is_child) note_root_cache_miss(cache);
+            return nullptr;
+        }
+        Node* child = r.children[word.rank + __builtin_popcountll(word.bits & (bit - 1))];
+        if (!is_child || now != child) {
+            note_root_cache_miss(cache);
+            return nullptr;
+        }
+        bool needRestart = false;
+        version = child->readLockOrRestart(needRestart);
+        if (needRestart) return nullptr;
+        parent = cache->root;
+        return child;
+    }
+
+    /// call f(p, bytes) for each allocation of node
+    template<class F>
+    static void for_node_memory(const Node* node, F&& f) {
+        if (node->is_two) {
+            f(node, sizeof(TwoNodeBlock));
+        } else if (node->interleaved) {
+            f(node, node_block_size(node->num_items));
         } else {
-            node = pending_two.top(); pending_two.pop();
+            #if LIPP_COALLOC_NODE
+            f(node, node_block_size(node->num_items));
+            #else
+            f(node, sizeof(Node));
+            f(node->items, sizeof(Item) * node->num_items);
+            if (SOA) f(node->values, sizeof(P) * node->num_items);
+            f(node->none_bitmap, sizeof(bitmap_t) * BITMAP_SIZE(node->num_items));
+            f(node->child_bitmap, sizeof(bitmap_t) * BITMAP_SIZE(node->num_items));
+            #endif
         }
-        node->typeVersionLockObsolete = 0b100;
+        if (node->stripes) f(node->stripes, sizeof(CounterStripe) * COUNTER_STRIPES);
+    }
 
-        const long double mid1_key = key1;
-        const long double mid2_key = key2;
+    /// a key stored somewhere below node into key, false if erases left
+    /// the subtree without any
+    static bool subtree_key(const Node* node, T& key) {
+        for (int pos = 0; pos < node->num_items; pos ++) {
+            if (BITMAP_GET(node->none_bitmap, pos) == 1) continue;
+            if (BITMAP_GET(node->child_bitmap, pos) == 0) {
+                key = node->items[pos].comp.data.key;
+                return true;
+            }
+            if (subtree_key(node->items[pos].comp.child, key)) return true;
+        }
+        return false;
+    }
 
-        const double mid1_target = node->num_items / 3;
-        const double mid2_target = node->num_items * 2 / 3;
+    static size_t page_size() {
+        static const size_t size = sysconf(_SC_PAGESIZE);
+        return size;
+    }
 
-        node->model.a = (mid2_target - mid1_target) / (mid2_key - mid1_key);
-        node->model.b = mid1_target - node->model.a * mid1_key;
-        RT_ASSERT(isfinite(node->model.a));
-        RT_ASSERT(isfinite(node->model.b));
+    #if LIPP_NUMA
+    std::vector<int> numa_interleave; // NUMA nodes a new root is spread over, see place_numa()
 
-        { // insert key1&value1
-            int pos = PREDICT_POS(node, key1);
-            RT_ASSERT(BITMAP_GET(node->none_bitmap, pos) == 1);
-            BITMAP_CLEAR(node->none_bitmap, pos);
-            node->items[pos].comp.data.key = key1;
-            node->items[pos].comp.data.value = value1;
+    /// append the pages [p, p + bytes) touches to out
+    static void node_pages(const void* p, size_t bytes, std::vector<void*>& out) {
+        const uintptr_t begin = reinterpret_cast<uintptr_t>(p) & ~(page_size() - 1);
+        for (uintptr_t page = begin; page < reinterpret_cast<uintptr_t>(p) + bytes; page += page_size()) {
+            out.push_back(reinterpret_cast<void*>(page));
         }
-        { // insert key2&value2
-            int pos = PREDICT_POS(node, key2);
-            RT_ASSERT(BITMAP_GET(node->none_bitmap, pos) == 1);
-            BITMAP_CLEAR(node->none_bitmap, pos);
-            node->items[pos].comp.data.key = key2;
-            node->items[pos].comp.data.value = value2;
+    }
+    /// Copy of node in a mapping of its own, interleaved over numa_interleave
+    /// before anything touches it: a policy set on heap pages would also
+    /// move whatever else shares them, and split the heap's mapping on
+    /// every call. The copy has node's block layout and owns nothing node
+    /// does but the stripes, which both point to. Null if the mapping
+    /// can't be had or interleaved, the error is reported.
+    Node* interleave_copy(const Node* node) const {
+        std::vector<unsigned long> mask(1);
+        for (int n : numa_interleave) {
+            if (static_cast<size_t>(n) / 64 >= mask.size()) mask.resize(n / 64 + 1);
+            mask[n / 64] |= 1ul << (n % 64);
+        }
+        const int num_items = node->num_items;
+        const size_t bytes = interleaved_bytes(num_items);
+        void* block = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (block == MAP_FAILED) {
+            fprintf(stderr, "LIPP: mmap of %zu bytes for an interleaved node failed: %s\n", bytes, strerror(errno));
+            return nullptr;
+        }
+        if (mbind(block, bytes, MPOL_INTERLEAVE, mask.data(), mask.size() * 64 + 1, 0) != 0) {
+            fprintf(stderr, "LIPP: mbind MPOL_INTERLEAVE of an interleaved node failed: %s\n", strerror(errno));
+            munmap(block, bytes);
+            return nullptr;
         }
 
-        return node;
+        char* p = static_cast<char*>(block);
+        Node* copy = reinterpret_cast<Node*>(p);
+        memcpy(static_cast<void*>(copy), node, sizeof(Node));
+        copy->typeVersionLockObsolete = 0b100;
+        copy->is_two = 0;
+        copy->interleaved = 1;
+        const int bitmap_size = BITMAP_SIZE(num_items);
+        copy->none_bitmap = reinterpret_cast<bitmap_t*>(p + sizeof(Node));
+        copy->child_bitmap = copy->none_bitmap + bitmap_size;
+        copy->items = reinterpret_cast<Item*>(p + node_items_offset(num_items));
+        copy->values = SOA ? reinterpret_cast<P*>(p + node_values_offset(num_items)) : nullptr;
+        memcpy(copy->none_bitmap, node->none_bitmap, sizeof(bitmap_t) * bitmap_size);
+        memcpy(copy->child_bitmap, node->child_bitmap, sizeof(bitmap_t) * bitmap_size);
+        memcpy(static_cast<void*>(copy->items), node->items, sizeof(Item) * num_items);
+        if constexpr (SOA) memcpy(static_cast<void*>(copy->values), node->values, sizeof(P) * num_items);
+        return copy;
     }
-    /// bulk build, _keys must be sorted in asc order.
-    Node* build_tree_bulk(T* _keys, P* _values, int _size)
-    {
-        if (USE_FMCD) {
-            return build_tree_bulk_fmcd(_keys, _values, _size);
+    /// move pages to NUMA node numa_node, returns the pages that moved
+    static size_t move_pages_to(std::vector<void*>& pages, int numa_node) {
+        std::sort(pages.begin(), pages.end());
+        pages.erase(std::unique(pages.begin(), pages.end()), pages.end());
+        constexpr size_t CHUNK = 1 << 14;
+        std::vector<int> nodes(CHUNK, numa_node), status(CHUNK);
+        size_t moved = 0;
+        for (size_t i = 0; i < pages.size(); i += CHUNK) {
+            const size_t n = std::min(CHUNK, pages.size() - i);
+            if (move_pages(0, n, pages.data() + i, nodes.data(), status.data(), MPOL_MF_MOVE) < 0) {
+                fprintf(stderr, "LIPP: move_pages of %zu pages to NUMA node %d failed: %s\n", n, numa_node, strerror(errno));
+                continue;
+            }
+            for (size_t j = 0; j < n; j ++) moved += status[j] == numa_node;
+        }
+        return moved;
+    }
+    #endif
+
+    /// payload of data slot pos
+    static P& slot_value(Node* node, int pos) {
+        if constexpr (SOA) {
+            return node->values[pos];
         } else {
-            return build_tree_bulk_fast(_keys, _values, _size);
+            return node->items[pos].comp.data.value;
         }
     }
-    /// bulk build, _keys must be sorted in asc order.
-    /// split keys into three parts at each node.
-    Node* build_tree_bulk_fast(T* _keys, P* _values, int _size)
-    {
-        RT_ASSERT(_size > 1);
 
-        typedef struct {
-            int begin;
-            int end;
-            int level; // top level = 1
-            Node* node;
-        } Segment;
-        std::stack<Segment> s;
+    static Node* load_child(const Item& item) {
+        return __atomic_load_n(&item.comp.child, __ATOMIC_ACQUIRE);
+    }
+    /// publish a fully built child, readers that see the pointer see its contents
+    static void store_child(Item& item, Node* child) {
+        __atomic_store_n(&item.comp.child, child, __ATOMIC_RELEASE);
+    }
 
-        Node* ret = new_nodes(1);
-        s.push((Segment){0, _size, 1, ret});
+    struct Leaf {
+        bool none;
+        T key;
+        P value;
+    };
 
-        while (!s.empty()) {
-            const int begin = s.top().begin;
-            const int end = s.top().end;
-            const int level = s.top().level;
-            Node* node = s.top().node;
-            s.pop();
+    /// counters of the per-thread shards: only the owning thread writes
+    /// them, metrics() reads them from any thread
+    static void bump(std::atomic<uint64_t>& counter, uint64_t delta = 1) {
+        counter.store(counter.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+    }
+    struct ThreadMetrics {
+        struct {
+            std::atomic<uint64_t> local{0};
+            std::atomic<uint64_t> parent{0};
+            std::atomic<uint64_t> root{0};
+        } read_restarts;
+        std::atomic<uint64_t> insert_restarts[INSERT_RESTART_SITES] = {};
+        std::atomic<uint64_t> adjust_restarts[ADJUST_RESTART_SITES] = {};
+        std::atomic<uint64_t> depth_samples{0};
+        std::atomic<uint64_t> depth_sum{0};
+        std::atomic<int> max_depth{0};
+        std::atomic<uint64_t> root_cache_misses{0};
+        std::atomic<uint64_t> htm_commits{0};
+        std::atomic<uint64_t> htm_aborts[HTM_ABORT_CAUSES] = {};
+        std::atomic<uint64_t> htm_fallbacks{0};
+    };
+    mutable tbb::enumerable_thread_specific<ThreadMetrics,
+        tbb::cache_aligned_allocator<ThreadMetrics>,
+        tbb::ets_key_per_instance> thread_metrics;
+
+    /// count a descent, every DEPTH_SAMPLE_PERIOD-th one's depth goes into
+    /// the thread's shard; the counter is shared by the LIPPs of this type
+    void sample_depth(int depth) const {
+        static thread_local uint32_t descents = 0;
+        if (++ descents % DEPTH_SAMPLE_PERIOD) return;
+        ThreadMetrics& local = thread_metrics.local();
+        bump(local.depth_samples);
+        bump(local.depth_sum, depth);
+        if (depth > local.max_depth.load(std::memory_order_relaxed)) {
+            local.max_depth.store(depth, std::memory_order_relaxed);
+        }
+    }
+
+    /// Read the leaf slot key maps to. Only the node being read is
+    /// validated: child pointers are read under the node's version and
+    /// published with release stores, and data slots are validated
+    /// seqlock-style against the version of their node. A failed check
+    /// re-reads that node only; an obsolete node (retired by a rebuild)
+    /// sends the reader back to its parent, and only a replaced root
+    /// restarts from the top. Writers elsewhere on the path never make a
+    /// reader wait or restart.
+    Leaf read_leaf(const T& key) const {
+        constexpr int MAX_DEPTH = 128;
+        Node* path[MAX_DEPTH];
+        int depth = 0;
+        uint64_t version = 0;
+        ReadRestartStats restarts;
+        int restartCount = 0;
+        Leaf leaf;
+
+        int skipped = 0; // the root, when the root cache led past it
+
+        while (true) {
+            if (depth == 0) {
+                bool needRestart = false;
+                Node* parent;
+                if (Node* child = cached_child(key, parent, version)) {
+                    skipped = 1;
+                    path[depth ++] = child;
+                    continue;
+                }
+                skipped = 0;
+                Node* node = load_root();
+                version = node->readLockOrRestart(needRestart);
+                if (needRestart || (node != load_root())) {
+                    restarts.root ++;
+                    yield(++ restartCount);
+                    continue;
+                }
+                path[depth ++] = node;
+            }
 
-            RT_ASSERT(end - begin >= 2);
-            if (end - begin == 2) {
-                Node* _ = build_tree_two(_keys[begin], _values[begin], _keys[begin+1], _values[begin+1]);
-                memcpy(node, _, sizeof(Node));
-                delete_nodes(_, 1);
+            Node* node = path[depth - 1];
+            bool needRestart = false;
+            int pos = PREDICT_POS(node, key);
+            if (BITMAP_GET(node->child_bitmap, pos) == 1) {
+                Node* child = load_child(node->items[pos]);
+                node->checkOrRestart(version, needRestart);
+                if (!needRestart) {
+                    uint64_t versionChild = child->readLockOrRestart(needRestart);
+                    if (!needRestart) {
+                        RT_ASSERT(depth < MAX_DEPTH);
+                        path[depth ++] = child;
+                        version = versionChild;
+                        continue;
+                    }
+                }
             } else {
-                T* keys = _keys + begin;
-                P* values = _values + begin;
-                const int size = end - begin;
-                const int BUILD_GAP_CNT = compute_gap_count(size);
+                leaf.none = BITMAP_GET(node->none_bitmap, pos) == 1;
+                leaf.key = node->items[pos].comp.data.key;
+                leaf.value = slot_value(node, pos);
+                node->readUnlockOrRestart(version, needRestart);
+                if (!needRestart) break;
+            }
 
-                node->is_two = 0;
-                node->build_size = size;
-                node->size = size;
-                node->fixed = 0;
-                node->num_inserts = node->num_insert_to_data = 0;
+            // re-read the innermost node that is still in the tree
+            while (depth > 0) {
+                Node* retry = path[depth - 1];
+                needRestart = false;
+                version = retry->readLockOrRestart(needRestart);
+                if (!needRestart) {
+                    restarts.local ++;
+                    break;
+                }
+                if (retry->isObsolete()) {
+                    depth --;
+                    restarts.parent ++;
+                } else {
+                    yield(++ restartCount);
+                }
+            }
+        }
 
-                int mid1_pos = (size - 1) / 3;
-                int mid2_pos = (size - 1) * 2 / 3;
+        if (restarts.local + restarts.parent + restarts.root > 0) {
+            auto& local = thread_metrics.local().read_restarts;
+            bump(local.local, restarts.local);
+            bump(local.parent, restarts.parent);
+            bump(local.root, restarts.root);
+        }
+        sample_depth(depth + skipped);
+        return leaf;
+    }
 
-                RT_ASSERT(0 <= mid1_pos);
-                RT_ASSERT(mid1_pos < mid2_pos);
-                RT_ASSERT(mid2_pos < size - 1);
+    // per-key cursor of at_batch/exists_batch
+    static constexpr size_t BATCH_WIDTH = 32;
+    struct BatchState {
+        Node* node;
+        uint64_t version;
+        int pos;
+        int restart_count;
+        bool done;
+    };
+
+    static inline void prefetch_slot(const Node* node, int pos) {
+        _mm_prefetch(reinterpret_cast<const char*>(&node->child_bitmap[pos / BITMAP_WIDTH]), _MM_HINT_T0);
+        _mm_prefetch(reinterpret_cast<const char*>(&node->items[pos]), _MM_HINT_T0);
+    }
 
-                const long double mid1_key =
-                        (static_cast<long double>(keys[mid1_pos]) + static_cast<long double>(keys[mid1_pos + 1])) / 2;
-                const long double mid2_key =
-                        (static_cast<long double>(keys[mid2_pos]) + static_cast<long double>(keys[mid2_pos + 1])) / 2;
+    /// (re)start a batched lookup of key from the root
+    void batch_restart(BatchState& st, const T& key) const {
+        st.done = false;
+        while (true) {
+            if (st.restart_count++)
+                yield(st.restart_count);
+            bool needRestart = false;
+            Node* parent;
+            Node* node = cached_child(key, parent, st.version);
+            if (!node) {
+                node = load_root();
+                st.version = node->readLockOrRestart(needRestart);
+                if (needRestart || (node != load_root())) continue;
+            }
+            st.node = node;
+            st.pos = PREDICT_POS(node, key);
+            prefetch_slot(node, st.pos);
+            return;
+        }
+    }
 
-                node->num_items = size * static_cast<int>(BUILD_GAP_CNT + 1);
-                const double mid1_target = mid1_pos * static_cast<int>(BUILD_GAP_CNT + 1) + static_cast<int>(BUILD_GAP_CNT + 1) / 2;
-                const double mid2_target = mid2_pos * static_cast<int>(BUILD_GAP_CNT + 1) + static_cast<int>(BUILD_GAP_CNT + 1) / 2;
+    /// advance st by one level, returns true when st.pos is a data/none slot
+    /// of st.node (still read-locked by st.version)
+    bool batch_step(BatchState& st, const T& key) const {
+        Node* node = st.node;
+        if (BITMAP_GET(node->child_bitmap, st.pos) == 0) {
+            return true;
+        }
+        bool needRestart = false;
+        Node* child = load_child(node->items[st.pos]);
+        node->checkOrRestart(st.version, needRestart);
+        if (needRestart) {
+            batch_restart(st, key);
+            return false;
+        }
+        uint64_t version = child->readLockOrRestart(needRestart);
+        if (needRestart) {
+            batch_restart(st, key);
+            return false;
+        }
+        st.node = child;
+        st.version = version;
+        st.pos = PREDICT_POS(child, key);
+        prefetch_slot(child, st.pos);
+        return false;
+    }
 
-                node->model.a = (mid2_target - mid1_target) / (mid2_key - mid1_key);
-                node->model.b = mid1_target - node->model.a * mid1_key;
-                RT_ASSERT(isfinite(node->model.a));
-                RT_ASSERT(isfinite(node->model.b));
+    void fill_chunk(const T& lo, bool lo_inclusive, const T& hi, std::vector<V>& out, size_t max_num) const {
+        EpochGuard guard;
+        auto callback = [&](const T& key, const P& value) {
+            out.emplace_back(key, value);
+            return out.size() < max_num;
+        };
+        scan_range(lo, lo_inclusive, hi, callback);
+    }
 
-                const int lr_remains = static_cast<int>(size * BUILD_LR_REMAIN);
-                node->model.b += lr_remains;
-                node->num_items += lr_remains * 2;
+    struct ScanFrame {
+        Node* node;
+        uint64_t version;
+        int pos;
+    };
 
-                if (size > 1e6) {
-                    node->fixed = 1;
+    /// re-validate the innermost scan frames after a failed version check and
+    /// reposition the first one that validates at key. Frames that stay
+    /// locked (e.g. a subtree replaced by adjust) are dropped so the scan
+    /// resumes from their parent. Returns the new depth, 0 means restart
+    /// from root.
+    int scan_recover(ScanFrame* frames, int depth, const T& key) const {
+        while (depth > 0) {
+            ScanFrame& f = frames[depth - 1];
+            for (int attempt = 1; attempt <= 4; attempt ++) {
+                bool needRestart = false;
+                uint64_t version = f.node->readLockOrRestart(needRestart);
+                if (!needRestart) {
+                    f.version = version;
+                    f.pos = PREDICT_POS(f.node, key);
+                    return depth;
                 }
+                yield(attempt);
+            }
+            depth --;
+        }
+        return 0;
+    }
 
-                node->items = new_items(node->num_items);
+    /// in-order walk of the keys in [lo, hi] (or (lo, hi] if !lo_inclusive).
+    /// Every slot is read under the version of its node; if validation fails
+    /// only that node's subtree is re-entered, resuming after the last key
+    /// passed to callback.
+    template<class F>
+    void scan_range(const T& lo, bool lo_inclusive, const T& hi, F& callback) const {
+        constexpr int MAX_DEPTH = 128;
+        ScanFrame frames[MAX_DEPTH];
+        int depth = 0;
+        // keys <= last (< last while !has_last) have been passed already
+        T last = lo;
+        bool has_last = !lo_inclusive;
+        int restartCount = 0;
+
+        while (true) {
+            if (depth == 0) {
+                if (restartCount++)
+                    yield(restartCount);
+                bool needRestart = false;
+                Node* node = load_root();
+                uint64_t version = node->readLockOrRestart(needRestart);
+                if (needRestart || (node != load_root())) continue;
+                frames[0] = (ScanFrame){node, version, PREDICT_POS(node, last)};
+                depth = 1;
+            }
+
+            ScanFrame& f = frames[depth - 1];
+            Node* node = f.node;
+
+            // jump to the next non-None slot
+            int pos = node->num_items;
+            if (f.pos < node->num_items) {
                 const int bitmap_size = BITMAP_SIZE(node->num_items);
-                node->none_bitmap = new_bitmap(bitmap_size);
-                node->child_bitmap = new_bitmap(bitmap_size);
-                memset(node->none_bitmap, 0xff, sizeof(bitmap_t) * bitmap_size);
-                memset(node->child_bitmap, 0, sizeof(bitmap_t) * bitmap_size);
-
-                for (int item_i = PREDICT_POS(node, keys[0]), offset = 0; offset < size; ) {
-                    int next = offset + 1, next_i = -1;
-                    while (next < size) {
-                        next_i = PREDICT_POS(node, keys[next]);
-                        if (next_i == item_i) {
-                            next ++;
-                        } else {
-                            break;
-                        }
-                    }
-                    if (next == offset + 1) {
-                        BITMAP_CLEAR(node->none_bitmap, item_i);
-                        node->items[item_i].comp.data.key = keys[offset];
-                        node->items[item_i].comp.data.value = values[offset];
-                    } else {
-                        // ASSERT(next - offset <= (size+2) / 3);
-                        BITMAP_CLEAR(node->none_bitmap, item_i);
-                        BITMAP_SET(node->child_bitmap, item_i);
-                        node->items[item_i].comp.child = new_nodes(1);
-                        s.push((Segment){begin + offset, begin + next, level + 1, node->items[item_i].comp.child});
-                    }
-                    if (next >= size) {
-                        break;
-                    } else {
-                        item_i = next_i;
-                        offset = next;
-                    }
+                int i = f.pos / BITMAP_WIDTH;
+                bitmap_t occupied = ~node->none_bitmap[i] & bitmap_t(bitmap_t(~bitmap_t(0)) << (f.pos % BITMAP_WIDTH));
+                while (occupied == 0 && ++ i < bitmap_size) {
+                    occupied = ~node->none_bitmap[i];
+                }
+                if (occupied != 0) {
+                    pos = std::min(node->num_items, static_cast<int>(i * BITMAP_WIDTH + BITMAP_NEXT_1(occupied)));
+                }
+            }
+            bool is_child = false;
+            Item item{};
+            P value{};
+            if (pos < node->num_items) {
+                is_child = BITMAP_GET(node->child_bitmap, pos) == 1;
+                item = node->items[pos];
+                if (!is_child) value = slot_value(node, pos);
+            }
+
+            bool needRestart = false;
+            node->readUnlockOrRestart(f.version, needRestart);
+            if (needRestart) {
+                depth = scan_recover(frames, depth, last);
+                continue;
+            }
+
+            if (pos >= node->num_items) {
+                depth --;
+                if (depth == 0) return;
+                continue;
+            }
+            f.pos = pos + 1;
+
+            if (!is_child) {
+                const T& key = item.comp.data.key;
+                if (key > hi) return;
+                if (has_last ? key > last : key >= last) {
+                    last = key;
+                    has_last = true;
+                    if (!callback(key, value)) return;
+                }
+            } else {
+                Node* child = item.comp.child;
+                uint64_t version = child->readLockOrRestart(needRestart);
+                if (needRestart) {
+                    depth = scan_recover(frames, depth, last);
+                    continue;
+                }
+                RT_ASSERT(depth < MAX_DEPTH);
+                frames[depth ++] = (ScanFrame){child, version, PREDICT_POS(child, last)};
+            }
+        }
+    }
+
+    /// Copy node's slots into the newest snapshot generation, unless that
+    /// was done already, before a write to the write-locked node. Nodes
+    /// start with snapshot_ts 0: one built after the newest snapshot is
+    /// copied too, which is cheaper than tracking when it was linked.
+    void preserve_for_snapshots(Node* node)
+    {
+        if (num_snapshots.load() == 0) return;
+        // kept alive by the caller's epoch, see release_versions()
+        SnapshotVersions* versions = newest_versions.load(std::memory_order_acquire);
+        if (!versions || node->snapshot_ts >= versions->ts) return;
+
+        const int num_items = node->num_items;
+        const int bitmap_size = BITMAP_SIZE(num_items);
+        Node* copy = new_node(num_items);
+        copy->is_two = 0;
+        copy->fixed = 1;
+        copy->build_size = 0;
+        copy->model = node->model;
+        memcpy(copy->none_bitmap, node->none_bitmap, sizeof(bitmap_t) * bitmap_size);
+        memcpy(copy->child_bitmap, node->child_bitmap, sizeof(bitmap_t) * bitmap_size);
+        memcpy(static_cast<void*>(copy->items), node->items, sizeof(Item) * num_items);
+        if constexpr (SOA) memcpy(static_cast<void*>(copy->values), node->values, sizeof(P) * num_items);
+        versions->copies.emplace(node, copy);
+        node->snapshot_ts = versions->ts;
+    }
+
+    // where a snapshot reads a node's slots from
+    struct SnapshotSource {
+        Node* node;
+        Node* slots; // node, or a copy of its slots preserved for the snapshot
+        uint64_t version; // of node, validates the slots read while slots == node
+    };
+
+    /// Pick where src.node is read from: its copy in the first generation
+    /// from versions on that has one, else the node itself at an unlocked
+    /// version. The version is read before the generations are searched, so
+    /// a copy made after the search fails the slot validation. Nodes retired
+    /// since the snapshot are read in place, their slots don't change anymore
+    /// and the snapshot's epoch keeps them allocated.
+    static void snapshot_resolve(SnapshotVersions* versions, SnapshotSource& src)
+    {
+        for (int attempt = 1; ; attempt ++) {
+            const uint64_t version = src.node->get_version_number();
+            if (src.node->isLocked(version)) {
+                yield(attempt);
+                continue;
+            }
+            src.slots = src.node;
+            src.version = version;
+            for (SnapshotVersions* v = versions; v; v = v->next_raw.load(std::memory_order_acquire)) {
+                if (Node* copy = v->find(src.node)) {
+                    src.slots = copy;
+                    break;
+                }
+            }
+            return;
+        }
+    }
+
+    /// first slot in [pos, end) that isn't None as the snapshot sees src.node,
+    /// end if there is none. Fills is_child and item, and value for data.
+    static int snapshot_next(SnapshotVersions* versions, SnapshotSource& src, int pos, int end,
+                             bool& is_child, Item& item, P& value)
+    {
+        while (true) {
+            Node* node = src.slots;
+            int next = end;
+            if (pos < end) {
+                const int bitmap_size = BITMAP_SIZE(end);
+                int i = pos / BITMAP_WIDTH;
+                bitmap_t occupied = ~node->none_bitmap[i] & bitmap_t(bitmap_t(~bitmap_t(0)) << (pos % BITMAP_WIDTH));
+                while (occupied == 0 && ++ i < bitmap_size) {
+                    occupied = ~node->none_bitmap[i];
+                }
+                if (occupied != 0) {
+                    next = std::min(end, static_cast<int>(i * BITMAP_WIDTH + BITMAP_NEXT_1(occupied)));
+                }
+            }
+            if (next < end) {
+                is_child = BITMAP_GET(node->child_bitmap, next) == 1;
+                item = node->items[next];
+                if (!is_child) value = slot_value(node, next);
+            }
+            if (node != src.node) return next;
+
+            bool needRestart = false;
+            src.node->readUnlockOrRestart(src.version, needRestart);
+            if (!needRestart) return next;
+            snapshot_resolve(versions, src);
+        }
+    }
+
+    Leaf snapshot_leaf(const Snapshot& snapshot, const T& key) const
+    {
+        SnapshotVersions* versions = snapshot.versions.get();
+        SnapshotSource src;
+        src.node = snapshot.root;
+        while (true) {
+            snapshot_resolve(versions, src);
+            const int pos = PREDICT_POS(src.node, key);
+            bool is_child = false;
+            Item item{};
+            P value{};
+            if (snapshot_next(versions, src, pos, pos + 1, is_child, item, value) != pos) {
+                return Leaf{true, key, P()};
+            }
+            if (!is_child) {
+                return Leaf{false, item.comp.data.key, value};
+            }
+            src.node = item.comp.child;
+        }
+    }
+
+    /// in-order walk of the snapshot's keys in [lo, hi]; a node's slots are
+    /// validated as in scan_range(), but a failed check only switches that
+    /// node to its preserved copy and the walk goes on where it was
+    template<class F>
+    void snapshot_scan(const Snapshot& snapshot, const T& lo, const T& hi, F& callback) const
+    {
+        constexpr int MAX_DEPTH = 128;
+        struct Frame {
+            SnapshotSource src;
+            int pos;
+        };
+        Frame frames[MAX_DEPTH];
+        SnapshotVersions* versions = snapshot.versions.get();
+        frames[0].src.node = snapshot.root;
+        snapshot_resolve(versions, frames[0].src);
+        frames[0].pos = PREDICT_POS(snapshot.root, lo);
+        int depth = 1;
+
+        while (depth > 0) {
+            Frame& f = frames[depth - 1];
+            const int num_items = f.src.node->num_items;
+            bool is_child = false;
+            Item item{};
+            P value{};
+            const int pos = snapshot_next(versions, f.src, f.pos, num_items, is_child, item, value);
+            if (pos >= num_items) {
+                depth --;
+                continue;
+            }
+            f.pos = pos + 1;
+
+            if (!is_child) {
+                const T& key = item.comp.data.key;
+                if (key > hi) return;
+                if (key >= lo && !callback(key, value)) return;
+            } else {
+                RT_ASSERT(depth < MAX_DEPTH);
+                Frame& c = frames[depth ++];
+                c.src.node = item.comp.child;
+                snapshot_resolve(versions, c.src);
+                c.pos = PREDICT_POS(c.src.node, lo);
+            }
+        }
+    }
+
+    // A two-key node is fixed-size, so its header, items and bitmaps live in
+    // one cache-aligned block handed out by TwoNodePool.
+    struct alignas(64) TwoNodeBlock {
+        Node node;
+        Item items[8];
+        P values[SOA ? 8 : 1]; // SoA only
+        bitmap_t none_bitmap[1];
+        bitmap_t child_bitmap[1];
+    };
+
+    // Per-thread pool of two-key node blocks. Each thread allocates from and
+    // frees into its own cache; surplus blocks are handed to other threads in
+    // batches through a shared list. Slabs are only reserved from the OS and
+    // never touched here, so pages are first touched (and placed NUMA-locally)
+    // by the thread that builds nodes in them.
+    // The pool is a singleton so nodes retired through ebr can still be
+    // returned after the owning LIPP is gone.
+    class TwoNodePool {
+        static constexpr size_t SLAB_NODES = 4096;
+        static constexpr size_t BATCH_NODES = 256;
+
+        struct LocalCache {
+            std::vector<TwoNodeBlock*> free;
+            // PoolStats, written by the owning thread only, see bump()
+            std::atomic<uint64_t> allocations{0};
+            std::atomic<uint64_t> local_hits{0};
+            std::atomic<uint64_t> batch_refills{0};
+            std::atomic<uint64_t> slab_refills{0};
+        };
+
+        tbb::enumerable_thread_specific<LocalCache,
+            tbb::cache_aligned_allocator<LocalCache>,
+            tbb::ets_key_per_instance> mLocalCaches;
+        spin_lock mLock;
+        std::vector<std::vector<TwoNodeBlock*>> mBatches; // protected by mLock
+        std::vector<TwoNodeBlock*> mSlabs; // protected by mLock
+        std::atomic<size_t> mReserved;
+
+        TwoNodePool() : mLocalCaches(), mReserved(0) {}
+
+        /// allocate a new slab, append its blocks to out
+        void new_slab(std::vector<TwoNodeBlock*>& out) {
+            TwoNodeBlock* slab = static_cast<TwoNodeBlock*>(
+                aligned_alloc(alignof(TwoNodeBlock), sizeof(TwoNodeBlock) * SLAB_NODES));
+            RT_ASSERT(slab != NULL);
+            mLock.lock();
+            mSlabs.push_back(slab);
+            mLock.unlock();
+            out.reserve(out.size() + SLAB_NODES);
+            for (size_t i = SLAB_NODES; i > 0; i --) {
+                out.push_back(slab + i - 1);
+            }
+            mReserved += SLAB_NODES;
+        }
+
+    public:
+        TwoNodePool(TwoNodePool const &other) = delete;
+        TwoNodePool(TwoNodePool &&other) = delete;
+
+        ~TwoNodePool() {
+            for (TwoNodeBlock* slab : mSlabs) {
+                free(slab);
+            }
+        }
+
+        static TwoNodePool *getInstance() {
+            static TwoNodePool instance;
+            return &instance;
+        }
+
+        /// make sure at least n blocks have been reserved
+        void reserve(size_t n) {
+            while (mReserved < n) {
+                std::vector<TwoNodeBlock*> blocks;
+                new_slab(blocks);
+                mLock.lock();
+                for (size_t i = 0; i < blocks.size(); i += BATCH_NODES) {
+                    mBatches.emplace_back(blocks.begin() + i,
+                        blocks.begin() + std::min(blocks.size(), i + BATCH_NODES));
+                }
+                mLock.unlock();
+            }
+        }
+
+        size_t reserved() const {
+            return mReserved.load();
+        }
+
+        /// allocations and refills so far, summed over all threads
+        PoolStats stats() const {
+            PoolStats sum;
+            for (const LocalCache& cache : mLocalCaches) {
+                sum.allocations += cache.allocations.load(std::memory_order_relaxed);
+                sum.local_hits += cache.local_hits.load(std::memory_order_relaxed);
+                sum.batch_refills += cache.batch_refills.load(std::memory_order_relaxed);
+                sum.slab_refills += cache.slab_refills.load(std::memory_order_relaxed);
+            }
+            return sum;
+        }
+
+        TwoNodeBlock* allocate() {
+            LocalCache& cache = mLocalCaches.local();
+            std::vector<TwoNodeBlock*>& local = cache.free;
+            bump(cache.allocations);
+            if (local.empty()) {
+                mLock.lock();
+                if (!mBatches.empty()) {
+                    local.swap(mBatches.back());
+                    mBatches.pop_back();
+                }
+                mLock.unlock();
+                if (local.empty()) {
+                    new_slab(local);
+                    bump(cache.slab_refills);
+                } else {
+                    bump(cache.batch_refills);
+                }
+            } else {
+                bump(cache.local_hits);
+            }
+            TwoNodeBlock* block = local.back();
+            local.pop_back();
+            return block;
+        }
+
+        void deallocate(TwoNodeBlock* block) {
+            std::vector<TwoNodeBlock*>& local = mLocalCaches.local().free;
+            local.push_back(block);
+            if (local.size() >= BATCH_NODES * 2) {
+                std::vector<TwoNodeBlock*> batch(local.end() - BATCH_NODES, local.end());
+                local.resize(local.size() - BATCH_NODES);
+                mLock.lock();
+                mBatches.push_back(std::move(batch));
+                mLock.unlock();
+            }
+        }
+    };
+
+    static std::allocator<Node> node_allocator;
+    Node* new_nodes(int n)
+    {
+        Node* p = node_allocator.allocate(n);
+        p->typeVersionLockObsolete = 0b100;
+
+        RT_ASSERT(p != NULL && p != (Node*)(-1));
+        return p;
+    }
+    static void delete_nodes(Node* p, int n)
+    {
+        node_allocator.deallocate(p, n);
+    }
+
+    void delete_oneNodes(Node* p)
+    {
+        node_allocator.deallocate(p, 1);
+    }
+
+    static std::allocator<Item> item_allocator;
+    Item* new_items(int n)
+    {
+        Item* p = item_allocator.allocate(n);
+        RT_ASSERT(p != NULL && p != (Item*)(-1));
+        return p;
+    }
+    static void delete_items(Item* p, int n)
+    {
+        item_allocator.deallocate(p, n);
+    }
+
+    static std::allocator<P> value_allocator;
+    P* new_values(int n)
+    {
+        P* p = value_allocator.allocate(n);
+        RT_ASSERT(p != NULL && p != (P*)(-1));
+        return p;
+    }
+    static void delete_values(P* p, int n)
+    {
+        value_allocator.deallocate(p, n);
+    }
+
+    static std::allocator<bitmap_t> bitmap_allocator;
+    bitmap_t* new_bitmap(int n)
+    {
+        bitmap_t* p = bitmap_allocator.allocate(n);
+        RT_ASSERT(p != NULL && p != (bitmap_t*)(-1));
+        return p;
+    }
+    static void delete_bitmap(bitmap_t* p, int n)
+    {
+        bitmap_allocator.deallocate(p, n);
+    }
+
+    // block layout: [Node | none_bitmap | child_bitmap | pad | items | pad |
+    // values (SoA only)], used by co-allocated nodes and by every node of a
+    // saved image
+    static size_t node_items_offset(int num_items)
+    {
+        const size_t bitmap_bytes = sizeof(bitmap_t) * BITMAP_SIZE(num_items) * 2;
+        return (sizeof(Node) + bitmap_bytes + alignof(Item) - 1) / alignof(Item) * alignof(Item);
+    }
+    static size_t node_values_offset(int num_items)
+    {
+        const size_t items_end = node_items_offset(num_items) + sizeof(Item) * num_items;
+        return (items_end + alignof(P) - 1) / alignof(P) * alignof(P);
+    }
+    static size_t node_block_size(int num_items)
+    {
+        const size_t end = SOA ? node_values_offset(num_items) + sizeof(P) * num_items
+                               : node_items_offset(num_items) + sizeof(Item) * num_items;
+        return (end + 63) / 64 * 64;
+    }
+
+    /// the mapping of an interleaved node, see interleave_copy()
+    static size_t interleaved_bytes(int num_items)
+    {
+        return (node_block_size(num_items) + page_size() - 1) / page_size() * page_size();
+    }
+
+    /// allocate a node with num_items items, bitmaps are left uninitialized
+    Node* new_node(int num_items)
+    {
+        #if LIPP_COALLOC_NODE
+        char* p = static_cast<char*>(aligned_alloc(64, node_block_size(num_items)));
+        RT_ASSERT(p != NULL);
+        Node* node = reinterpret_cast<Node*>(p);
+        node->none_bitmap = reinterpret_cast<bitmap_t*>(p + sizeof(Node));
+        node->child_bitmap = node->none_bitmap + BITMAP_SIZE(num_items);
+        node->items = reinterpret_cast<Item*>(p + node_items_offset(num_items));
+        node->values = SOA ? reinterpret_cast<P*>(p + node_values_offset(num_items)) : nullptr;
+        #else
+        Node* node = new_nodes(1);
+        const int bitmap_size = BITMAP_SIZE(num_items);
+        node->items = new_items(num_items);
+        node->values = SOA ? new_values(num_items) : nullptr;
+        node->none_bitmap = new_bitmap(bitmap_size);
+        node->child_bitmap = new_bitmap(bitmap_size);
+        #endif
+        node->num_items = num_items;
+        node->in_image = 0;
+        node->interleaved = 0;
+        node->stripes = nullptr;
+        node->rebuild_queued = false;
+        node->snapshot_ts = 0;
+        node->typeVersionLockObsolete = 0b100;
+        return node;
+    }
+    static void delete_node(Node* node)
+    {
+        free(node->stripes);
+        if (node->interleaved) {
+            munmap(node, interleaved_bytes(node->num_items));
+            return;
+        }
+        #if LIPP_COALLOC_NODE
+        free(node);
+        #else
+        delete_items(node->items, node->num_items);
+        if (SOA) delete_values(node->values, node->num_items);
+        const int bitmap_size = BITMAP_SIZE(node->num_items);
+        delete_bitmap(node->none_bitmap, bitmap_size);
+        delete_bitmap(node->child_bitmap, bitmap_size);
+        delete_nodes(node, 1);
+        #endif
+    }
+    /// bytes used by a node besides its items
+    static size_t node_overhead(int num_items)
+    {
+        #if LIPP_COALLOC_NODE
+        return node_block_size(num_items) - SLOT_SIZE * num_items;
+        #else
+        (void) num_items;
+        return sizeof(Node);
+        #endif
+    }
+    /// bytes freeing node gives back
+    static size_t node_bytes(const Node* node)
+    {
+        if (node->is_two) return sizeof(TwoNodeBlock) + (node->stripes ? sizeof(CounterStripe) * COUNTER_STRIPES : 0);
+        return node_overhead(node->num_items) + SLOT_SIZE * node->num_items
+            + (node->stripes ? sizeof(CounterStripe) * COUNTER_STRIPES : 0);
+    }
+
+    // Nodes built over at least this many keys (the levels below the root)
+    // are on the path of most inserts. Their counters are split into cache
+    // line sized stripes picked by thread, so inserts don't all write the
+    // same line. The root is on every path and striped whatever its size,
+    // see stripe_root().
+    static constexpr int STRIPED_COUNTERS_MIN_SIZE = 1 << 16;
+    static constexpr int COUNTER_STRIPES = 16;
+    // adjust() looks at a striped node once every this many counted
+    // operations of a stripe, summing the stripes on every insert would
+    // pull all of their lines back
+    static constexpr int COUNTER_CHECK_PERIOD = 64;
+
+    static int counter_stripe()
+    {
+        static std::atomic<int> next_stripe{0};
+        thread_local int stripe = next_stripe.fetch_add(1, std::memory_order_relaxed) % COUNTER_STRIPES;
+        return stripe;
+    }
+    static void reset_counters(NodeCounters& c, int size)
+    {
+        c.size.store(size, std::memory_order_relaxed);
+        c.num_inserts.store(0, std::memory_order_relaxed);
+        c.num_insert_to_data.store(0, std::memory_order_relaxed);
+        c.ticks.store(0, std::memory_order_relaxed);
+    }
+    static CounterStripe* new_stripes()
+    {
+        CounterStripe* stripes = static_cast<CounterStripe*>(aligned_alloc(64, sizeof(CounterStripe) * COUNTER_STRIPES));
+        RT_ASSERT(stripes != NULL);
+        for (int i = 0; i < COUNTER_STRIPES; i ++) {
+            reset_counters(stripes[i], 0);
+        }
+        return stripes;
+    }
+    /// set the counters of a new node holding size keys, built over build_size
+    static void init_counters(Node* node, int build_size, int size)
+    {
+        node->build_size = build_size;
+        reset_counters(node->counters, size);
+        node->stripes = build_size >= STRIPED_COUNTERS_MIN_SIZE ? new_stripes() : nullptr;
+    }
+    /// give node, about to be published as the root, striped counters. A
+    /// root built small or empty would keep its single counters while it
+    /// fills up otherwise, until its first rebuild.
+    static Node* stripe_root(Node* node)
+    {
+        if (node->stripes == nullptr) node->stripes = new_stripes();
+        return node;
+    }
+    /// count an insert (size_delta 1) or an erase (size_delta -1) below node
+    static void count_op(Node* node, int size_delta, int inserts_delta, int to_data_delta)
+    {
+        NodeCounters& c = node->stripes ? node->stripes[counter_stripe()] : node->counters;
+        c.size.fetch_add(size_delta, std::memory_order_relaxed);
+        if (inserts_delta) c.num_inserts.fetch_add(inserts_delta, std::memory_order_relaxed);
+        if (to_data_delta) c.num_insert_to_data.fetch_add(to_data_delta, std::memory_order_relaxed);
+        if (node->stripes) c.ticks.fetch_add(1, std::memory_order_relaxed);
+    }
+    /// false while adjust() may skip node, see COUNTER_CHECK_PERIOD
+    static bool counters_due(const Node* node)
+    {
+        return node->stripes == nullptr
+            || node->stripes[counter_stripe()].ticks.load(std::memory_order_relaxed) % COUNTER_CHECK_PERIOD == 0;
+    }
+    static int sum_counter(const Node* node, std::atomic<int> NodeCounters::* counter)
+    {
+        int sum = (node->counters.*counter).load(std::memory_order_relaxed);
+        if (node->stripes) {
+            for (int i = 0; i < COUNTER_STRIPES; i ++) {
+                sum += (node->stripes[i].*counter).load(std::memory_order_relaxed);
+            }
+        }
+        return sum;
+    }
+    static int node_size(const Node* node) { return sum_counter(node, &NodeCounters::size); }
+    static int node_num_inserts(const Node* node) { return sum_counter(node, &NodeCounters::num_inserts); }
+    static int node_num_insert_to_data(const Node* node) { return sum_counter(node, &NodeCounters::num_insert_to_data); }
+
+    /// build an empty tree
+    Node* build_tree_none()
+    {
+        Node* node = new_node(1);
+        node->is_two = 0;
+        init_counters(node, 0, 0);
+        node->fixed = 0;
+        node->model.a = node->model.c = 0;
+        node->model.base = KeyTraits<T>::make_base(T(), T());
+        node->none_bitmap[0] = 0;
+        BITMAP_SET(node->none_bitmap, 0);
+        node->child_bitmap[0] = 0;
+        node->typeVersionLockObsolete = 0b100;
+        return node;
+    }
+    /// build a tree with two keys
+    Node* build_tree_two(T key1, P value1, T key2, P value2)
+    {
+        if (key1 > key2) {
+            std::swap(key1, key2);
+            std::swap(value1, value2);
+        }
+        RT_ASSERT(key1 < key2);
+        static_assert(BITMAP_WIDTH >= 8);
+
+        TwoNodeBlock* block = TwoNodePool::getInstance()->allocate();
+        Node* node = &block->node;
+        node->is_two = 1;
+        node->in_image = 0;
+        node->interleaved = 0;
+        init_counters(node, 2, 2);
+        node->fixed = 0;
+
+        node->num_items = 8;
+        node->items = block->items;
+        node->values = SOA ? block->values : nullptr;
+        node->none_bitmap = block->none_bitmap;
+        node->child_bitmap = block->child_bitmap;
+        node->none_bitmap[0] = bitmap_t(~bitmap_t(0));
+        node->child_bitmap[0] = 0;
+        node->rebuild_queued = false;
+        node->snapshot_ts = 0;
+        node->typeVersionLockObsolete = 0b100;
+
+        node->model.base = KeyTraits<T>::make_base(key1, key2);
+        const double mid2_key = node->model.offset(key2);
+
+        const double mid1_target = node->num_items / 3;
+        const double mid2_target = node->num_items * 2 / 3;
+
+        node->model.a = (mid2_target - mid1_target) / mid2_key;
+        node->model.c = mid1_target;
+        RT_ASSERT(isfinite(node->model.a));
+        RT_ASSERT(isfinite(node->model.c));
+
+        { // insert key1&value1
+            int pos = PREDICT_POS(node, key1);
+            RT_ASSERT(BITMAP_GET(node->none_bitmap, pos) == 1);
+            BITMAP_CLEAR(node->none_bitmap, pos);
+            node->items[pos].comp.data.key = key1;
+            slot_value(node, pos) = value1;
+        }
+        { // insert key2&value2
+            int pos = PREDICT_POS(node, key2);
+            RT_ASSERT(BITMAP_GET(node->none_bitmap, pos) == 1);
+            BITMAP_CLEAR(node->none_bitmap, pos);
+            node->items[pos].comp.data.key = key2;
+            slot_value(node, pos) = value2;
+        }
+
+        return node;
+    }
+    /// bulk build, _keys must be sorted in asc order. heat, if given, is
+    /// InsertHeat::prefix() of the keys and picks their nodes' gap counts.
+    Node* build_tree_bulk(T* _keys, P* _values, int _size, const double* heat = nullptr)
+    {
+        if constexpr (USE_FMCD) {
+            return build_tree_bulk_fmcd(_keys, _values, _size, heat);
+        } else {
+            return build_tree_bulk_fast(_keys, _values, _size, heat);
+        }
+    }
+    /// bulk build, _keys must be sorted in asc order.
+    /// split keys into three parts at each node.
+    Node* build_tree_bulk_fast(T* _keys, P* _values, int _size, const double* heat = nullptr)
+    {
+        return build_tree_segments(_keys, _values, _size, false, heat);
+    }
+    /// bulk build, _keys must be sorted in asc order.
+    /// FMCD method.
+    Node* build_tree_bulk_fmcd(T* _keys, P* _values, int _size, const double* heat = nullptr)
+    {
+        return build_tree_segments(_keys, _values, _size, true, heat);
+    }
+
+    // segments with at least this many keys are built as separate tasks
+    static constexpr int PARALLEL_BUILD_MIN_SIZE = 1 << 16;
+
+    typedef struct {
+        int begin;
+        int end;
+        int level; // top level = 1
+        Node** slot; // where the built node is stored
+    } Segment;
+
+    /// Build the tree of _keys top-down. Each node places its keys and hands
+    /// every conflicting range of keys on as a child segment. Large segments
+    /// become tbb tasks, the others are built on an explicit stack, the tree
+    /// is the same either way.
+    Node* build_tree_segments(T* _keys, P* _values, int _size, bool fmcd, const double* heat)
+    {
+        RT_ASSERT(_size > 1);
+        if (_size == 2) {
+            return build_tree_two(_keys[0], _values[0], _keys[1], _values[1]);
+        }
+
+        Node* ret = NULL;
+        const Segment top = (Segment){0, _size, 1, &ret};
+        if (_size >= PARALLEL_BUILD_MIN_SIZE) {
+            tbb::task_group tg;
+            build_segment_parallel(tg, _keys, _values, top, fmcd, heat);
+            tg.wait();
+        } else {
+            build_segment_serial(_keys, _values, top, fmcd, heat);
+        }
+        return ret;
+    }
+
+    void build_segment_parallel(tbb::task_group& tg, T* _keys, P* _values, const Segment& seg, bool fmcd, const double* heat)
+    {
+        build_segment(_keys, _values, seg, fmcd, heat, [&](const Segment& child) {
+            if (child.end - child.begin >= PARALLEL_BUILD_MIN_SIZE) {
+                tg.run([this, &tg, _keys, _values, child, fmcd, heat] {
+                    build_segment_parallel(tg, _keys, _values, child, fmcd, heat);
+                });
+            } else {
+                build_segment_serial(_keys, _values, child, fmcd, heat);
+            }
+        });
+    }
+
+    void build_segment_serial(T* _keys, P* _values, const Segment& seg, bool fmcd, const double* heat)
+    {
+        std::stack<Segment> s;
+        s.push(seg);
+        while (!s.empty()) {
+            Segment top = s.top();
+            s.pop();
+            build_segment(_keys, _values, top, fmcd, heat, [&](const Segment& child) {
+                s.push(child);
+            });
+        }
+    }
+
+    /// build the node of one segment into *seg.slot, keys that conflict on
+    /// a slot are passed to on_child as a new segment
+    template<class F>
+    void build_segment(T* _keys, P* _values, const Segment& seg, bool fmcd, const double* heat, F&& on_child)
+    {
+        const int begin = seg.begin;
+        const int end = seg.end;
+        const int level = seg.level;
+
+        RT_ASSERT(end - begin > 2);
+        T* keys = _keys + begin;
+        P* values = _values + begin;
+        const int size = end - begin;
+
+        int gap_cnt = compute_gap_count(size);
+        if (heat) {
+            gap_cnt = Policy::rebuild_gap_count(gap_cnt, (heat[end] - heat[begin]) / size);
+        }
+        Node* node = fmcd ? new_node_fmcd(keys, size, gap_cnt) : new_node_fast(keys, size, gap_cnt);
+        *seg.slot = node;
+        node->is_two = 0;
+        init_counters(node, size, size);
+        node->fixed = 0;
+
+        if (size > 1e6) {
+            node->fixed = 1;
+        }
+
+        const int bitmap_size = BITMAP_SIZE(node->num_items);
+        memset(node->none_bitmap, 0xff, sizeof(bitmap_t) * bitmap_size);
+        memset(node->child_bitmap, 0, sizeof(bitmap_t) * bitmap_size);
+
+        std::vector<int> positions(size);
+        predict_positions(node, keys, size, positions.data());
+        for (int item_i = positions[0], offset = 0; offset < size; ) {
+            int next = offset + 1, next_i = -1;
+            while (next < size) {
+                next_i = positions[next];
+                if (next_i == item_i) {
+                    next ++;
+                } else {
+                    break;
                 }
             }
+            if (next == offset + 1) {
+                BITMAP_CLEAR(node->none_bitmap, item_i);
+                node->items[item_i].comp.data.key = keys[offset];
+                slot_value(node, item_i) = values[offset];
+            } else {
+                // ASSERT(next - offset <= (size+2) / 3);
+                BITMAP_CLEAR(node->none_bitmap, item_i);
+                BITMAP_SET(node->child_bitmap, item_i);
+                if (next == offset + 2) {
+                    node->items[item_i].comp.child = build_tree_two(keys[offset], values[offset], keys[offset+1], values[offset+1]);
+                } else {
+                    on_child((Segment){begin + offset, begin + next, level + 1, &node->items[item_i].comp.child});
+                }
+            }
+            if (next >= size) {
+                break;
+            } else {
+                item_i = next_i;
+                offset = next;
+            }
+        }
+    }
+
+    /// allocate the node for size sorted keys with BUILD_GAP_CNT free slots
+    /// per key, model fit through the keys at 1/3 and 2/3
+    Node* new_node_fast(T* keys, int size, const int BUILD_GAP_CNT)
+    {
+        LinearModel<T> model;
+        int num_items;
+
+        int mid1_pos = (size - 1) / 3;
+        int mid2_pos = (size - 1) * 2 / 3;
+
+        RT_ASSERT(0 <= mid1_pos);
+        RT_ASSERT(mid1_pos < mid2_pos);
+        RT_ASSERT(mid2_pos < size - 1);
+
+        model.base = KeyTraits<T>::make_base(keys[0], keys[size - 1]);
+        num_items = size * static_cast<int>(BUILD_GAP_CNT + 1);
+        fit_mid_keys(model, keys, size, mid1_pos, mid2_pos, BUILD_GAP_CNT);
+
+        const int lr_remains = static_cast<int>(size * BUILD_LR_REMAIN);
+        model.c += lr_remains;
+        num_items += lr_remains * 2;
+
+        Node* node = new_node(num_items);
+        node->model = model;
+        return node;
+    }
+
+    /// fit model (its base set) through the midpoints of the keys at
+    /// mid1_pos and mid2_pos; through the first and last key instead where
+    /// those midpoints tie, byte keys alike in the node's offset window do
+    void fit_mid_keys(LinearModel<T>& model, const T* keys, int size, int mid1_pos, int mid2_pos, const int BUILD_GAP_CNT)
+    {
+        double mid1_key = (model.offset(keys[mid1_pos]) + model.offset(keys[mid1_pos + 1])) / 2;
+        double mid2_key = (model.offset(keys[mid2_pos]) + model.offset(keys[mid2_pos + 1])) / 2;
+        double mid1_target = mid1_pos * static_cast<int>(BUILD_GAP_CNT + 1) + static_cast<int>(BUILD_GAP_CNT + 1) / 2;
+        double mid2_target = mid2_pos * static_cast<int>(BUILD_GAP_CNT + 1) + static_cast<int>(BUILD_GAP_CNT + 1) / 2;
+        if (!(mid2_key > mid1_key)) {
+            mid1_key = model.offset(keys[0]);
+            mid2_key = model.offset(keys[size - 1]);
+            mid1_target = static_cast<int>(BUILD_GAP_CNT + 1) / 2;
+            mid2_target = (size - 1) * static_cast<int>(BUILD_GAP_CNT + 1) + static_cast<int>(BUILD_GAP_CNT + 1) / 2;
+        }
+
+        model.a = (mid2_target - mid1_target) / (mid2_key - mid1_key);
+        model.c = mid1_target - model.a * mid1_key;
+        RT_ASSERT(isfinite(model.a));
+        RT_ASSERT(isfinite(model.c));
+    }
+
+    /// allocate the node for size sorted keys with BUILD_GAP_CNT free slots
+    /// per key, model from FMCD
+    Node* new_node_fmcd(T* keys, int size, const int BUILD_GAP_CNT)
+    {
+        LinearModel<T> model;
+        int num_items;
+
+        // FMCD method
+        // Here the implementation is a little different with Algorithm 1 in our paper.
+        // In Algorithm 1, U_T should be (keys[size-1-D] - keys[D]) / (L - 2).
+        // But according to the derivation described in our paper, M.A should be less than 1 / U_T.
+        // So we added a small number (1e-6) to U_T.
+        // In fact, it has only a negligible impact of the performance.
+        {
+            // in offsets from the node's base, the gaps of byte keys are
+            // those of their bytes after the common prefix
+            model.base = KeyTraits<T>::make_base(keys[0], keys[size - 1]);
+            const int L = size * static_cast<int>(BUILD_GAP_CNT + 1);
+            int i = 0;
+            int D = 1;
+            RT_ASSERT(D <= size-1-D);
+            double Ut = (model.offset(keys[size - 1 - D]) - model.offset(keys[D])) /
+                        (static_cast<double>(L - 2)) + 1e-6;
+            while (i < size - 1 - D) {
+                while (i + D < size && model.offset(keys[i + D]) - model.offset(keys[i]) >= Ut) {
+                    i ++;
+                }
+                if (i + D >= size) {
+                    break;
+                }
+                D = D + 1;
+                if (D * 3 > size) break;
+                RT_ASSERT(D <= size-1-D);
+                Ut = (model.offset(keys[size - 1 - D]) - model.offset(keys[D])) /
+                     (static_cast<double>(L - 2)) + 1e-6;
+            }
+            if (D * 3 <= size) {
+                stats.fmcd_success_times ++;
+
+                model.a = 1.0 / Ut;
+                model.c = (L - model.a * (model.offset(keys[size - 1 - D]) + model.offset(keys[D]))) / 2;
+                RT_ASSERT(isfinite(model.a));
+                RT_ASSERT(isfinite(model.c));
+                num_items = L;
+            } else {
+                stats.fmcd_broken_times ++;
+
+                int mid1_pos = (size - 1) / 3;
+                int mid2_pos = (size - 1) * 2 / 3;
+
+                RT_ASSERT(0 <= mid1_pos);
+                RT_ASSERT(mid1_pos < mid2_pos);
+                RT_ASSERT(mid2_pos < size - 1);
+
+                num_items = size * static_cast<int>(BUILD_GAP_CNT + 1);
+                fit_mid_keys(model, keys, size, mid1_pos, mid2_pos, BUILD_GAP_CNT);
+            }
+        }
+        RT_ASSERT(model.a >= 0);
+        const int lr_remains = static_cast<int>(size * BUILD_LR_REMAIN);
+        model.c += lr_remains;
+        num_items += lr_remains * 2;
+
+        Node* node = new_node(num_items);
+        node->model = model;
+        return node;
+    }
+
+    void destroy_tree(Node* root)
+    {
+        std::stack<Node*> s;
+        s.push(root);
+        while (!s.empty()) {
+            Node* node = s.top(); s.pop();
+
+            for (int i = 0; i < node->num_items; i ++) {
+                if (BITMAP_GET(node->child_bitmap, i) == 1) {
+                    s.push(node->items[i].comp.child);
+                }
+            }
+
+            delete_all(node);
+        }
+    }
+
+    static void delete_all(void *vnode){
+        Node *node = (Node *) vnode ;
+
+        if (node->in_image) {
+            return;
+        }
+        if (node->is_two) {
+            RT_ASSERT(node->num_items == 8);
+            free(node->stripes); // as the root
+            TwoNodePool::getInstance()->deallocate(reinterpret_cast<TwoNodeBlock*>(node));
+            return;
+        }
+
+        delete_node(node);
+    }
+
+    /// Where the inserts since the last build landed in a subtree, gathered
+    /// while scanning it for a rebuild. A scan emits every node's subtree as
+    /// one run of keys; the inserts a node counted that its children didn't
+    /// are spread evenly over its run.
+    class InsertHeat
+    {
+        struct Span { int begin; int end; double inserts; };
+        std::vector<Span> spans;
+
+    public:
+        /// node's subtree starts at key begin, below the node of span parent
+        /// (-1 for the scanned root), returns node's span
+        int enter(const Node* node, int begin, int parent) {
+            const int inserts = node_num_inserts(node);
+            if (parent >= 0) spans[parent].inserts -= inserts;
+            spans.push_back((Span){begin, begin, static_cast<double>(inserts)});
+            return spans.size() - 1;
+        }
+        void leave(int span, int end) { spans[span].end = end; }
+
+        /// prefix sums of the per-key heat over size keys, scaled so the
+        /// average key has heat 1; empty if nothing was inserted
+        std::vector<double> prefix(int size) const {
+            std::vector<double> diff(size + 1, 0);
+            for (const Span& span : spans) {
+                if (span.end <= span.begin || span.inserts <= 0) continue;
+                const double w = span.inserts / (span.end - span.begin);
+                diff[span.begin] += w;
+                diff[span.end] -= w;
+            }
+            double total = 0, heat = 0;
+            for (int i = 0; i < size; i ++) {
+                heat += diff[i];
+                diff[i] = heat;
+                total += heat;
+            }
+            std::vector<double> ret;
+            if (!(total > 0)) return ret;
+            ret.resize(size + 1);
+            ret[0] = 0;
+            for (int i = 0; i < size; i ++) {
+                ret[i + 1] = ret[i] + std::max(0.0, diff[i]) * size / total;
+            }
+            return ret;
+        }
+    };
+
+    /// collect the keys of the subtree under _root in asc order. _root must
+    /// be write-locked by the caller; every node below it is write-locked
+    /// too, so writers still inside the subtree finish first or restart.
+    /// The locked nodes are appended to nodes, release them with
+    /// retire_nodes() once the subtree is replaced.
+    void scan_and_destory_tree(Node* _root, std::vector<T>& keys, std::vector<P>& values, std::vector<Node*>& nodes,
+                               InsertHeat* heat = nullptr)
+    {
+        struct Segment {
+            Node* node;
+            int pos; // next pos
+            int span; // in heat
+        };
+        std::stack<Segment> s;
+
+        nodes.push_back(_root);
+        s.push((Segment){_root, 0, heat ? heat->enter(_root, keys.size(), -1) : -1});
+        while (!s.empty()) {
+            Node* node = s.top().node;
+            int i = s.top().pos;
+            while (i < node->num_items && BITMAP_GET(node->none_bitmap, i) == 1) {
+                i ++;
+            }
+            if (i >= node->num_items) {
+                if (heat) heat->leave(s.top().span, keys.size());
+                s.pop();
+                continue;
+            }
+            s.top().pos = i + 1;
+
+            if (BITMAP_GET(node->child_bitmap, i) == 0) {
+                keys.push_back(node->items[i].comp.data.key);
+                values.push_back(slot_value(node, i));
+            } else {
+                Node* child = node->items[i].comp.child;
+                write_lock_child(child);
+                nodes.push_back(child);
+                s.push((Segment){child, 0, heat ? heat->enter(child, keys.size(), s.top().span) : -1});
+            }
+        }
+    }
+
+    /// write-lock child of a write-locked node, waiting for writers inside it
+    static void write_lock_child(Node* child)
+    {
+        int restartCount = 0;
+        while (true) {
+            bool needRestart = false;
+            uint64_t version = child->readLockOrRestart(needRestart);
+            if (!needRestart) {
+                child->upgradeToWriteLockOrRestart(version, needRestart);
+                if (!needRestart) break;
+            }
+            // only leaf writers can hold it, a child is never replaced without its parent's lock
+            RT_ASSERT(!child->isObsolete());
+            yield(++ restartCount);
+        }
+    }
+
+    /// mark write-locked nodes obsolete and schedule them for deletion
+    void retire_nodes(const std::vector<Node*>& nodes)
+    {
+        for (Node* node : nodes) {
+            node->writeUnlockObsolete();
+            if (node->in_image) continue; // stays mapped until the image is released
+            ebr->scheduleForDeletion(std::make_pair((void *)node, delete_all), node_bytes(node)) ;
+        }
+    }
+
+    /// build a node from sorted keys, size may be below 2
+    Node* build_tree_any(T* keys, P* values, int size, const double* heat = nullptr)
+    {
+        if (size >= 2) {
+            return build_tree_bulk(keys, values, size, heat);
+        }
+        Node* node = build_tree_none();
+        if (size == 1) {
+            BITMAP_CLEAR(node->none_bitmap, 0);
+            node->items[0].comp.data.key = keys[0];
+            slot_value(node, 0) = values[0];
+            init_counters(node, 1, 1);
+        }
+        return node;
+    }
+
+    enum RebuildResult { REBUILD_DONE, REBUILD_RESTART, REBUILD_STALE };
+
+    /// replace the subtree at node by a freshly built one while holding
+    /// locks. node is parent's child on key's path (or the root if parent is
+    /// null) and version its read version.
+    RebuildResult rebuild_locked(Node* parent, Node* node, uint64_t version, const T& key)
+    {
+        bool needRestart = false;
+        // locks are taken top-down: parent slot first, then the subtree
+        int pos = 0;
+        if (parent) {
+            uint64_t versionParent = parent->readLockOrRestart(needRestart);
+            if (needRestart) {
+                return parent->isObsolete() ? REBUILD_STALE : REBUILD_RESTART;
+            }
+            parent->upgradeToWriteLockOrRestart(versionParent, needRestart);
+            if (needRestart) return REBUILD_RESTART;
+            pos = PREDICT_POS(parent, key);
+            if (BITMAP_GET(parent->child_bitmap, pos) == 0 || parent->items[pos].comp.child != node) {
+                parent->writeUnlock();
+                return REBUILD_STALE;
+            }
+        }
+        node->upgradeToWriteLockOrRestart(version, needRestart) ;
+        if(needRestart) {
+            if (parent) parent->writeUnlock();
+            return REBUILD_RESTART;
+        }
+        if (parent) preserve_for_snapshots(parent);
+
+        std::vector<T> keys;
+        std::vector<P> values;
+        std::vector<Node*> nodes;
+        keys.reserve(std::max(0, node_size(node)));
+        values.reserve(std::max(0, node_size(node)));
+        InsertHeat heat;
+
+        #if COLLECT_TIME
+        auto start_time_scan = std::chrono::high_resolution_clock::now();
+        #endif
+        scan_and_destory_tree(node, keys, values, nodes, &heat);
+        #if COLLECT_TIME
+        auto end_time_scan = std::chrono::high_resolution_clock::now();
+        auto duration_scan = end_time_scan - start_time_scan;
+        stats.time_scan_and_destory_tree += std::chrono::duration_cast<std::chrono::nanoseconds>(duration_scan).count() * 1e-9;
+        #endif
+        const int ESIZE = keys.size();
+
+        if (parent && ESIZE <= 1) {
+            BITMAP_CLEAR(parent->child_bitmap, pos);
+            if (ESIZE == 0) {
+                BITMAP_SET(parent->none_bitmap, pos);
+            } else {
+                parent->items[pos].comp.data.key = keys[0];
+                slot_value(parent, pos) = values[0];
+            }
+        } else {
+            #if COLLECT_TIME
+            auto start_time_build = std::chrono::high_resolution_clock::now();
+            #endif
+            const std::vector<double> heat_prefix = heat.prefix(ESIZE);
+            Node* new_node = build_tree_any(keys.data(), values.data(), ESIZE,
+                                            heat_prefix.empty() ? nullptr : heat_prefix.data());
+            #if COLLECT_TIME
+            auto end_time_build = std::chrono::high_resolution_clock::now();
+            auto duration_build = end_time_build - start_time_build;
+            stats.time_build_tree_bulk += std::chrono::duration_cast<std::chrono::nanoseconds>(duration_build).count() * 1e-9;
+            #endif
+
+            if (parent) {
+                store_child(parent->items[pos], new_node);
+            } else {
+                swap_root(node, new_node);
+            }
+        }
+
+        retire_nodes(nodes);
+        if (parent) parent->writeUnlock();
+        return REBUILD_DONE;
+    }
+
+    /// Keys past the right end of the root model all clamp into its last slot
+    /// and pile up there as a chain of two-key nodes, appends (timestamps)
+    /// hit this on every insert. Such a key grows the root first: returns
+    /// the item count of the grown root, or 0 if key fits the current one.
+    /// Keys more than a root width away don't grow it, they are rare and
+    /// would blow the root up.
+    static int root_grow_items(const Node* node, const T& key)
+    {
+        const int num_items = node->num_items;
+        const double v = node->model.predict_double(key);
+        if (!(v >= num_items) || v - num_items >= num_items) return 0;
+        // half a root of headroom, so appends grow it geometrically
+        const long long grown = static_cast<long long>(v) + 1 + num_items / 2;
+        if (grown > std::numeric_limits<int>::max() / 2) return 0;
+        return static_cast<int>(grown);
+    }
+
+    /// Copy of the write-locked root with num_items slots. The model is kept
+    /// as is, so every slot but the last keeps its keys and in-flight writers
+    /// below those slots stay valid. The keys of the old last slot, which
+    /// also held everything clamped past the end, are spread over the new
+    /// slots. The old root and the last slot's subtree are appended to nodes
+    /// for retire_nodes(), the copy is not published yet.
+    Node* grow_root_locked(Node* node, int num_items, std::vector<Node*>& nodes)
+    {
+        nodes.push_back(node);
+        std::vector<T> keys;
+        std::vector<P> values;
+        const int last = node->num_items - 1;
+        if (BITMAP_GET(node->child_bitmap, last) == 1) {
+            Node* child = node->items[last].comp.child;
+            write_lock_child(child);
+            scan_and_destory_tree(child, keys, values, nodes);
+        } else if (BITMAP_GET(node->none_bitmap, last) == 0) {
+            keys.push_back(node->items[last].comp.data.key);
+            values.push_back(slot_value(node, last));
+        }
+
+        Node* grown = new_node(num_items);
+        grown->is_two = 0;
+        grown->fixed = node->fixed;
+        grown->model = node->model;
+
+        const int bitmap_size = BITMAP_SIZE(num_items);
+        memset(grown->none_bitmap, 0xff, sizeof(bitmap_t) * bitmap_size);
+        memset(grown->child_bitmap, 0, sizeof(bitmap_t) * bitmap_size);
+        // size is recounted from the slots, writers below the root bump the
+        // old root's counter after their write and may not have done so yet
+        int size = keys.size();
+        for (int i = 0; i < last; i ++) {
+            if (BITMAP_GET(node->none_bitmap, i) == 1) continue;
+            BITMAP_CLEAR(grown->none_bitmap, i);
+            if (BITMAP_GET(node->child_bitmap, i) == 1) {
+                BITMAP_SET(grown->child_bitmap, i);
+                size += node_size(node->items[i].comp.child);
+            } else {
+                size ++;
+            }
+            grown->items[i] = node->items[i];
+            if (BITMAP_GET(node->child_bitmap, i) == 0) slot_value(grown, i) = slot_value(node, i);
+        }
+        init_counters(grown, node->build_size, size);
+        grown->counters.num_inserts.store(node_num_inserts(node), std::memory_order_relaxed);
+        grown->counters.num_insert_to_data.store(node_num_insert_to_data(node), std::memory_order_relaxed);
+
+        merge_into_slots(grown, keys.data(), values.data(), keys.size(), nodes);
+        return grown;
+    }
+
+    /// grow the root to num_items slots, see grow_root_locked(). Does
+    /// nothing if the root changed since version.
+    void grow_root(Node* node, uint64_t version, int num_items)
+    {
+        bool needRestart = false;
+        node->upgradeToWriteLockOrRestart(version, needRestart);
+        if (needRestart) return;
+
+        std::vector<Node*> nodes;
+        Node* grown = grow_root_locked(node, num_items, nodes);
+        swap_root(node, grown);
+        retire_nodes(nodes);
+    }
+
+    /// the sorted keys [begin, end) and the sorted keys a slot held merged
+    /// into merged_keys, a key the slot held already takes the new value.
+    /// Returns how many keys did.
+    static int merge_slot_keys(const std::vector<T>& slot_keys, const std::vector<P>& slot_values,
+                               const T* keys, const P* values, int begin, int end,
+                               std::vector<T>& merged_keys, std::vector<P>& merged_values)
+    {
+        int replaced = 0;
+        merged_keys.clear();
+        merged_values.clear();
+        size_t j = 0;
+        for (int i = begin; i < end; i ++) {
+            while (j < slot_keys.size() && slot_keys[j] < keys[i]) {
+                merged_keys.push_back(slot_keys[j]);
+                merged_values.push_back(slot_values[j]);
+                j ++;
+            }
+            if (j < slot_keys.size() && slot_keys[j] == keys[i]) {
+                replaced ++;
+                j ++;
+            }
+            merged_keys.push_back(keys[i]);
+            merged_values.push_back(values[i]);
         }
-
-        return ret;
+        for (; j < slot_keys.size(); j ++) {
+            merged_keys.push_back(slot_keys[j]);
+            merged_values.push_back(slot_values[j]);
+        }
+        return replaced;
     }
-    /// bulk build, _keys must be sorted in asc order.
-    /// FMCD method.
-    Node* build_tree_bulk_fmcd(T* _keys, P* _values, int _size)
+
+    /// Merge num_keys sorted keys into the slots of node, which is write-locked
+    /// or not published yet. Keys sharing a slot are bulk built into one
+    /// child together with what the slot held before; a child subtree taken
+    /// over this way is locked, scanned and appended to nodes. A key
+    /// already held replaces the value it had. Counting the keys into
+    /// node's size is left to the caller, returns how many of them were
+    /// such replacements.
+    static constexpr int MERGE_PREFETCH_DISTANCE = 8; // keys
+    int merge_into_slots(Node* node, const T* keys, const P* values, int num_keys, std::vector<Node*>& nodes)
     {
-        RT_ASSERT(_size > 1);
+        int replaced = 0;
+        std::vector<T> slot_keys, merged_keys;
+        std::vector<P> slot_values, merged_values;
+        std::vector<int> positions(num_keys);
+        predict_positions(node, keys, num_keys, positions.data());
+        for (int begin = 0; begin < num_keys; ) {
+            // the slots of sparse runs are far apart, overlap their misses
+            if (begin + MERGE_PREFETCH_DISTANCE < num_keys) {
+                const int ahead = positions[begin + MERGE_PREFETCH_DISTANCE];
+                _mm_prefetch(reinterpret_cast<const char*>(&node->none_bitmap[ahead / BITMAP_WIDTH]), _MM_HINT_T0);
+                prefetch_slot(node, ahead);
+            }
+            // keys are sorted, those sharing a slot are adjacent
+            const int pos = positions[begin];
+            int end = begin + 1;
+            while (end < num_keys && positions[end] == pos) {
+                end ++;
+            }
 
-        typedef struct {
-            int begin;
-            int end;
-            int level; // top level = 1
-            Node* node;
-        } Segment;
-        std::stack<Segment> s;
+            if (BITMAP_GET(node->none_bitmap, pos) == 1 && end - begin == 1) {
+                BITMAP_CLEAR(node->none_bitmap, pos);
+                node->items[pos].comp.data.key = keys[begin];
+                slot_value(node, pos) = values[begin];
+                begin = end;
+                continue;
+            }
 
-        Node* ret = new_nodes(1);
-        s.push((Segment){0, _size, 1, ret});
+            slot_keys.clear();
+            slot_values.clear();
+            if (BITMAP_GET(node->child_bitmap, pos) == 1) {
+                Node* child = node->items[pos].comp.child;
+                write_lock_child(child);
+                scan_and_destory_tree(child, slot_keys, slot_values, nodes);
+            } else if (BITMAP_GET(node->none_bitmap, pos) == 0) {
+                slot_keys.push_back(node->items[pos].comp.data.key);
+                slot_values.push_back(slot_value(node, pos));
+            }
 
-        while (!s.empty()) {
-            const int begin = s.top().begin;
-            const int end = s.top().end;
-            const int level = s.top().level;
-            Node* node = s.top().node;
-            s.pop();
+            replaced += merge_slot_keys(slot_keys, slot_values, keys, values, begin, end, merged_keys, merged_values);
 
-            RT_ASSERT(end - begin >= 2);
-            if (end - begin == 2) {
-                Node* _ = build_tree_two(_keys[begin], _values[begin], _keys[begin+1], _values[begin+1]);
-                memcpy(node, _, sizeof(Node));
-                delete_nodes(_, 1);
+            BITMAP_CLEAR(node->none_bitmap, pos);
+            if (merged_keys.size() == 1) {
+                // the slot's one key, replaced
+                BITMAP_CLEAR(node->child_bitmap, pos);
+                node->items[pos].comp.data.key = merged_keys[0];
+                slot_value(node, pos) = merged_values[0];
             } else {
-                T* keys = _keys + begin;
-                P* values = _values + begin;
-                const int size = end - begin;
-                const int BUILD_GAP_CNT = compute_gap_count(size);
-
-                node->is_two = 0;
-                node->build_size = size;
-                node->size = size;
-                node->fixed = 0;
-                node->num_inserts = node->num_insert_to_data = 0;
-
-                // FMCD method
-                // Here the implementation is a little different with Algorithm 1 in our paper.
-                // In Algorithm 1, U_T should be (keys[size-1-D] - keys[D]) / (L - 2).
-                // But according to the derivation described in our paper, M.A should be less than 1 / U_T.
-                // So we added a small number (1e-6) to U_T.
-                // In fact, it has only a negligible impact of the performance.
-                {
-                    const int L = size * static_cast<int>(BUILD_GAP_CNT + 1);
-                    int i = 0;
-                    int D = 1;
-                    RT_ASSERT(D <= size-1-D);
-                    double Ut = (static_cast<long double>(keys[size - 1 - D]) - static_cast<long double>(keys[D])) /
-                                (static_cast<double>(L - 2)) + 1e-6;
-                    while (i < size - 1 - D) {
-                        while (i + D < size && keys[i + D] - keys[i] >= Ut) {
-                            i ++;
-                        }
-                        if (i + D >= size) {
-                            break;
-                        }
-                        D = D + 1;
-                        if (D * 3 > size) break;
-                        RT_ASSERT(D <= size-1-D);
-                        Ut = (static_cast<long double>(keys[size - 1 - D]) - static_cast<long double>(keys[D])) /
-                             (static_cast<double>(L - 2)) + 1e-6;
-                    }
-                    if (D * 3 <= size) {
-                        stats.fmcd_success_times ++;
-
-                        node->model.a = 1.0 / Ut;
-                        node->model.b = (L - node->model.a * (static_cast<long double>(keys[size - 1 - D]) +
-                                                              static_cast<long double>(keys[D]))) / 2;
-                        RT_ASSERT(isfinite(node->model.a));
-                        RT_ASSERT(isfinite(node->model.b));
-                        node->num_items = L;
-                    } else {
-                        stats.fmcd_broken_times ++;
+                BITMAP_SET(node->child_bitmap, pos);
+                store_child(node->items[pos], build_tree_bulk(merged_keys.data(), merged_values.data(), merged_keys.size()));
+            }
+            begin = end;
+        }
+        return replaced;
+    }
+
+    /// insert a sorted run of keys under one root lock, growing the root
+    /// toward its last key first
+    void append_tree(const T* keys, const P* values, int num_keys)
+    {
+        int restartCount = 0;
+        restart:
+        if (restartCount++)
+            yield(restartCount);
+        bool needRestart = false;
 
-                        int mid1_pos = (size - 1) / 3;
-                        int mid2_pos = (size - 1) * 2 / 3;
+        Node* node = load_root();
+        uint64_t version = node->readLockOrRestart(needRestart);
+        if (needRestart) goto restart;
+        node->upgradeToWriteLockOrRestart(version, needRestart);
+        if (needRestart) goto restart;
+
+        std::vector<Node*> nodes;
+        Node* target = node;
+        // grown as far as an insert would grow it, see root_grow_items():
+        // for the last key less than a root width past the end. Keys further
+        // out clamp into the last slot and are bulk built into a subtree there.
+        int last = num_keys - 1;
+        while (last > 0 && node->model.predict_double(keys[last]) - node->num_items >= node->num_items) {
+            last --;
+        }
+        if (const int grow_items = root_grow_items(node, keys[last])) {
+            target = grow_root_locked(node, grow_items, nodes);
+        }
+        if (target == node) preserve_for_snapshots(node);
+        const int replaced = merge_into_slots(target, keys, values, num_keys, nodes);
+        target->counters.size.fetch_add(num_keys - replaced, std::memory_order_relaxed);
 
-                        RT_ASSERT(0 <= mid1_pos);
-                        RT_ASSERT(mid1_pos < mid2_pos);
-                        RT_ASSERT(mid2_pos < size - 1);
+        if (target != node) {
+            target = swap_root(node, target);
+        }
+        retire_nodes(nodes);
+        if (target == node) {
+            node->writeUnlock();
+        }
 
-                        const long double mid1_key = (static_cast<long double>(keys[mid1_pos]) +
-                                                      static_cast<long double>(keys[mid1_pos + 1])) / 2;
-                        const long double mid2_key = (static_cast<long double>(keys[mid2_pos]) +
-                                                      static_cast<long double>(keys[mid2_pos + 1])) / 2;
+        Node* path[1] = {target};
+        adjust(path, 1, keys[num_keys - 1]);
+    }
 
-                        node->num_items = size * static_cast<int>(BUILD_GAP_CNT + 1);
-                        const double mid1_target = mid1_pos * static_cast<int>(BUILD_GAP_CNT + 1) + static_cast<int>(BUILD_GAP_CNT + 1) / 2;
-                        const double mid2_target = mid2_pos * static_cast<int>(BUILD_GAP_CNT + 1) + static_cast<int>(BUILD_GAP_CNT + 1) / 2;
+    void adjust(Node** path, int path_size, const T& key){
+        int restartCount = 0;
+        int restartSite = ADJUST_NODE_LOCK;
+        restart:
+        if (restartCount++) {
+            bump(thread_metrics.local().adjust_restarts[restartSite]);
+            yield(restartCount);
+        }
+        bool needRestart = false;
 
-                        node->model.a = (mid2_target - mid1_target) / (mid2_key - mid1_key);
-                        node->model.b = mid1_target - node->model.a * mid1_key;
-                        RT_ASSERT(isfinite(node->model.a));
-                        RT_ASSERT(isfinite(node->model.b));
-                    }
-                }
-                RT_ASSERT(node->model.a >= 0);
-                const int lr_remains = static_cast<int>(size * BUILD_LR_REMAIN);
-                node->model.b += lr_remains;
-                node->num_items += lr_remains * 2;
+        for (int i = 0; i < path_size; i ++) {
+            Node* node = path[i];
+            if (!counters_due(node)) continue;
 
-                if (size > 1e6) {
-                    node->fixed = 1;
-                }
+            uint64_t version = node->readLockOrRestart(needRestart) ;
+            if(needRestart) {
+                // rebuilt by another thread meanwhile, the path is stale
+                if (node->isObsolete()) return;
+                restartSite = ADJUST_NODE_LOCK;
+                goto restart ;
+            }
 
-                node->items = new_items(node->num_items);
-                const int bitmap_size = BITMAP_SIZE(node->num_items);
-                node->none_bitmap = new_bitmap(bitmap_size);
-                node->child_bitmap = new_bitmap(bitmap_size);
-                memset(node->none_bitmap, 0xff, sizeof(bitmap_t) * bitmap_size);
-                memset(node->child_bitmap, 0, sizeof(bitmap_t) * bitmap_size);
-
-                for (int item_i = PREDICT_POS(node, keys[0]), offset = 0; offset < size; ) {
-                    int next = offset + 1, next_i = -1;
-                    while (next < size) {
-                        next_i = PREDICT_POS(node, keys[next]);
-                        if (next_i == item_i) {
-                            next ++;
-                        } else {
-                            break;
-                        }
-                    }
-                    if (next == offset + 1) {
-                        BITMAP_CLEAR(node->none_bitmap, item_i);
-                        node->items[item_i].comp.data.key = keys[offset];
-                        node->items[item_i].comp.data.value = values[offset];
-                    } else {
-                        // ASSERT(next - offset <= (size+2) / 3);
-                        BITMAP_CLEAR(node->none_bitmap, item_i);
-                        BITMAP_SET(node->child_bitmap, item_i);
-                        node->items[item_i].comp.child = new_nodes(1);
-                        s.push((Segment){begin + offset, begin + next, level + 1, node->items[item_i].comp.child});
-                    }
-                    if (next >= size) {
-                        break;
-                    } else {
-                        item_i = next_i;
-                        offset = next;
+            const int size = node_size(node);
+            const int build_size = node->build_size.load(std::memory_order_relaxed);
+            const int num_inserts = node_num_inserts(node);
+            const int num_insert_to_data = node_num_insert_to_data(node);
+            const bool need_rebuild = node->fixed == 0 && size >= build_size * 4 && size >= 64 && num_insert_to_data * 10 >= num_inserts;
+            // erased down to a quarter, rebuild into a smaller node
+            const bool need_shrink = node->fixed == 0 && build_size >= 64 && size * 4 <= build_size;
+            // at most one key left below a child slot, fold it into the parent
+            const bool need_collapse = i > 0 && size <= 1;
+
+            if (!need_rebuild && !need_shrink && !need_collapse){
+                node->readUnlockOrRestart(version, needRestart) ;
+                if(needRestart) {
+                    restartSite = ADJUST_NODE_UNLOCK;
+                    goto restart ;
+                }
+            }
+            else if (async_rebuild && !need_collapse) {
+                // background mode, leave the subtree to a rebuild worker
+                const int depth = need_rebuild ? local_rebuild_depth(path, path_size, i) : i;
+                if (!path[depth]->rebuild_queued.exchange(true)) {
+                    if (need_rebuild) count_rebuild(path, i, depth);
+                    enqueue_rebuild(key, depth);
+                }
+                break;
+            }
+            else {
+                const int depth = need_rebuild ? local_rebuild_depth(path, path_size, i) : i;
+                if (depth != i) {
+                    restartSite = ADJUST_LOCAL_SWITCH;
+                    node->readUnlockOrRestart(version, needRestart);
+                    if (needRestart) goto restart;
+                    version = path[depth]->readLockOrRestart(needRestart);
+                    if (needRestart) {
+                        if (path[depth]->isObsolete()) return;
+                        goto restart;
                     }
                 }
+                RebuildResult result = rebuild_locked(depth > 0 ? path[depth-1] : nullptr, path[depth], version, key);
+                if (result == REBUILD_RESTART) {
+                    restartSite = ADJUST_REBUILD;
+                    goto restart ;
+                }
+                if (result == REBUILD_DONE && need_rebuild) count_rebuild(path, i, depth);
+                break;
             }
         }
 
-        return ret;
     }
 
-    void destory_pending()
+    /// Cost model of a growth rebuild of path[i]: when the child on the path
+    /// (a hot slot's child chain) holds at least as many keys as half of
+    /// what path[i] grew by since its build, the growth went there, and
+    /// rebuilding only that child's subtree flattens the chain for a
+    /// fraction of the keys. Returns the depth to rebuild, i + 1 for the
+    /// child or i for the whole subtree. A node further down is never
+    /// picked alone, the chain above it would stay.
+    int local_rebuild_depth(Node** path, int path_size, int i) const
     {
-        while (!pending_two.empty()) {
-            Node* node = pending_two.top(); pending_two.pop();
-
-            delete_items(node->items, node->num_items);
-            const int bitmap_size = BITMAP_SIZE(node->num_items);
-            delete_bitmap(node->none_bitmap, bitmap_size);
-            delete_bitmap(node->child_bitmap, bitmap_size);
-            delete_nodes(node, 1);
-        }
+        if (i + 1 >= path_size) return i;
+        const Node* child = path[i + 1];
+        const int growth = node_size(path[i]) - path[i]->build_size.load(std::memory_order_relaxed);
+        return child->fixed == 0 && node_size(child) * 2 >= growth ? i + 1 : i;
     }
 
-    void destroy_tree(Node* root)
+    /// account the rebuild of path[depth] for the growth of path[i]; a
+    /// local rebuild leaves path[i]'s slots as they are, it is rebased to its
+    /// current size so it doesn't ask again until it grows by 4x from here
+    void count_rebuild(Node** path, int i, int depth)
     {
-        std::stack<Node*> s;
-        s.push(root);
-        while (!s.empty()) {
-            Node* node = s.top(); s.pop();
+        stats.rebuilds ++;
+        stats.rebuild_keys += node_size(path[depth]);
+        stats.full_rebuild_keys += node_size(path[i]);
+        if (depth == i) return;
+        stats.local_rebuilds ++;
+        path[i]->build_size.store(node_size(path[i]), std::memory_order_relaxed);
+    }
 
-            for (int i = 0; i < node->num_items; i ++) {
-                if (BITMAP_GET(node->child_bitmap, i) == 1) {
-                    s.push(node->items[i].comp.child);
-                }
-            }
+    // background rebuild, see start_rebuild_workers()
+    std::atomic<bool> async_rebuild{false};
+    std::vector<std::thread> rebuild_workers;
+    std::mutex rebuild_mutex;
+    std::condition_variable rebuild_cv;
+    std::deque<std::pair<T, int>> rebuild_queue; // <key on path, depth>
+    bool rebuild_stop = false;
 
-            if (node->is_two) {
-                RT_ASSERT(node->build_size == 2);
-                RT_ASSERT(node->num_items == 8);
-                node->size = 2;
-                node->num_inserts = node->num_insert_to_data = 0;
-                node->none_bitmap[0] = 0xff;
-                node->child_bitmap[0] = 0;
-                pending_two.push(node);
-            } else {
-                delete_items(node->items, node->num_items);
-                const int bitmap_size = BITMAP_SIZE(node->num_items);
-                delete_bitmap(node->none_bitmap, bitmap_size);
-                delete_bitmap(node->child_bitmap, bitmap_size);
-                delete_nodes(node, 1);
-            }
+    void enqueue_rebuild(const T& key, int depth)
+    {
+        {
+            std::lock_guard<std::mutex> lock(rebuild_mutex);
+            rebuild_queue.emplace_back(key, depth);
         }
+        rebuild_cv.notify_one();
     }
 
-    static void delete_all(void *vnode){
-        Node *node = (Node *) vnode ;
+    /// clear the queued mark of the node at depth on key's path. A subtree
+    /// that isn't there any more was replaced, and the new nodes start
+    /// unmarked.
+    void unqueue_rebuild(const T& key, int depth)
+    {
+        Node* parent;
+        Node* node;
+        uint64_t version;
+        if (locate(key, depth, parent, node, version)) node->rebuild_queued = false;
+    }
 
-        delete_items(node->items, node->num_items);
-        const int bitmap_size = BITMAP_SIZE(node->num_items);
-        delete_bitmap(node->none_bitmap, bitmap_size);
-        delete_bitmap(node->child_bitmap, bitmap_size);
-        delete_nodes(node, 1);
+    void rebuild_worker()
+    {
+        while (true) {
+            std::pair<T, int> task;
+            {
+                std::unique_lock<std::mutex> lock(rebuild_mutex);
+                rebuild_cv.wait(lock, [this] { return rebuild_stop || !rebuild_queue.empty(); });
+                if (rebuild_stop) return;
+                task = rebuild_queue.front();
+                rebuild_queue.pop_front();
+            }
+            EpochGuard guard;
+            rebuild_background(task.first, task.second);
+        }
     }
 
-    void scan_and_destory_tree(Node* _root, T* keys, P* values, bool destory = true)
+    /// find the node at depth on key's path and its parent
+    bool locate(const T& key, int depth, Node*& parent, Node*& node, uint64_t& version)
     {
         int restartCount = 0;
         restart:
@@ -994,127 +3761,288 @@ private:
             yield(restartCount);
         bool needRestart = false;
 
-        typedef std::pair<int, Node*> Segment; // <begin, Node*>
+        parent = nullptr;
+        node = load_root();
+        version = node->readLockOrRestart(needRestart);
+        if (needRestart || node != load_root()) goto restart;
+        for (int d = 0; d < depth; d ++) {
+            int pos = PREDICT_POS(node, key);
+            if (BITMAP_GET(node->child_bitmap, pos) == 0) {
+                node->readUnlockOrRestart(version, needRestart);
+                if (needRestart) goto restart;
+                return false;
+            }
+            Node* child = node->items[pos].comp.child;
+            node->checkOrRestart(version, needRestart);
+            if (needRestart) goto restart;
+            uint64_t versionChild = child->readLockOrRestart(needRestart);
+            if (needRestart) goto restart;
+            parent = node;
+            node = child;
+            version = versionChild;
+        }
+        return true;
+    }
+
+    /// read the subtree under _root without locking, recording the version
+    /// every node had when it was read. Fails if any node was being written.
+    bool scan_optimistic(Node* _root, std::vector<T>& keys, std::vector<P>& values,
+                         std::vector<std::pair<Node*, uint64_t>>& snapshot, InsertHeat* heat = nullptr)
+    {
+        struct Segment {
+            Node* node;
+            uint64_t version;
+            int pos; // next pos
+            int span; // in heat
+        };
         std::stack<Segment> s;
+        bool needRestart = false;
 
-        s.push(Segment(0, _root));
+        uint64_t version = _root->readLockOrRestart(needRestart);
+        if (needRestart) return false;
+        snapshot.emplace_back(_root, version);
+        s.push((Segment){_root, version, 0, heat ? heat->enter(_root, keys.size(), -1) : -1});
         while (!s.empty()) {
-            int begin = s.top().first;
-            Node* node = s.top().second;
-            const int SHOULD_END_POS = begin + node->size;
-            s.pop();
-            uint64_t version;
-            if(node != _root){
-                version = node->readLockOrRestart(needRestart) ;
-                if(needRestart) goto restart ;
+            Node* node = s.top().node;
+            int i = s.top().pos;
+            while (i < node->num_items && BITMAP_GET(node->none_bitmap, i) == 1) {
+                i ++;
             }
+            if (i >= node->num_items) {
+                if (heat) heat->leave(s.top().span, keys.size());
+                s.pop();
+                continue;
+            }
+            s.top().pos = i + 1;
 
-            for (int i = 0; i < node->num_items; i ++) {
-                if (BITMAP_GET(node->none_bitmap, i) == 0) {
-                    if (BITMAP_GET(node->child_bitmap, i) == 0) {
-                        keys[begin] = node->items[i].comp.data.key;
-                        values[begin] = node->items[i].comp.data.value;
-                        begin ++;
-                    } else {
-                        s.push(Segment(begin, node->items[i].comp.child));
-                        begin += node->items[i].comp.child->size;
-                    }
-                }
+            if (BITMAP_GET(node->child_bitmap, i) == 0) {
+                keys.push_back(node->items[i].comp.data.key);
+                values.push_back(slot_value(node, i));
+            } else {
+                Node* child = node->items[i].comp.child;
+                node->readUnlockOrRestart(s.top().version, needRestart);
+                if (needRestart) return false;
+                version = child->readLockOrRestart(needRestart);
+                if (needRestart) return false;
+                snapshot.emplace_back(child, version);
+                s.push((Segment){child, version, 0, heat ? heat->enter(child, keys.size(), s.top().span) : -1});
             }
-            RT_ASSERT(SHOULD_END_POS == begin);
+        }
+        // the last reads of every node still have to be valid
+        for (auto& e : snapshot) {
+            e.first->readUnlockOrRestart(e.second, needRestart);
+            if (needRestart) return false;
+        }
+        return true;
+    }
 
-            if (destory) {
-                ebr->scheduleForDeletion(std::make_pair((void *)node, delete_all)) ;
+    /// Rebuild the subtree at depth on key's path. The replacement is built
+    /// from an unlocked snapshot while writers keep going; it is installed
+    /// only if write-locking every snapshot node at its recorded version
+    /// succeeds, i.e. nothing changed meanwhile. Otherwise the snapshot is
+    /// retaken, and after a few attempts the subtree is rebuilt under locks
+    /// on this (background) thread.
+    void rebuild_background(const T& key, int depth)
+    {
+        constexpr int MAX_ATTEMPTS = 4;
+        Node* parent;
+        Node* node;
+        uint64_t version;
+
+        for (int attempt = 1; ; attempt ++) {
+            // a node at depth that isn't marked, or none, means the queued
+            // one was replaced meanwhile, see unqueue_rebuild()
+            if (!locate(key, depth, parent, node, version) || !node->rebuild_queued) return;
+
+            if (attempt > MAX_ATTEMPTS) {
+                RebuildResult result = rebuild_locked(parent, node, version, key);
+                if (result == REBUILD_RESTART) {
+                    yield(attempt);
+                    continue;
+                }
+                if (result == REBUILD_STALE) node->rebuild_queued = false;
+                return;
             }
 
-            if(node != _root){
-                node->readUnlockOrRestart(version, needRestart) ;
-                if(needRestart) goto restart ;
+            std::vector<T> keys;
+            std::vector<P> values;
+            std::vector<std::pair<Node*, uint64_t>> snapshot;
+            InsertHeat heat;
+            if (!scan_optimistic(node, keys, values, snapshot, &heat)) {
+                yield(attempt);
+                continue;
             }
+            const int ESIZE = keys.size();
+            const std::vector<double> heat_prefix = heat.prefix(ESIZE);
+            Node* new_node = ESIZE <= 1 && parent ? nullptr : build_tree_any(keys.data(), values.data(), ESIZE,
+                                                                             heat_prefix.empty() ? nullptr : heat_prefix.data());
+
+            if (install_rebuilt(parent, node, key, new_node, keys, values, snapshot)) return;
+            if (new_node) destroy_tree(new_node);
+            yield(attempt);
         }
     }
 
-    void adjust(Node** path, int path_size, const T& key){
-        int restartCount = 0;
-        restart:
-        if (restartCount++)
-            yield(restartCount);
+    /// publish new_node in place of node if no snapshot node changed, a null
+    /// new_node folds the (at most one) key into parent
+    bool install_rebuilt(Node* parent, Node* node, const T& key, Node* new_node,
+                         const std::vector<T>& keys, const std::vector<P>& values,
+                         std::vector<std::pair<Node*, uint64_t>>& snapshot)
+    {
         bool needRestart = false;
-
-        for (int i = 0; i < path_size; i ++) {
-            Node* node = path[i];
-
-            uint64_t version = node->readLockOrRestart(needRestart) ;
-            if(needRestart) goto restart ;
-
-            const int num_inserts = node->num_inserts ;
-            const int num_insert_to_data = node->num_insert_to_data ;
-            const bool need_rebuild = node->fixed == 0 && node->size >= node->build_size * 4 && node->size >= 64 && num_insert_to_data * 10 >= num_inserts;
-
-            if (!need_rebuild){
-                node->readUnlockOrRestart(version, needRestart) ;
-                if(needRestart) goto restart ;
+        int pos = 0;
+        if (parent) {
+            uint64_t versionParent = parent->readLockOrRestart(needRestart);
+            if (needRestart) return false;
+            parent->upgradeToWriteLockOrRestart(versionParent, needRestart);
+            if (needRestart) return false;
+            pos = PREDICT_POS(parent, key);
+            if (BITMAP_GET(parent->child_bitmap, pos) == 0 || parent->items[pos].comp.child != node) {
+                parent->writeUnlock();
+                return false;
             }
-            else {
-                node->upgradeToWriteLockOrRestart(version, needRestart) ;
-                if(needRestart) goto restart ;
-
-                const int ESIZE = node->size;
-                T* keys = new T[ESIZE] ;
-                P* values = new P[ESIZE] ;
+        }
+        std::vector<Node*> nodes;
+        for (auto& e : snapshot) {
+            e.first->upgradeToWriteLockOrRestart(e.second, needRestart);
+            if (needRestart) break;
+            nodes.push_back(e.first);
+        }
+        if (needRestart || (!parent && load_root() != node)) {
+            for (Node* n : nodes) n->writeUnlock();
+            if (parent) parent->writeUnlock();
+            return false;
+        }
+        if (parent) preserve_for_snapshots(parent);
 
-                #if COLLECT_TIME
-                auto start_time_scan = std::chrono::high_resolution_clock::now();
-                #endif
-                scan_and_destory_tree(node, keys, values);
-                #if COLLECT_TIME
-                auto end_time_scan = std::chrono::high_resolution_clock::now();
-                auto duration_scan = end_time_scan - start_time_scan;
-                stats.time_scan_and_destory_tree += std::chrono::duration_cast<std::chrono::nanoseconds>(duration_scan).count() * 1e-9;
-                #endif
+        if (new_node == nullptr) {
+            BITMAP_CLEAR(parent->child_bitmap, pos);
+            if (keys.empty()) {
+                BITMAP_SET(parent->none_bitmap, pos);
+            } else {
+                parent->items[pos].comp.data.key = keys[0];
+                slot_value(parent, pos) = values[0];
+            }
+        } else if (parent) {
+            store_child(parent->items[pos], new_node);
+        } else {
+            swap_root(node, new_node);
+        }
 
-                #if COLLECT_TIME
-                auto start_time_build = std::chrono::high_resolution_clock::now();
-                #endif
-                Node* new_node = build_tree_bulk(keys, values, ESIZE);
-                #if COLLECT_TIME
-                auto end_time_build = std::chrono::high_resolution_clock::now();
-                auto duration_build = end_time_build - start_time_build;
-                stats.time_build_tree_bulk += std::chrono::duration_cast<std::chrono::nanoseconds>(duration_build).count() * 1e-9;
-                #endif
+        retire_nodes(nodes);
+        if (parent) parent->writeUnlock();
+        return true;
+    }
 
-                delete[] keys;
-                delete[] values;
+    static bool htm_supported() {
+        #if defined(__RTM__)
+        unsigned int eax, ebx, ecx, edx;
+        return __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & bit_RTM);
+        #else
+        return false;
+        #endif
+    }
 
-                path[i] = new_node;
-                if (i > 0) {
-                    int pos = PREDICT_POS(path[i-1], key);
-                    path[i-1]->items[pos].comp.child = new_node;
+    static constexpr int HTM_RETRIES = 3;
+    /// insert_tree()'s write of key into slot pos of node, a data or empty
+    /// slot as of version, and its counts on the path, as one transaction.
+    /// The version check makes the transaction abort on a locked or changed
+    /// node, and a lock taken meanwhile aborts it; the version is bumped as
+    /// a lock and unlock would, so optimistic readers still notice. A two
+    /// key child for a data slot is built beforehand, the pool can't run
+    /// in a transaction. Returns false when the caller should lock.
+    bool htm_insert_leaf(Node* node, uint64_t version, int pos, const T& key, const P& value,
+                         Node** path, int path_size, int& insert_to_data)
+    {
+        #if defined(__RTM__)
+        // NoLock has no lock to elide, and its version word is a plain integer
+        if constexpr (lock_t::concurrent) {
+            if (num_snapshots.load(std::memory_order_relaxed) > 0) return false; // writes copy nodes aside
+            ThreadMetrics& local = thread_metrics.local();
+            Node* two = nullptr;
+            if (BITMAP_GET(node->none_bitmap, pos) == 0) {
+                const T slot_key = node->items[pos].comp.data.key;
+                const P slot_val = slot_value(node, pos);
+                bool needRestart = false;
+                node->checkOrRestart(version, needRestart);
+                if (needRestart || slot_key == key) return false; // a replace isn't counted, leave it to the lock path
+                two = build_tree_two(key, value, slot_key, slot_val);
+            }
+            for (int attempt = 0; attempt < HTM_RETRIES; attempt ++) {
+                const unsigned status = _xbegin();
+                if (status == _XBEGIN_STARTED) {
+                    if (node->typeVersionLockObsolete.load(std::memory_order_relaxed) != version) _xabort(1);
+                    if (num_snapshots.load(std::memory_order_relaxed) > 0) _xabort(1);
+                    if (two) {
+                        store_child(node->items[pos], two);
+                        BITMAP_SET(node->child_bitmap, pos);
+                    } else {
+                        BITMAP_CLEAR(node->none_bitmap, pos);
+                        node->items[pos].comp.data.key = key;
+                        slot_value(node, pos) = value;
+                    }
+                    node->typeVersionLockObsolete.store(version + 0b100, std::memory_order_relaxed);
+                    for (int i = 0; i < path_size; i ++) {
+                        count_op(path[i], 1, 1, two ? 1 : 0);
+                    }
+                    _xend();
+                    bump(local.htm_commits);
+                    insert_to_data = two ? 1 : 0;
+                    return true;
                 }
-
-                //no need for unlock bc it was delete. the new node isnt locked.
-
-                break;
+                if (status & _XABORT_EXPLICIT) {
+                    bump(local.htm_aborts[HTM_ABORT_LOCKED]);
+                    break; // the node moved on, the caller restarts
+                } else if (status & _XABORT_CONFLICT) {
+                    bump(local.htm_aborts[HTM_ABORT_CONFLICT]);
+                } else if (status & _XABORT_CAPACITY) {
+                    bump(local.htm_aborts[HTM_ABORT_CAPACITY]);
+                    break;
+                } else {
+                    bump(local.htm_aborts[HTM_ABORT_OTHER]);
+                }
+                if (!(status & _XABORT_RETRY)) break;
             }
+            bump(local.htm_fallbacks);
+            if (two) delete_all(two); // never published
         }
-
+        #endif
+        (void) node; (void) version; (void) pos; (void) key; (void) value;
+        (void) path; (void) path_size; (void) insert_to_data;
+        return false;
     }
 
-    Node* insert_tree(Node* _node, const T& key, const P& value)
+    void insert_tree(const T& key, const P& value)
     {
         //printf("Insert key - %d, value - %d \n", key, value);
         int restartCount = 0;
+        int restartSite = INSERT_ROOT_LOCK;
         restart:
-        if (restartCount++)
+        if (restartCount++) {
+            bump(thread_metrics.local().insert_restarts[restartSite]);
             yield(restartCount);
+        }
         bool needRestart = false;
 
-        //lock
-        uint64_t version = _node->readLockOrRestart(needRestart) ;
-        if(needRestart) {  
-                    //printf("1At key - %d, %d\n", key, value);
-                    goto restart;
-                }
+        Node* _node = nullptr;
+        uint64_t version = 0;
+        Node* start = cached_child(key, _node, version);
+        if (!start) {
+            _node = load_root();
+            //lock
+            version = _node->readLockOrRestart(needRestart) ;
+            if(needRestart) {
+                        //printf("1At key - %d, %d\n", key, value);
+                        restartSite = INSERT_ROOT_LOCK;
+                        goto restart;
+                    }
+            if (const int grow_items = root_grow_items(_node, key)) {
+                grow_root(_node, version, grow_items);
+                restartSite = INSERT_ROOT_GROW;
+                goto restart;
+            }
+            start = _node;
+        }
 
         Node* parent = nullptr ;
         uint64_t versionParent ;
@@ -1123,8 +4051,12 @@ private:
         Node* path[MAX_DEPTH];
         int path_size = 0;
         int insert_to_data = 0;
+        bool counted = false; // by htm_insert_leaf()
+        // the root stays on the path for count_op() and adjust() when the
+        // root cache led past it
+        if (start != _node) path[path_size ++] = _node;
 
-        for (Node* node = _node; ; ) {
+        for (Node* node = start; ; ) {
             RT_ASSERT(path_size < MAX_DEPTH);
             path[path_size ++] = node;
 
@@ -1132,27 +4064,32 @@ private:
                 parent->readUnlockOrRestart(versionParent, needRestart);
                 if (needRestart) {
                     //printf("2At key - %d, %d\n", key, &node);
+                    restartSite = INSERT_PARENT_UNLOCK;
                     goto restart;
                 }
             }
 
-            node->size ++;
-            node->num_inserts ++;
             int pos = PREDICT_POS(node, key);
 
             Node* inner = node ;
 
-
+            if (htm_on.load(std::memory_order_relaxed) && BITMAP_GET(node->child_bitmap, pos) == 0 &&
+                htm_insert_leaf(node, version, pos, key, value, path, path_size, insert_to_data)) {
+                counted = true;
+                break;
+            }
             if (BITMAP_GET(node->none_bitmap, pos) == 1) {
                 node->upgradeToWriteLockOrRestart(version, needRestart);
                 if(needRestart) {
                     //printf("3At key - %d, %d\n", key, &node);
+                    restartSite = INSERT_SLOT_LOCK;
                     goto restart;
                 }
+                preserve_for_snapshots(node);
 
                 BITMAP_CLEAR(node->none_bitmap, pos);
                 node->items[pos].comp.data.key = key;
-                node->items[pos].comp.data.value = value;
+                slot_value(node, pos) = value;
                 
                 node->writeUnlock() ;
 
@@ -1161,11 +4098,19 @@ private:
                 node->upgradeToWriteLockOrRestart(version, needRestart);
                 if(needRestart){
                     //printf("4At key - %d, %d\n", key, &node);
+                    restartSite = INSERT_SLOT_LOCK;
                     goto restart;
                 }
+                preserve_for_snapshots(node);
 
+                if (node->items[pos].comp.data.key == key) {
+                    // already present, replace the value and count nothing
+                    slot_value(node, pos) = value;
+                    node->writeUnlock();
+                    return;
+                }
+                store_child(node->items[pos], build_tree_two(key, value, node->items[pos].comp.data.key, slot_value(node, pos)));
                 BITMAP_SET(node->child_bitmap, pos);
-                node->items[pos].comp.child = build_tree_two(key, value, node->items[pos].comp.data.key, node->items[pos].comp.data.value);
                 insert_to_data = 1;
 
                 node->writeUnlock() ;
@@ -1180,23 +4125,151 @@ private:
                 inner->checkOrRestart(version, needRestart);
                 if (needRestart) {
                     //printf("5At key - %d, %d\n", key, &node);
+                    restartSite = INSERT_CHILD_CHECK;
                     goto restart;
                 }
                 version = node->readLockOrRestart(needRestart);
                 if (needRestart) {
                     //printf("6At key - %d, %d\n", key, &node);
+                    restartSite = INSERT_CHILD_LOCK;
                     goto restart;
                 }
             }
         }
 
+        // counted once the insert took effect, so restarts don't inflate them
+        for (int i = 0; !counted && i < path_size; i ++) {
+            count_op(path[i], 1, 1, insert_to_data);
+        }
+        sample_depth(path_size);
+
+        adjust(path, path_size, key) ;
+    }
+
+    bool erase_tree(const T& key)
+    {
+        int restartCount = 0;
+        restart:
+        if (restartCount++)
+            yield(restartCount);
+        bool needRestart = false;
+
+        Node* _node = nullptr;
+        uint64_t version = 0;
+        Node* start = cached_child(key, _node, version);
+        if (!start) {
+            _node = load_root();
+            version = _node->readLockOrRestart(needRestart) ;
+            if(needRestart) goto restart;
+            start = _node;
+        }
+
+        Node* parent = nullptr ;
+        uint64_t versionParent ;
+
+        constexpr int MAX_DEPTH = 128;
+        Node* path[MAX_DEPTH];
+        int path_size = 0;
+        if (start != _node) path[path_size ++] = _node;
+
+        for (Node* node = start; ; ) {
+            RT_ASSERT(path_size < MAX_DEPTH);
+            path[path_size ++] = node;
+
+            if (parent){
+                parent->readUnlockOrRestart(versionParent, needRestart);
+                if (needRestart) goto restart;
+            }
+
+            int pos = PREDICT_POS(node, key);
+            Node* inner = node ;
+
+            if (BITMAP_GET(node->none_bitmap, pos) == 1 ||
+                (BITMAP_GET(node->child_bitmap, pos) == 0 && node->items[pos].comp.data.key != key)) {
+                node->readUnlockOrRestart(version, needRestart);
+                if (needRestart) goto restart;
+
+                return false;
+            } else if (BITMAP_GET(node->child_bitmap, pos) == 0) {
+                node->upgradeToWriteLockOrRestart(version, needRestart);
+                if (needRestart) goto restart;
+                preserve_for_snapshots(node);
+
+                BITMAP_SET(node->none_bitmap, pos);
+
+                node->writeUnlock() ;
+
+                break;
+            } else {
+                parent = inner;
+                versionParent = version;
+
+                node = node->items[pos].comp.child;
+
+                inner->checkOrRestart(version, needRestart);
+                if (needRestart) goto restart;
+                version = node->readLockOrRestart(needRestart);
+                if (needRestart) goto restart;
+            }
+        }
+
         for (int i = 0; i < path_size; i ++) {
-            atomic_add(path[i]->num_insert_to_data, insert_to_data) ;
+            count_op(path[i], -1, 0, 0);
         }
 
         adjust(path, path_size, key) ;
 
-        return path[0];
+        return true;
+    }
+
+    bool update_tree(const T& key, const P& value)
+    {
+        int restartCount = 0;
+        restart:
+        if (restartCount++)
+            yield(restartCount);
+        bool needRestart = false;
+
+        Node* _node = nullptr;
+        uint64_t version = 0;
+        Node* start = cached_child(key, _node, version);
+        if (!start) {
+            _node = load_root();
+            version = _node->readLockOrRestart(needRestart) ;
+            if(needRestart) goto restart;
+            start = _node;
+        }
+
+        for (Node* node = start; ; ) {
+            int pos = PREDICT_POS(node, key);
+
+            if (BITMAP_GET(node->none_bitmap, pos) == 1 ||
+                (BITMAP_GET(node->child_bitmap, pos) == 0 && node->items[pos].comp.data.key != key)) {
+                node->readUnlockOrRestart(version, needRestart);
+                if (needRestart) goto restart;
+                return false;
+            } else if (BITMAP_GET(node->child_bitmap, pos) == 0) {
+                node->upgradeToWriteLockOrRestart(version, needRestart);
+                if (needRestart) goto restart;
+                preserve_for_snapshots(node);
+
+                slot_value(node, pos) = value;
+
+                node->writeUnlock() ;
+                return true;
+            } else {
+                Node* inner = node;
+                node = node->items[pos].comp.child;
+
+                inner->checkOrRestart(version, needRestart);
+                if (needRestart) goto restart;
+                uint64_t versionChild = node->readLockOrRestart(needRestart);
+                if (needRestart) goto restart;
+                inner->readUnlockOrRestart(version, needRestart);
+                if (needRestart) goto restart;
+                version = versionChild;
+            }
+        }
     }
 };
 
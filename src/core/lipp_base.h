@@ -3,29 +3,209 @@
 
 #include <limits>
 #include <cmath>
+#include <cstdint>
 #include <cstdlib>
+#include <cstring>
 #include <algorithm>
+#include <string>
+#include <type_traits>
+
+/// How a key type is mapped to model space, the extension point for keys
+/// that are not numbers. A node's model works on offsets of keys from a
+/// Base of its own, made from the first and last key it was built for, so
+/// offsets stay precise where a node's keys are close together:
+/// Base, what a node keeps to compute offsets (a key, for byte keys also
+/// the length of the prefix its keys share);
+/// make_base(first, last), the Base of a node for keys in [first, last];
+/// offset(key, base), non-decreasing in key over all keys and 0 at the
+/// base key, first and last must get distinct offsets;
+/// min() and max(), the smallest and largest key.
+/// Keys themselves need operator< and the other comparisons, and are
+/// compared whole at the leaves.
+template <class T, class Enable = void>
+struct KeyTraits
+{
+    static constexpr bool specialized = false;
+};
+
+template <class T>
+struct KeyTraits<T, typename std::enable_if<std::is_arithmetic<T>::value>::type>
+{
+    static constexpr bool specialized = true;
+    typedef T Base;
+
+    static Base make_base(const T &first, const T &) { return first; }
+    /// key - base, exact for integer keys up to 2^53 apart
+    static inline double offset(const T &key, const Base &base)
+    {
+        if constexpr (std::is_integral<T>::value) {
+            typedef typename std::make_unsigned<T>::type U;
+            return key >= base ? static_cast<double>(static_cast<U>(key) - static_cast<U>(base))
+                               : -static_cast<double>(static_cast<U>(base) - static_cast<U>(key));
+        } else {
+            return static_cast<double>(key) - static_cast<double>(base);
+        }
+    }
+    static T min() { return std::numeric_limits<T>::lowest(); }
+    static T max() { return std::numeric_limits<T>::max(); }
+};
+
+#ifdef __SIZEOF_INT128__
+/// 128-bit integers, e.g. composite (tenant, timestamp) keys packed with
+/// the tenant in the high half. Differences are taken in 128 bits, so the
+/// nodes deep in a run of keys with the same high half still see them
+/// 1 apart.
+template <class T>
+struct Int128KeyTraits
+{
+    static constexpr bool specialized = true;
+    typedef T Base;
+
+    static Base make_base(const T &first, const T &) { return first; }
+    static inline double offset(const T &key, const Base &base)
+    {
+        typedef unsigned __int128 U;
+        return key >= base ? static_cast<double>(static_cast<U>(key) - static_cast<U>(base))
+                           : -static_cast<double>(static_cast<U>(base) - static_cast<U>(key));
+    }
+    static T min() {
+        return std::is_same<T, __int128>::value ? static_cast<T>(static_cast<unsigned __int128>(1) << 127) : T(0);
+    }
+    static T max() {
+        return std::is_same<T, __int128>::value ? static_cast<T>(~(static_cast<unsigned __int128>(1) << 127)) : ~T(0);
+    }
+};
+template <>
+struct KeyTraits<unsigned __int128> : Int128KeyTraits<unsigned __int128> {};
+template <>
+struct KeyTraits<__int128> : Int128KeyTraits<__int128> {};
+#endif
+
+/// Fixed-width byte string key, ordered like memcmp. Shorter strings are
+/// padded with zero bytes, so strings that differ only in trailing zeros
+/// are the same key.
+template <size_t N>
+struct ByteKey
+{
+    static_assert(N > 0, "byte keys need at least one byte");
+    uint8_t bytes[N];
+
+    static ByteKey from_string(const std::string &s)
+    {
+        ByteKey key;
+        memset(key.bytes, 0, N);
+        memcpy(key.bytes, s.data(), std::min(N, s.size()));
+        return key;
+    }
+    /// big-endian, so integer order is key order
+    static ByteKey from_uint(uint64_t hi, uint64_t lo = 0)
+    {
+        ByteKey key;
+        memset(key.bytes, 0, N);
+        for (size_t i = 0; i < 16 && i < N; i ++) {
+            key.bytes[i] = static_cast<uint8_t>((i < 8 ? hi >> (56 - 8 * i) : lo >> (120 - 8 * i)) & 0xff);
+        }
+        return key;
+    }
+
+    friend bool operator<(const ByteKey &x, const ByteKey &y) { return memcmp(x.bytes, y.bytes, N) < 0; }
+    friend bool operator>(const ByteKey &x, const ByteKey &y) { return y < x; }
+    friend bool operator<=(const ByteKey &x, const ByteKey &y) { return !(y < x); }
+    friend bool operator>=(const ByteKey &x, const ByteKey &y) { return !(x < y); }
+    friend bool operator==(const ByteKey &x, const ByteKey &y) { return memcmp(x.bytes, y.bytes, N) == 0; }
+    friend bool operator!=(const ByteKey &x, const ByteKey &y) { return !(x == y); }
+};
+
+/// A node keeps the prefix its first and last key share, the offset of a
+/// key is taken from the 8 bytes after it. Keys outside the prefix get an
+/// offset past every in-prefix one. Keys alike in those 8 bytes collide
+/// and go into a child, whose longer prefix tells them apart.
+template <size_t N>
+struct KeyTraits<ByteKey<N>>
+{
+    static constexpr bool specialized = true;
+    struct Base {
+        ByteKey<N> key;
+        uint32_t prefix; // bytes all keys of the node start with
+    };
+    // beyond any difference of two 8-byte windows
+    static constexpr double OUTSIDE = 0x1p68;
+
+    static Base make_base(const ByteKey<N> &first, const ByteKey<N> &last)
+    {
+        Base base;
+        base.key = first;
+        base.prefix = 0;
+        while (base.prefix < N && first.bytes[base.prefix] == last.bytes[base.prefix]) base.prefix ++;
+        return base;
+    }
+    /// the 8 bytes from pos on, big-endian, zero past the end
+    static inline uint64_t window(const ByteKey<N> &key, uint32_t pos)
+    {
+        uint64_t w = 0;
+        for (uint32_t i = 0; i < 8; i ++) {
+            w = (w << 8) | (pos + i < N ? key.bytes[pos + i] : 0);
+        }
+        return w;
+    }
+    static inline double offset(const ByteKey<N> &key, const Base &base)
+    {
+        if (base.prefix > 0) {
+            const int cmp = memcmp(key.bytes, base.key.bytes, base.prefix);
+            if (cmp != 0) return cmp < 0 ? -OUTSIDE : OUTSIDE;
+        }
+        const uint64_t x = window(key, base.prefix);
+        const uint64_t b = window(base.key, base.prefix);
+        return x >= b ? static_cast<double>(x - b) : -static_cast<double>(b - x);
+    }
+    static ByteKey<N> min()
+    {
+        ByteKey<N> key;
+        memset(key.bytes, 0, N);
+        return key;
+    }
+    static ByteKey<N> max()
+    {
+        ByteKey<N> key;
+        memset(key.bytes, 0xff, N);
+        return key;
+    }
+};
 
 // Linear regression model
 template <class T>
 class LinearModel
 {
 public:
+    typedef KeyTraits<T> Traits;
+    typedef typename Traits::Base Base;
+
+    // a * offset(key, base) + c, in double: offsets are small for the keys
+    // of the node, so this rounds to a slot fraction of 2^-52 and
+    // vectorizes
     double a = 0; // slope
-    long double b = 0; // intercept
+    Base base{};
+    double c = 0; // position of the base key
 
     LinearModel() = default;
-    LinearModel(double a, long double b) : a(a), b(b) {}
-    explicit LinearModel(const LinearModel &other) : a(other.a), b(other.b) {}
+    explicit LinearModel(const LinearModel &other) = default;
+    LinearModel &operator=(const LinearModel &other) = default;
+
+    /// key's offset from base, what a and c apply to
+    inline double offset(const T &key) const
+    {
+        return Traits::offset(key, base);
+    }
 
-    inline int predict(T key) const
+    inline int predict(const T &key) const
     {
-        return std::floor(a * static_cast<long double>(key) + b);
+        return std::floor(predict_double(key));
     }
 
-    inline double predict_double(T key) const
+    /// fma ties the rounding down, the SIMD kernels compute the same value
+    inline double predict_double(const T &key) const
     {
-        return a * static_cast<long double>(key) + b;
+        return std::fma(a, offset(key), c);
     }
 };
 
@@ -0,0 +1,408 @@
+#ifndef __PARTITIONED_LIPP_H__
+#define __PARTITIONED_LIPP_H__
+
+#include "lipp.h"
+#include <pthread.h>
+#include <shared_mutex>
+
+/// Range-partitioned front-end over independent LIPPs, so a burst of
+/// inserts rebuilds subtrees of one partition without holding up the
+/// others, and each partition can be owned by one writer thread.
+///
+/// A key is routed with a LinearModel fitted to the CDF of the partition
+/// boundaries: the model picks one of SLOTS_PER_PARTITION slots per
+/// partition, a slot names the first partition its keys can be in, and
+/// the boundaries of the few partitions starting inside the slot settle it.
+/// Lookups and scans take no lock. Writers share-lock their partition,
+/// which rebalance() locks exclusively while it splits or merges it, so
+/// rebalancing runs online and only the writers of the partitions it
+/// replaces wait. Retired routings and partitions are freed through the
+/// LIPPs' epoch based reclamation.
+///
+/// With start_delegation(), writes are handed to owner threads instead:
+/// each partition belongs to one owner, writers push their request onto
+/// the owner's lock-free queue and wait for it to be applied, so the tree
+/// of a partition is written by one thread at a time.
+template<class T, class P, bool USE_FMCD = true, class Policy = LIPPPolicy<>>
+class PartitionedLIPP
+{
+public:
+    typedef LIPP<T, P, USE_FMCD, Policy> Index;
+    typedef std::pair<T, P> V;
+
+    static constexpr int SLOTS_PER_PARTITION = 64;
+
+    /// bulk_load() splits the keys into num_partitions partitions, and
+    /// rebalance() keeps their sizes near an even share of that many
+    explicit PartitionedLIPP(int num_partitions = 1) : target_partitions(num_partitions) {
+        RT_ASSERT(num_partitions >= 1);
+        std::vector<Partition*> partitions(1, new Partition());
+        routing = make_routing(std::vector<T>(1, KeyTraits<T>::min()), partitions);
+        // after a LIPP made the node pool, which must outlive the garbage
+        ebr = Index::EpochBasedMemoryReclamationStrategy::getInstance();
+    }
+    ~PartitionedLIPP() {
+        stop_delegation();
+        destroy_routing(routing.load());
+    }
+
+    /// vs sorted by key in asc order, replaces the contents. Must not run
+    /// concurrently with other operations.
+    void bulk_load(const V* vs, int num_keys) {
+        const int num = std::max(1, std::min(target_partitions, num_keys));
+        std::vector<T> lower(num);
+        std::vector<Partition*> partitions(num);
+        lower[0] = KeyTraits<T>::min();
+        for (int i = 0; i < num; i ++) {
+            const int begin = static_cast<int>(static_cast<long long>(num_keys) * i / num);
+            const int end = static_cast<int>(static_cast<long long>(num_keys) * (i + 1) / num);
+            if (i > 0) lower[i] = vs[begin].first;
+            partitions[i] = new Partition();
+            partitions[i]->index.bulk_load(vs + begin, end - begin);
+        }
+        destroy_routing(routing.load());
+        routing = make_routing(lower, partitions);
+    }
+
+    void insert(const V& v) {
+        insert(v.first, v.second);
+    }
+    void insert(const T& key, const P& value) {
+        write(INSERT_OP, key, value);
+    }
+    /// remove key, returns false if it was not present
+    bool erase(const T& key) {
+        return write(ERASE_OP, key, P());
+    }
+    /// overwrite the value of an existing key, returns false if absent
+    bool update(const T& key, const P& value) {
+        return write(UPDATE_OP, key, value);
+    }
+    P at(const T& key, bool skip_existence_check = true) const {
+        EpochGuard guard;
+        const Routing* r = routing.load(std::memory_order_acquire);
+        return r->partitions[route(r, key)]->index.at(key, skip_existence_check);
+    }
+    bool exists(const T& key) const {
+        EpochGuard guard;
+        const Routing* r = routing.load(std::memory_order_acquire);
+        return r->partitions[route(r, key)]->index.exists(key);
+    }
+    /// call callback(key, value) for every key in [lo, hi] in ascending
+    /// order until it returns false
+    template<class F>
+    void range_scan(const T& lo, const T& hi, F callback) const {
+        EpochGuard guard;
+        const Routing* r = routing.load(std::memory_order_acquire);
+        bool more = true;
+        for (int i = route(r, lo), last = route(r, hi); more && i <= last; i ++) {
+            r->partitions[i]->index.range_scan(lo, hi, [&](const T& key, const P& value) {
+                return more = callback(key, value);
+            });
+        }
+    }
+    /// copy at most max_num pairs with key in [lo, hi] into out, returns the
+    /// number of pairs copied
+    size_t range_scan(const T& lo, const T& hi, V* out, size_t max_num) const {
+        size_t num = 0;
+        if (max_num == 0) return 0;
+        range_scan(lo, hi, [&](const T& key, const P& value) {
+            out[num ++] = V(key, value);
+            return num < max_num;
+        });
+        return num;
+    }
+
+    /// keys in all partitions, without stopping writers
+    size_t size() const {
+        EpochGuard guard;
+        size_t sum = 0;
+        for (const Partition* p : routing.load(std::memory_order_acquire)->partitions) sum += p->index.size();
+        return sum;
+    }
+    int num_partitions() const {
+        EpochGuard guard;
+        return static_cast<int>(routing.load(std::memory_order_acquire)->partitions.size());
+    }
+
+    /// Split the largest partition if it holds more than imbalance times an
+    /// even share of the keys, else merge the smallest adjacent pair if
+    /// together they hold less than an even share over imbalance. Runs
+    /// alongside any other operation. Returns false if nothing changed.
+    bool rebalance(double imbalance = 2) {
+        RT_ASSERT(imbalance > 1);
+        std::lock_guard<std::mutex> lock(rebalance_mutex);
+        EpochGuard guard;
+        const Routing* r = routing.load(std::memory_order_acquire);
+        const int num = static_cast<int>(r->partitions.size());
+        std::vector<size_t> sizes(num);
+        size_t total = 0;
+        for (int i = 0; i < num; i ++) {
+            sizes[i] = r->partitions[i]->index.size();
+            total += sizes[i];
+        }
+        const double share = std::max<double>(1, static_cast<double>(total) / target_partitions);
+        const int largest = std::max_element(sizes.begin(), sizes.end()) - sizes.begin();
+        if (sizes[largest] >= 2 && sizes[largest] > imbalance * share) {
+            return replace(r, largest, 1, 2);
+        }
+        int smallest = -1;
+        for (int i = 0; i + 1 < num; i ++) {
+            if (smallest < 0 || sizes[i] + sizes[i + 1] < sizes[smallest] + sizes[smallest + 1]) smallest = i;
+        }
+        if (smallest >= 0 && (sizes[smallest] + sizes[smallest + 1]) * imbalance < share) {
+            return replace(r, smallest, 2, 1);
+        }
+        return false;
+    }
+
+    /// Delegation mode: num_owners threads apply all writes, partition i
+    /// belongs to owner i % num_owners. Owner i runs on cpus[i % cpus.size()]
+    /// if cpus is given. Must not run concurrently with writers.
+    void start_delegation(int num_owners, const std::vector<int>& cpus = {}) {
+        RT_ASSERT(num_owners >= 1);
+        stop_delegation();
+        owners_stop = false;
+        for (int i = 0; i < num_owners; i ++) {
+            owners.emplace_back(new Owner());
+        }
+        for (int i = 0; i < num_owners; i ++) {
+            Owner* owner = owners[i].get();
+            owner->thread = std::thread(&PartitionedLIPP::owner_loop, this, owner);
+            if (!cpus.empty()) {
+                cpu_set_t set;
+                CPU_ZERO(&set);
+                CPU_SET(cpus[i % cpus.size()], &set);
+                pthread_setaffinity_np(owner->thread.native_handle(), sizeof(set), &set);
+            }
+        }
+    }
+    /// back to writers applying their own writes. Must not run concurrently
+    /// with writers.
+    void stop_delegation() {
+        owners_stop = true;
+        for (auto& owner : owners) {
+            owner->thread.join();
+        }
+        owners.clear();
+    }
+
+private:
+    typedef typename Index::EpochGuard EpochGuard;
+    typedef typename Index::EpochBasedMemoryReclamationStrategy Reclamation;
+
+    struct alignas(64) Partition {
+        Index index;
+        std::shared_mutex mutex; // shared by writers, exclusive while rebalance() replaces it
+        std::atomic<bool> retired{false}; // replaced, writers go back to the routing
+    };
+    /// Partitions by key: partition i holds the keys from lower[i] on and
+    /// before lower[i + 1]. The model maps a key to one of slot_partition's
+    /// slots, which holds the first partition keys of that slot can be in.
+    struct Routing {
+        LinearModel<T> model;
+        std::vector<int> slot_partition;
+        std::vector<T> lower; // lower[0] is unused
+        std::vector<Partition*> partitions;
+    };
+
+    enum WriteOp { INSERT_OP, ERASE_OP, UPDATE_OP };
+    // one write handed to an owner, lives on the writer's stack until done
+    struct Request {
+        Request* next;
+        WriteOp op;
+        T key;
+        P value;
+        bool result;
+        std::atomic<bool> done;
+    };
+    // requests are pushed onto head and taken off all at once
+    struct alignas(64) Owner {
+        std::atomic<Request*> head{nullptr};
+        std::thread thread;
+    };
+
+    const int target_partitions;
+    std::atomic<Routing*> routing;
+    std::mutex rebalance_mutex;
+    Reclamation* ebr;
+    std::vector<std::unique_ptr<Owner>> owners;
+    std::atomic<bool> owners_stop{false};
+
+    static int slot_of(const Routing* r, const T& key) {
+        const double v = r->model.predict_double(key);
+        const int num_slots = static_cast<int>(r->slot_partition.size());
+        if (!(v >= 0)) return 0;
+        return v >= num_slots ? num_slots - 1 : static_cast<int>(v);
+    }
+    static int route(const Routing* r, const T& key) {
+        int i = r->slot_partition[slot_of(r, key)];
+        const int num = static_cast<int>(r->partitions.size());
+        while (i + 1 < num && !(key < r->lower[i + 1])) i ++;
+        return i;
+    }
+
+    /// routing over partitions, fitting the model to put boundary i near
+    /// slot i * SLOTS_PER_PARTITION
+    static Routing* make_routing(const std::vector<T>& lower, const std::vector<Partition*>& partitions) {
+        Routing* r = new Routing();
+        r->lower = lower;
+        r->partitions = partitions;
+        const int num = static_cast<int>(partitions.size());
+        // least squares over the boundaries lower[1..num-1]
+        if (num > 2) {
+            r->model.base = KeyTraits<T>::make_base(lower[1], lower[num - 1]);
+            long double sx = 0, sy = 0, sxx = 0, sxy = 0;
+            for (int i = 1; i < num; i ++) {
+                const long double x = r->model.offset(lower[i]);
+                const long double y = static_cast<long double>(i) * SLOTS_PER_PARTITION;
+                sx += x;
+                sy += y;
+                sxx += x * x;
+                sxy += x * y;
+            }
+            const long double n = num - 1;
+            const long double var = sxx - sx * sx / n;
+            // monotone for sorted boundaries, up to rounding
+            const long double a = var > 0 ? std::max<long double>(0, (sxy - sx * sy / n) / var) : 0;
+            r->model.a = static_cast<double>(a);
+            r->model.c = static_cast<double>((sy - a * sx) / n);
+        }
+        // a slot's first partition is the last one starting in an earlier
+        // slot, the model being monotone
+        r->slot_partition.resize(static_cast<size_t>(num) * SLOTS_PER_PARTITION);
+        int i = 0;
+        for (int s = 0; s < static_cast<int>(r->slot_partition.size()); s ++) {
+            while (i + 1 < num && slot_of(r, lower[i + 1]) < s) i ++;
+            r->slot_partition[s] = i;
+        }
+        return r;
+    }
+
+    static void delete_partition(void* p) {
+        delete static_cast<Partition*>(p);
+    }
+    static void delete_routing(void* r) {
+        delete static_cast<Routing*>(r);
+    }
+    static void destroy_routing(Routing* r) {
+        for (Partition* p : r->partitions) delete p;
+        delete r;
+    }
+
+    /// Replace the count partitions from first of r by num_new ones holding
+    /// the same keys, splitting them evenly. Their writers wait meanwhile,
+    /// lookups go on reading the old ones until the new routing is out.
+    bool replace(const Routing* r, int first, int count, int num_new) {
+        std::vector<std::unique_lock<std::shared_mutex>> locks;
+        std::vector<V> pairs;
+        for (int i = first; i < first + count; i ++) {
+            locks.emplace_back(r->partitions[i]->mutex);
+            r->partitions[i]->index.range_scan(KeyTraits<T>::min(), KeyTraits<T>::max(),
+                                               [&](const T& key, const P& value) {
+                pairs.emplace_back(key, value);
+                return true;
+            });
+        }
+        // a split needs a key per half, a merge may leave one empty partition
+        if (num_new > 1 && static_cast<int>(pairs.size()) < num_new) return false;
+
+        std::vector<T> lower(r->lower.begin(), r->lower.begin() + first);
+        std::vector<Partition*> partitions(r->partitions.begin(), r->partitions.begin() + first);
+        for (int j = 0; j < num_new; j ++) {
+            const size_t begin = pairs.size() * j / num_new;
+            const size_t end = pairs.size() * (j + 1) / num_new;
+            lower.push_back(j == 0 ? r->lower[first] : pairs[begin].first);
+            partitions.push_back(new Partition());
+            partitions.back()->index.bulk_load(pairs.data() + begin, static_cast<int>(end - begin));
+        }
+        lower.insert(lower.end(), r->lower.begin() + first + count, r->lower.end());
+        partitions.insert(partitions.end(), r->partitions.begin() + first + count, r->partitions.end());
+
+        routing.store(make_routing(lower, partitions), std::memory_order_release);
+        for (int i = first; i < first + count; i ++) {
+            r->partitions[i]->retired.store(true, std::memory_order_relaxed);
+        }
+        locks.clear();
+        for (int i = first; i < first + count; i ++) {
+            Partition* p = r->partitions[i];
+            ebr->scheduleForDeletion(std::make_pair((void *)p, delete_partition), sizeof(Partition));
+        }
+        ebr->scheduleForDeletion(std::make_pair((void *)r, delete_routing), sizeof(Routing));
+        return true;
+    }
+
+    /// apply a write to the partition of key, in the calling thread
+    bool apply(WriteOp op, const T& key, const P& value) {
+        EpochGuard guard;
+        for (int restartCount = 0; ; ) {
+            const Routing* r = routing.load(std::memory_order_acquire);
+            Partition* p = r->partitions[route(r, key)];
+            std::shared_lock<std::shared_mutex> lock(p->mutex);
+            if (!p->retired.load(std::memory_order_relaxed)) {
+                switch (op) {
+                case INSERT_OP:
+                    p->index.insert(key, value);
+                    return true;
+                case ERASE_OP:
+                    return p->index.erase(key);
+                case UPDATE_OP:
+                    return p->index.update(key, value);
+                }
+            }
+            lock.unlock();
+            yield(++ restartCount);
+        }
+    }
+    /// apply a write, through the owner of its partition in delegation mode
+    bool write(WriteOp op, const T& key, const P& value) {
+        if (owners.empty()) return apply(op, key, value);
+        Owner* owner;
+        {
+            EpochGuard guard;
+            const Routing* r = routing.load(std::memory_order_acquire);
+            owner = owners[route(r, key) % owners.size()].get();
+        }
+        Request request;
+        request.op = op;
+        request.key = key;
+        request.value = value;
+        request.done.store(false, std::memory_order_relaxed);
+        request.next = owner->head.load(std::memory_order_relaxed);
+        while (!owner->head.compare_exchange_weak(request.next, &request, std::memory_order_release,
+                                                  std::memory_order_relaxed)) {}
+        for (int count = 0; !request.done.load(std::memory_order_acquire); ) {
+            yield(++ count);
+        }
+        return request.result;
+    }
+    void owner_loop(Owner* owner) {
+        for (int idle = 0; ; ) {
+            Request* list = owner->head.exchange(nullptr, std::memory_order_acquire);
+            if (!list) {
+                if (owners_stop.load(std::memory_order_relaxed)) return;
+                yield(++ idle);
+                continue;
+            }
+            idle = 0;
+            // pushed newest first
+            Request* ordered = nullptr;
+            while (list) {
+                Request* next = list->next;
+                list->next = ordered;
+                ordered = list;
+                list = next;
+            }
+            typename Index::EpochBatch batch;
+            while (ordered) {
+                // the writer may return as soon as done is set
+                Request* next = ordered->next;
+                ordered->result = apply(ordered->op, ordered->key, ordered->value);
+                ordered->done.store(true, std::memory_order_release);
+                ordered = next;
+            }
+        }
+    }
+};
+
+#endif // __PARTITIONED_LIPP_H__
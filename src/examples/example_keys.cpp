@@ -0,0 +1,86 @@
+#include <lipp.h>
+#include <iostream>
+#include <map>
+#include <random>
+
+using namespace std;
+
+// Round-trips LIPP over keys other than arithmetic types against std::map:
+// bulk load, inserts, replacing inserts, erases, lookups, a full range scan
+// and verify().
+template<class T>
+void round_trip(const char* name, vector<T> keys)
+{
+    mt19937_64 gen(42);
+    map<T, uint64_t> expected;
+    for (size_t i = 0; i < keys.size(); i ++) {
+        expected[keys[i]] = i;
+    }
+
+    vector<pair<T, uint64_t>> sorted(expected.begin(), expected.end());
+    vector<pair<T, uint64_t>> loaded, inserted;
+    for (size_t i = 0; i < sorted.size(); i ++) {
+        (i % 2 ? inserted : loaded).push_back(sorted[i]);
+    }
+
+    LIPP<T, uint64_t> lipp;
+    lipp.bulk_load(loaded.data(), loaded.size());
+    shuffle(inserted.begin(), inserted.end(), gen);
+    for (auto& kv : inserted) {
+        lipp.insert(kv.first, kv.second);
+    }
+    // already present, the value is replaced
+    for (size_t i = 0; i < sorted.size(); i += 7) {
+        expected[sorted[i].first] = i + sorted.size();
+        lipp.insert(sorted[i].first, i + sorted.size());
+    }
+    for (size_t i = 0; i < sorted.size(); i += 3) {
+        RT_ASSERT(lipp.erase(sorted[i].first));
+        expected.erase(sorted[i].first);
+    }
+
+    RT_ASSERT(lipp.size() == expected.size());
+    for (size_t i = 0; i < sorted.size(); i ++) {
+        auto it = expected.find(sorted[i].first);
+        RT_ASSERT(lipp.exists(sorted[i].first) == (it != expected.end()));
+        if (it != expected.end()) RT_ASSERT(lipp.at(sorted[i].first) == it->second);
+    }
+    auto it = expected.begin();
+    lipp.range_scan(KeyTraits<T>::min(), KeyTraits<T>::max(), [&](const T& key, const uint64_t& value) {
+        RT_ASSERT(it != expected.end() && it->first == key && it->second == value);
+        ++ it;
+        return true;
+    });
+    RT_ASSERT(it == expected.end());
+    lipp.verify();
+
+    cout << name << ": " << expected.size() << " keys ok" << endl;
+}
+
+int main()
+{
+    mt19937_64 gen(7);
+
+    // A handful of distinct first halves: keys sharing one agree in the 8
+    // bytes after the common prefix of the root, collide there and go into
+    // a child that tells them apart by the second half.
+    vector<ByteKey<16>> byte_keys;
+    for (int i = 0; i < 20000; i ++) {
+        byte_keys.push_back(ByteKey<16>::from_uint(0x0102030400000000ull + gen() % 8, gen()));
+    }
+    // and strings shorter than the key, zero padded
+    for (int i = 0; i < 2000; i ++) {
+        byte_keys.push_back(ByteKey<16>::from_string("user" + to_string(gen() % 100000)));
+    }
+    round_trip("ByteKey<16>", byte_keys);
+
+    // (tenant, timestamp) packed into 128 bits, tenants on both sides of 0
+    vector<__int128> int128_keys;
+    for (int i = 0; i < 20000; i ++) {
+        const __int128 tenant = static_cast<__int128>(static_cast<int64_t>(gen() % 16) - 8);
+        int128_keys.push_back(tenant * (static_cast<__int128>(1) << 64) + static_cast<__int128>(gen() >> 1));
+    }
+    round_trip("__int128", int128_keys);
+
+    return 0;
+}
@@ -0,0 +1,146 @@
+#include <partitioned_lipp.h>
+#include <iostream>
+#include <map>
+#include <random>
+#include <thread>
+
+using namespace std;
+
+typedef PartitionedLIPP<uint64_t, uint64_t> Index;
+
+// Every key of expected is found with its value, the full scan and a scan
+// of a few ranges that cross partition boundaries return exactly them.
+void check(const Index& index, const map<uint64_t, uint64_t>& expected)
+{
+    RT_ASSERT(index.size() == expected.size());
+    for (auto& kv : expected) {
+        RT_ASSERT(index.exists(kv.first));
+        RT_ASSERT(index.at(kv.first) == kv.second);
+    }
+    auto it = expected.begin();
+    index.range_scan(0, numeric_limits<uint64_t>::max(), [&](const uint64_t& key, const uint64_t& value) {
+        RT_ASSERT(it != expected.end() && it->first == key && it->second == value);
+        ++ it;
+        return true;
+    });
+    RT_ASSERT(it == expected.end());
+
+    mt19937_64 gen(3);
+    vector<pair<uint64_t, uint64_t>> out(100);
+    for (int i = 0; i < 100; i ++) {
+        const uint64_t lo = gen() >> 20;
+        const uint64_t hi = lo + (gen() >> 24);
+        const size_t num = index.range_scan(lo, hi, out.data(), out.size());
+        auto e = expected.lower_bound(lo);
+        for (size_t j = 0; j < num; j ++, ++ e) {
+            RT_ASSERT(e != expected.end() && e->first == out[j].first && e->second == out[j].second);
+        }
+        RT_ASSERT(num == out.size() || e == expected.end() || e->first > hi);
+    }
+}
+
+int main()
+{
+    mt19937_64 gen(42);
+    map<uint64_t, uint64_t> expected;
+    while (expected.size() < 20000) {
+        const uint64_t key = gen() >> 20;
+        expected[key] = key * 3;
+    }
+    vector<pair<uint64_t, uint64_t>> sorted(expected.begin(), expected.end());
+
+    // routing: keys below the first boundary, on boundaries, between and
+    // past the last one each reach the partition holding them
+    Index index(8);
+    index.bulk_load(sorted.data(), sorted.size());
+    RT_ASSERT(index.num_partitions() == 8);
+    for (size_t i = 0; i < sorted.size(); i += 5) {
+        expected[sorted[i].first] = i;
+        index.insert(sorted[i].first, i);
+    }
+    for (size_t i = 0; i < sorted.size(); i += 7) {
+        RT_ASSERT(index.erase(sorted[i].first));
+        RT_ASSERT(!index.erase(sorted[i].first));
+        RT_ASSERT(!index.update(sorted[i].first, 0));
+        expected.erase(sorted[i].first);
+    }
+    for (uint64_t key : {uint64_t(0), uint64_t(1), numeric_limits<uint64_t>::max()}) {
+        index.insert(key, key);
+        expected[key] = key;
+    }
+    check(index, expected);
+    cout << "routing: " << expected.size() << " keys ok" << endl;
+
+    // rebalance: a burst of keys into one range splits its partition, and
+    // erasing them again merges partitions back. Each call splits one
+    // partition or merges two, the partitions left small by a split may
+    // merge already.
+    int splits = 0, merges = 0;
+    auto rebalance_all = [&] {
+        for (int num = index.num_partitions(); index.rebalance(); num = index.num_partitions()) {
+            RT_ASSERT(abs(index.num_partitions() - num) == 1);
+            (index.num_partitions() > num ? splits : merges) ++;
+        }
+    };
+    vector<uint64_t> burst;
+    for (uint64_t i = 0; i < 60000; i ++) {
+        burst.push_back((1ull << 43) + i * 16 + 1);
+        index.insert(burst.back(), i);
+        expected[burst.back()] = i;
+    }
+    rebalance_all();
+    RT_ASSERT(splits > 0);
+    check(index, expected);
+    for (uint64_t key : burst) {
+        RT_ASSERT(index.erase(key));
+        expected.erase(key);
+    }
+    const int merges_before = merges;
+    rebalance_all();
+    RT_ASSERT(merges > merges_before);
+    check(index, expected);
+    cout << "rebalance: " << splits << " splits, " << merges << " merges, " << index.num_partitions()
+         << " partitions ok" << endl;
+
+    // delegation: writer threads hand their writes to two owners while
+    // rebalance() splits and merges under them, and write themselves again
+    // once it stops
+    constexpr int NUM_WRITERS = 4;
+    constexpr uint64_t KEYS_PER_WRITER = 5000;
+    for (int round = 0; round < 2; round ++) {
+        if (round == 0) index.start_delegation(2);
+        atomic<bool> writing{true};
+        thread rebalancer([&] {
+            while (writing.load()) {
+                if (!index.rebalance(1.5)) this_thread::yield();
+            }
+        });
+        vector<thread> writers;
+        for (int t = 0; t < NUM_WRITERS; t ++) {
+            writers.emplace_back([&index, t, round] {
+                // keys of a writer are its own, odd ones are erased again
+                for (uint64_t i = 0; i < KEYS_PER_WRITER; i ++) {
+                    const uint64_t key = (1ull << 44) + (i * NUM_WRITERS + t) * 2 + round;
+                    index.insert(key, i);
+                    RT_ASSERT(index.update(key, i + 1));
+                    if (i % 2) RT_ASSERT(index.erase(key));
+                }
+            });
+        }
+        for (auto& writer : writers) writer.join();
+        writing = false;
+        rebalancer.join();
+        if (round == 0) index.stop_delegation();
+
+        for (uint64_t i = 0; i < KEYS_PER_WRITER; i += 2) {
+            for (int t = 0; t < NUM_WRITERS; t ++) {
+                expected[(1ull << 44) + (i * NUM_WRITERS + t) * 2 + round] = i + 1;
+            }
+        }
+        check(index, expected);
+        cout << (round == 0 ? "delegated" : "direct") << " writes: " << index.num_partitions()
+             << " partitions, " << expected.size() << " keys ok" << endl;
+    }
+
+    return 0;
+}
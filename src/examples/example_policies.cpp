@@ -0,0 +1,117 @@
+#include <lipp.h>
+#include <iostream>
+#include <map>
+#include <random>
+
+using namespace std;
+
+// Round-trips one LIPP instantiation against std::map: bulk load, inserts,
+// replacing inserts, erases, lookups, a full range scan and verify().
+template<class Index, class P>
+void round_trip(const char* name)
+{
+    mt19937_64 gen(42);
+    map<uint64_t, P> expected;
+    while (expected.size() < 20000) {
+        const uint64_t key = gen() >> 16;
+        expected[key] = static_cast<P>(key * 3);
+    }
+
+    vector<pair<uint64_t, P>> sorted(expected.begin(), expected.end());
+    vector<pair<uint64_t, P>> loaded, inserted;
+    for (size_t i = 0; i < sorted.size(); i ++) {
+        (i % 2 ? inserted : loaded).push_back(sorted[i]);
+    }
+
+    Index lipp;
+    lipp.bulk_load(loaded.data(), loaded.size());
+    shuffle(inserted.begin(), inserted.end(), gen);
+    for (auto& kv : inserted) {
+        lipp.insert(kv.first, kv.second);
+    }
+    // already present, the value is replaced
+    for (size_t i = 0; i < sorted.size(); i += 7) {
+        expected[sorted[i].first] = static_cast<P>(i);
+        lipp.insert(sorted[i].first, static_cast<P>(i));
+    }
+    for (size_t i = 0; i < sorted.size(); i += 3) {
+        RT_ASSERT(lipp.erase(sorted[i].first));
+        RT_ASSERT(!lipp.erase(sorted[i].first));
+        expected.erase(sorted[i].first);
+    }
+
+    RT_ASSERT(lipp.size() == expected.size());
+    for (size_t i = 0; i < sorted.size(); i ++) {
+        auto it = expected.find(sorted[i].first);
+        RT_ASSERT(lipp.exists(sorted[i].first) == (it != expected.end()));
+        if (it != expected.end()) RT_ASSERT(lipp.at(sorted[i].first) == it->second);
+    }
+    auto it = expected.begin();
+    lipp.range_scan(0, numeric_limits<uint64_t>::max(), [&](const uint64_t& key, const P& value) {
+        RT_ASSERT(it != expected.end() && it->first == key && it->second == value);
+        ++ it;
+        return true;
+    });
+    RT_ASSERT(it == expected.end());
+    lipp.verify();
+
+    cout << name << ": " << expected.size() << " keys ok" << endl;
+}
+
+// Appends past the end of a loaded index: a dense run the root grows to
+// cover, then a sparse tail reaching far past any width the root may grow
+// to, and replacing appends.
+void append_tail()
+{
+    map<uint64_t, uint64_t> expected;
+    vector<pair<uint64_t, uint64_t>> loaded;
+    for (uint64_t i = 0; i < 1000; i ++) {
+        loaded.emplace_back(i * 10, i);
+        expected[i * 10] = i;
+    }
+    LIPP<uint64_t, uint64_t> lipp;
+    lipp.bulk_load(loaded.data(), loaded.size());
+
+    vector<vector<pair<uint64_t, uint64_t>>> runs(4);
+    for (uint64_t i = 1000; i < 1500; i ++) {
+        runs[0].emplace_back(i * 10, i);
+    }
+    runs[1] = {{20000, 1}, {1ull << 40, 2}};
+    for (uint64_t i = 1; i <= 100; i ++) {
+        runs[2].emplace_back((1ull << 40) + i * (1ull << 30), i);
+    }
+    runs[3] = {{50, 3}, {14990, 4}, {1ull << 40, 5}, {1ull << 62, 6}};
+    for (auto& run : runs) {
+        lipp.append(run.data(), run.size());
+        for (auto& kv : run) expected[kv.first] = kv.second;
+    }
+
+    RT_ASSERT(lipp.size() == expected.size());
+    for (auto& kv : expected) {
+        RT_ASSERT(lipp.exists(kv.first));
+        RT_ASSERT(lipp.at(kv.first) == kv.second);
+    }
+    auto it = expected.begin();
+    lipp.range_scan(0, numeric_limits<uint64_t>::max(), [&](const uint64_t& key, const uint64_t& value) {
+        RT_ASSERT(it != expected.end() && it->first == key && it->second == value);
+        ++ it;
+        return true;
+    });
+    RT_ASSERT(it == expected.end());
+    lipp.verify();
+
+    cout << "append with a far tail: " << expected.size() << " keys ok" << endl;
+}
+
+int main()
+{
+    // single-threaded index, no lock words touched
+    round_trip<LIPP<uint64_t, uint64_t, true, LIPPPolicy<uint8_t, NoLock>>, uint64_t>("uint8_t bitmap, NoLock");
+    // one bitmap word covers 64 slots
+    round_trip<LIPP<uint64_t, uint64_t, true, LIPPPolicy<uint64_t>>, uint64_t>("uint64_t bitmap");
+    // payloads apart from the keys, 4 bytes each
+    round_trip<LIPP<uint64_t, uint32_t, true, LIPPPolicy<uint8_t, OptLock, true>>, uint32_t>("SoA slots");
+    append_tail();
+
+    return 0;
+}